@@ -40,6 +40,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef HAVE_SYS_STAT_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
 /* I guess "rb" should be right for any libc */
 #define OPEN_MODE "rb"
 
@@ -47,16 +52,14 @@
 #include "common.h"
 #include "ospaths.h"
 
-/* The paths in this list will be tried by timi_openfile() */
+/* The paths in the list of a context will be tried by timi_openfile() */
 struct _PathList {
     char *path;
     struct _PathList *next;
 };
 
-static PathList *pathlist = NULL;
-
 /* This is meant to find and open files for reading */
-FILE *timi_openfile(const char *name)
+FILE *timi_openfile(MidContext *ctx, const char *name)
 {
     FILE *fp;
 
@@ -72,7 +75,7 @@ FILE *timi_openfile(const char *name)
 
     if (!is_abspath(name)) {
         char current_filename[TIM_MAXPATH];
-        PathList *plp = pathlist;
+        PathList *plp = ctx->pathlist;
         char *p;
         size_t l;
 
@@ -102,8 +105,26 @@ FILE *timi_openfile(const char *name)
     return NULL;
 }
 
+/* This tells an open file from a changed or replaced one by its size
+   and modification time, or gives zeros where they can't be had */
+void timi_filestamp(FILE *fp, long *size, long *mtime)
+{
+#ifdef HAVE_SYS_STAT_H
+    struct stat st;
+
+    if (fstat(fileno(fp), &st) == 0) {
+        *size = (long) st.st_size;
+        *mtime = (long) st.st_mtime;
+        return;
+    }
+#else
+    TIMI_UNUSED(fp);
+#endif
+    *size = *mtime = 0;
+}
+
 /* This adds a directory to the path list */
-int timi_add_pathlist(const char *s, size_t l)
+int timi_add_pathlist(MidContext *ctx, const char *s, size_t l)
 {
     PathList *plp = (PathList *) timi_malloc(sizeof(PathList));
     if (!plp) return -2;
@@ -112,16 +133,16 @@ int timi_add_pathlist(const char *s, size_t l)
         timi_free (plp);
         return -2;
     }
-    plp->next = pathlist;
-    pathlist = plp;
+    plp->next = ctx->pathlist;
+    ctx->pathlist = plp;
     memcpy(plp->path, s, l);
     plp->path[l] = 0;
     return 0;
 }
 
-void timi_free_pathlist(void)
+void timi_free_pathlist(MidContext *ctx)
 {
-    PathList *plp = pathlist;
+    PathList *plp = ctx->pathlist;
     PathList *next;
 
     while (plp) {
@@ -130,7 +151,7 @@ void timi_free_pathlist(void)
         timi_free(plp);
         plp = next;
     }
-    pathlist = NULL;
+    ctx->pathlist = NULL;
 }
 
 char *timi_strdup(const char *str)
@@ -31,12 +31,13 @@
 #ifndef TIMIDITY_COMMON_H
 #define TIMIDITY_COMMON_H
 
-extern FILE *timi_openfile(const char *name);
+extern FILE *timi_openfile(MidContext *ctx, const char *name);
+extern void timi_filestamp(FILE *fp, long *size, long *mtime);
 
-/* pathlist funcs only to be used during mid_init/mid_exit */
+/* pathlist funcs only to be used while setting up or freeing a context */
 typedef struct _PathList PathList;
-extern int  timi_add_pathlist(const char *s, size_t len);
-extern void timi_free_pathlist(void);
+extern int  timi_add_pathlist(MidContext *ctx, const char *s, size_t len);
+extern void timi_free_pathlist(MidContext *ctx);
 
 /* in case someone wants to compile with a different malloc() than stdlib */
 #define timi_malloc  malloc
@@ -46,6 +47,44 @@ extern void timi_free_pathlist(void);
 
 char *timi_strdup(const char *str);
 
+/* threads, if we have them: otherwise the locks do nothing and no
+ * thread can be created, so that callers fall back to serial code. */
+#ifdef TIMIDITY_THREADS
+#include <pthread.h>
+typedef pthread_mutex_t timi_mutex;
+typedef pthread_cond_t  timi_cond;
+typedef pthread_t       timi_thread;
+#define TIMI_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define timi_mutex_init(m)     pthread_mutex_init((m), NULL)
+#define timi_mutex_destroy(m)  pthread_mutex_destroy((m))
+#define timi_mutex_lock(m)     pthread_mutex_lock((m))
+#define timi_mutex_unlock(m)   pthread_mutex_unlock((m))
+#define timi_cond_init(c)      pthread_cond_init((c), NULL)
+#define timi_cond_destroy(c)   pthread_cond_destroy((c))
+#define timi_cond_wait(c,m)    pthread_cond_wait((c), (m))
+#define timi_cond_signal(c)    pthread_cond_signal((c))
+#define timi_cond_broadcast(c) pthread_cond_broadcast((c))
+/* fn is a void *(*)(void *): evaluates to 0 on success */
+#define timi_thread_create(t,fn,arg) pthread_create((t), NULL, (fn), (arg))
+#define timi_thread_join(t)    pthread_join((t), NULL)
+#else
+typedef int timi_mutex;
+typedef int timi_cond;
+typedef int timi_thread;
+#define TIMI_MUTEX_INITIALIZER 0
+#define timi_mutex_init(m)     (*(m) = 0)
+#define timi_mutex_destroy(m)  ((void)(m))
+#define timi_mutex_lock(m)     ((void)(m))
+#define timi_mutex_unlock(m)   ((void)(m))
+#define timi_cond_init(c)      (*(c) = 0)
+#define timi_cond_destroy(c)   ((void)(c))
+#define timi_cond_wait(c,m)    ((void)(c))
+#define timi_cond_signal(c)    ((void)(c))
+#define timi_cond_broadcast(c) ((void)(c))
+#define timi_thread_create(t,fn,arg) ((void)(t), (void)(fn), (void)(arg), -1)
+#define timi_thread_join(t)    ((void)(t))
+#endif
+
 /* timi_strtokr() is a strtok_r() replacement */
 char *timi_strtokr(char *s1, const char *s2, char **ptr);
 
@@ -44,11 +44,66 @@
 #include "timidity_internal.h"
 #include "common.h"
 #include "instrum.h"
+#include "playmidi.h"
 #include "sndfont.h"
 #include "resample.h"
 #include "tables.h"
 
-static void free_instrument(MidInstrument *ip)
+/* instruments may be loaded by several threads at once: this guards
+   the instrument cache and the reference counts of shared data. */
+static timi_mutex cache_lock = TIMI_MUTEX_INITIALIZER;
+
+void hold_data_ref(MidDataRef *ref)
+{
+  timi_mutex_lock(&cache_lock);
+  ref->refcount++;
+  timi_mutex_unlock(&cache_lock);
+}
+
+void drop_data_ref(MidDataRef *ref)
+{
+  int n;
+  timi_mutex_lock(&cache_lock);
+  n = --ref->refcount;
+  timi_mutex_unlock(&cache_lock);
+  if (n == 0)
+    ref->release(ref);
+}
+
+/* for tables looking up data nobody holds for them: data whose last
+   reference is gone already is about to be released, so isn't taken. */
+int hold_live_data_ref(MidDataRef *ref)
+{
+  int n;
+  timi_mutex_lock(&cache_lock);
+  if ((n = ref->refcount) > 0)
+    ref->refcount++;
+  timi_mutex_unlock(&cache_lock);
+  return n > 0;
+}
+
+int data_ref_count(MidDataRef *ref)
+{
+  int n;
+  timi_mutex_lock(&cache_lock);
+  n = ref->refcount;
+  timi_mutex_unlock(&cache_lock);
+  return n;
+}
+
+void free_sample_data(MidSample *sp)
+{
+  if (sp->data_ref)
+    {
+      drop_data_ref(sp->data_ref);
+      sp->data_ref = NULL;
+    }
+  else
+    timi_free(sp->data);
+  sp->data = NULL;
+}
+
+void free_instrument(MidInstrument *ip)
 {
   MidSample *sp;
   int i;
@@ -56,22 +111,314 @@ static void free_instrument(MidInstrument *ip)
   if (ip->sample) {
     for (i=0; i<ip->samples; i++) {
       sp=&(ip->sample[i]);
-      timi_free(sp->data);
+      free_sample_data(sp);
     }
     timi_free(ip->sample);
   }
   timi_free(ip);
 }
 
+/* The instrument cache: Instruments are never modified once loaded, so
+   songs which ask for the same instrument with the same parameters at
+   the same output rate share a single copy. Each entry counts the bank
+   slots referring to it. Unreferenced entries are kept until they are
+   purged, so that loading another song with the same instruments costs
+   nothing, or until the sample memory of the cache goes over the budget:
+   then the ones unused for the longest time are freed first. */
+
+#define INST_CACHE_SIZE 256
+
+typedef struct _MidInstCache MidInstCache;
+struct _MidInstCache
+{
+  MidInstKey key;
+  MidInstrument *ip;
+  int refcount;
+  size_t bytes;		/* the sample memory of ip */
+  MidInstCache *next;
+  MidInstCache *lru_prev, *lru_next;	/* while refcount is 0 */
+};
+
+static MidInstCache *inst_cache[INST_CACHE_SIZE];
+
+/* the unused entries, least recently used first */
+static MidInstCache *lru_head, *lru_tail;
+
+static size_t cache_bytes;	/* the sample memory of the cached instruments */
+static size_t cache_peak;	/* the most cache_bytes has been */
+static size_t cache_budget;	/* 0 for no limit */
+
+static int evict_instruments(void);
+
+static void lru_append(MidInstCache *p)
+{
+  p->lru_next = NULL;
+  p->lru_prev = lru_tail;
+  if (lru_tail)
+    lru_tail->lru_next = p;
+  else
+    lru_head = p;
+  lru_tail = p;
+}
+
+static void lru_remove(MidInstCache *p)
+{
+  if (p->lru_prev)
+    p->lru_prev->lru_next = p->lru_next;
+  else
+    lru_head = p->lru_next;
+  if (p->lru_next)
+    p->lru_next->lru_prev = p->lru_prev;
+  else
+    lru_tail = p->lru_prev;
+  p->lru_prev = p->lru_next = NULL;
+}
+
+/* Sample data shared with other instruments counts for each of them,
+   data mapped from the font file for none. */
+static size_t instrument_size(MidInstrument *ip)
+{
+  size_t n = ip->samples * sizeof(MidSample);
+  MidSample *sp;
+  int i;
+  for (i = 0, sp = ip->sample; i < ip->samples; i++, sp++)
+    {
+      if (sp->data_ref)
+	n += sp->data_ref->bytes;
+      else if (sp->data)
+	n += (size_t) (sp->data_length >> FRACTION_BITS) <<
+	     ((sp->modes & MODES_16BIT) ? 1 : 0);
+    }
+  return n;
+}
+
+static unsigned int hash_inst_key(const MidInstKey *key)
+{
+  const unsigned char *p = (const unsigned char *) key->name;
+  unsigned int h = (unsigned int) key->type;
+  if (p)
+    while (*p)
+      h = h * 31 + *p++;
+  h = h * 31 + (unsigned int) key->bank;
+  h = h * 31 + (unsigned int) key->preset;
+  h = h * 31 + (unsigned int) key->keynote;
+  h = h * 31 + (unsigned int) key->note_to_use;
+  h = h * 31 + (unsigned int) key->fsize;
+  h ^= (unsigned int) key->mtime;
+  h ^= (unsigned int) key->rate;
+  return (h ^ (h >> 8)) % INST_CACHE_SIZE;
+}
+
+static int same_inst_key(const MidInstKey *a, const MidInstKey *b)
+{
+  if (a->type != b->type || a->context != b->context ||
+      a->fsize != b->fsize || a->mtime != b->mtime ||
+      a->bank != b->bank || a->preset != b->preset ||
+      a->keynote != b->keynote || a->order != b->order ||
+      a->panning != b->panning || a->amp != b->amp ||
+      a->note_to_use != b->note_to_use ||
+      a->strip_loop != b->strip_loop ||
+      a->strip_envelope != b->strip_envelope ||
+      a->strip_tail != b->strip_tail ||
+      a->rate != b->rate || a->control_ratio != b->control_ratio)
+    return 0;
+  if (!a->name || !b->name)
+    return (a->name == b->name);
+  return !strcmp(a->name, b->name);
+}
+
+static MidInstrument *lookup_instrument(const MidInstKey *key, unsigned int h)
+{
+  MidInstCache *p;
+  for (p = inst_cache[h]; p; p = p->next)
+    {
+      if (same_inst_key(&p->key, key))
+	{
+	  if (p->refcount++ == 0)
+	    lru_remove(p);
+	  return p->ip;
+	}
+    }
+  return NULL;
+}
+
+/* Returns a new reference to a cached instrument, or NULL. */
+MidInstrument *find_instrument(const MidInstKey *key)
+{
+  MidInstrument *ip;
+  timi_mutex_lock(&cache_lock);
+  ip = lookup_instrument(key, hash_inst_key(key));
+  timi_mutex_unlock(&cache_lock);
+  return ip;
+}
+
+/* Adds a freshly loaded instrument to the cache, with one reference
+   held by the caller. If another thread got there first, ours is freed
+   and the cached one returned instead. If we can't cache it, it is
+   simply returned uncached and will be freed when released. */
+MidInstrument *cache_instrument(const MidInstKey *key, MidInstrument *ip)
+{
+  MidInstCache *p;
+  MidInstrument *cached;
+  unsigned int h;
+
+  if (!ip) return NULL;
+  p = (MidInstCache *) timi_calloc(1, sizeof(MidInstCache));
+  if (!p) return ip;
+  p->key = *key;
+  if (key->name)
+    {
+      p->key.name = timi_strdup(key->name);
+      if (!p->key.name)
+	{
+	  timi_free(p);
+	  return ip;
+	}
+    }
+  p->ip = ip;
+  p->refcount = 1;
+  p->bytes = instrument_size(ip);
+
+  h = hash_inst_key(key);
+  timi_mutex_lock(&cache_lock);
+  cached = lookup_instrument(key, h);
+  if (!cached)
+    {
+      ip->cache = p;
+      p->next = inst_cache[h];
+      inst_cache[h] = p;
+      cache_bytes += p->bytes;
+      if (cache_peak < cache_bytes)
+	cache_peak = cache_bytes;
+    }
+  timi_mutex_unlock(&cache_lock);
+  if (!cached)
+    {
+      evict_instruments();
+      return ip;
+    }
+
+  timi_free((void *) p->key.name);
+  timi_free(p);
+  free_instrument(ip);
+  return cached;
+}
+
+void release_instrument(MidInstrument *ip)
+{
+  if (!ip || ip == MAGIC_LOAD_INSTRUMENT)
+    return;
+  if (!ip->cache)
+    {
+      free_instrument(ip);
+      return;
+    }
+  timi_mutex_lock(&cache_lock);
+  if (ip->cache->refcount > 0 && --ip->cache->refcount == 0)
+    lru_append(ip->cache);
+  timi_mutex_unlock(&cache_lock);
+  evict_instruments();
+}
+
+/* Frees the entries taken out of the cache: unlocked, since releasing
+   shared data takes the lock. */
+static int free_entries(MidInstCache *dead, int all)
+{
+  MidInstCache *p;
+  int n = 0;
+  while ((p = dead) != NULL)
+    {
+      dead = p->next;
+      free_instrument(p->ip);
+      timi_free((void *) p->key.name);
+      timi_free(p);
+      n++;
+    }
+  /* and the resampled data they no longer use */
+  purge_resampled(all);
+  return n;
+}
+
+/* Frees the cached instruments no song is using, or all of them.
+   Returns the number of instruments freed. */
+int purge_instruments(int all)
+{
+  MidInstCache **pp, *p, *dead = NULL;
+  int i;
+  timi_mutex_lock(&cache_lock);
+  for (i = 0; i < INST_CACHE_SIZE; i++)
+    {
+      pp = &inst_cache[i];
+      while ((p = *pp) != NULL)
+	{
+	  if (p->refcount > 0 && !all)
+	    {
+	      pp = &p->next;
+	      continue;
+	    }
+	  *pp = p->next;
+	  if (p->refcount == 0)
+	    lru_remove(p);
+	  cache_bytes -= p->bytes;
+	  p->next = dead;
+	  dead = p;
+	}
+    }
+  timi_mutex_unlock(&cache_lock);
+  return free_entries(dead, all);
+}
+
+/* Frees the instruments unused for the longest time, until the cache
+   is back within its budget. Instruments in use are never freed, so
+   the songs playing may keep it over the budget. */
+static int evict_instruments(void)
+{
+  MidInstCache **pp, *p, *dead = NULL;
+
+  timi_mutex_lock(&cache_lock);
+  while (cache_budget && cache_bytes > cache_budget && (p = lru_head) != NULL)
+    {
+      lru_remove(p);
+      for (pp = &inst_cache[hash_inst_key(&p->key)]; *pp != p; pp = &(*pp)->next)
+	;
+      *pp = p->next;
+      cache_bytes -= p->bytes;
+      p->next = dead;
+      dead = p;
+    }
+  timi_mutex_unlock(&cache_lock);
+  if (!dead)
+    return 0;
+  return free_entries(dead, 0);
+}
+
+void set_instrument_budget(size_t bytes)
+{
+  timi_mutex_lock(&cache_lock);
+  cache_budget = bytes;
+  timi_mutex_unlock(&cache_lock);
+  evict_instruments();
+}
+
+size_t instrument_memory(size_t *peak)
+{
+  size_t n;
+  timi_mutex_lock(&cache_lock);
+  n = cache_bytes;
+  if (peak)
+    *peak = cache_peak;
+  timi_mutex_unlock(&cache_lock);
+  return n;
+}
+
 static void free_bank(MidSong *song, int dr, int b)
 {
   int i;
   MidToneBank *bank=((dr) ? song->drumset[b] : song->tonebank[b]);
   for (i=0; i<128; i++)
-    if (bank->instrument[i])
+    if (bank->instrument[i] && bank->instrument[i] != MAGIC_LOAD_INSTRUMENT)
       {
-	if (bank->instrument[i] != MAGIC_LOAD_INSTRUMENT)
-	  free_instrument(bank->instrument[i]);
+	release_instrument(bank->instrument[i]);
 	bank->instrument[i] = NULL;
       }
 }
@@ -85,12 +432,18 @@ static sint32 convert_envelope_rate(MidSong *song, uint8 rate)
   r = (sint32) (rate & 0x3f) << r; /* 6.9 fixed point */
 
   /* 15.15 fixed point. */
-  r = ((r * 44100) / song->rate) * song->control_ratio;
+  r = (r * 44100) / song->rate;
 
+  /* any more than this gets to the end of the envelope in one go, and
+     it keeps from overflowing with the longer control ratios */
 #ifdef FAST_DECAY
-  return r << 10;
+  if ((double) r * song->control_ratio >= (double) (1 << 20))
+    return MAX_ENVELOPE_RATE;
+  return (r * song->control_ratio) << 10;
 #else
-  return r << 9;
+  if ((double) r * song->control_ratio >= (double) (1 << 21))
+    return MAX_ENVELOPE_RATE;
+  return (r * song->control_ratio) << 9;
 #endif
 }
 
@@ -109,8 +462,8 @@ static sint32 convert_tremolo_sweep(MidSong *song, uint8 sweep)
     return 0;
 
   return
-    ((song->control_ratio * SWEEP_TUNING) << SWEEP_SHIFT) /
-      (song->rate * sweep);
+    (sint32) ((double) (song->control_ratio * SWEEP_TUNING) *
+	      (1 << SWEEP_SHIFT) / (double) (song->rate * sweep));
 }
 
 static sint32 convert_vibrato_sweep(MidSong *song, uint8 sweep,
@@ -132,8 +485,8 @@ static sint32 convert_vibrato_sweep(MidSong *song, uint8 sweep,
 static sint32 convert_tremolo_rate(MidSong *song, uint8 rate)
 {
   return
-    ((SINE_CYCLE_LENGTH * song->control_ratio * rate) << RATE_SHIFT) /
-      (TREMOLO_RATE_TUNING * song->rate);
+    (sint32) ((double) (SINE_CYCLE_LENGTH * song->control_ratio * rate) *
+	      (1 << RATE_SHIFT) / (double) (TREMOLO_RATE_TUNING * song->rate));
 }
 
 static sint32 convert_vibrato_rate(MidSong *song, uint8 rate)
@@ -146,7 +499,21 @@ static sint32 convert_vibrato_rate(MidSong *song, uint8 rate)
 
 static void reverse_data(sint16 *sp, sint32 ls, sint32 le)
 {
-  sint16 s, *ep=sp+le;
+  sint16 s, *ep=sp+le-1;
+  sp+=ls;
+  le-=ls;
+  le/=2;
+  while (le--)
+    {
+      s=*sp;
+      *sp++=*ep;
+      *ep--=s;
+    }
+}
+
+static void reverse_data8(sint8 *sp, sint32 ls, sint32 le)
+{
+  sint8 s, *ep=sp+le-1;
   sp+=ls;
   le-=ls;
   le/=2;
@@ -167,8 +534,11 @@ static void reverse_data(sint16 *sp, sint32 ls, sint32 le)
    For other parameters, 1 means yes, 0 means no, other values are
    undefined.
 
+   Returns -1 if we ran out of memory, 0 otherwise: *out is NULL if
+   the instrument couldn't be loaded.
+
    TODO: do reverse loops right */
-static void load_instrument(MidSong *song, const char *name,
+static int load_instrument(MidSong *song, const char *name,
 				   MidInstrument **out,
 				   int percussion, int panning,
 				   int amp, int note_to_use,
@@ -184,23 +554,38 @@ static void load_instrument(MidSong *song, const char *name,
   MidSample *sp;
   FILE *fp;
   char tmp[TMPSIZE];
-  int i,j;
+  int i,j,shift;
   static const char *patch_ext[] = PATCH_EXT_LIST;
 
+  MidInstKey key;
+
   TIMI_UNUSED(percussion);
   *out = NULL;
-  if (!name || !*name) return;
+  if (!name || !*name) return 0;
+
+  memset(&key, 0, sizeof(key));
+  key.type = INST_GUS;
+  key.context = song->ctx->id;
+  key.name = name;
+  key.panning = panning;
+  key.amp = amp;
+  key.note_to_use = note_to_use;
+  key.strip_loop = strip_loop;
+  key.strip_envelope = strip_envelope;
+  key.strip_tail = strip_tail;
+  key.rate = song->rate;
+  key.control_ratio = song->control_ratio;
 
   /* Open patch file */
   i = -1;
-  if ((fp=timi_openfile(name)) == NULL)
+  if ((fp=timi_openfile(song->ctx, name)) == NULL)
     {
       /* Try with various extensions */
       for (i=0; patch_ext[i]; i++)
 	{
 	    size_t l = timi_strxcpy(tmp, name, sizeof(tmp)) - 1;
 	    timi_strxcpy(tmp + l, patch_ext[i], sizeof(tmp) - l);
-	    if ((fp=timi_openfile(tmp)) != NULL)
+	    if ((fp=timi_openfile(song->ctx, tmp)) != NULL)
 		break;
 	}
     }
@@ -208,7 +593,15 @@ static void load_instrument(MidSong *song, const char *name,
   if (fp == NULL)
     {
       DEBUG_MSG("Instrument `%s' can't be found.\n", name);
-      return;
+      return 0;
+    }
+
+  /* A copy loaded from the same file, unchanged since, will do */
+  timi_filestamp(fp, &key.fsize, &key.mtime);
+  if ((*out = find_instrument(&key)) != NULL)
+    {
+      fclose(fp);
+      return 0;
     }
 
   DEBUG_MSG("Loading instrument %s\n", (i < 0)? name : tmp);
@@ -243,6 +636,7 @@ static void load_instrument(MidSong *song, const char *name,
   if (!ip) goto nomem;
 
   ip->type = INST_GUS;
+  ip->cache = NULL;
 
   ip->samples = tmp[198];
   ip->sample = (MidSample *) timi_calloc(ip->samples, sizeof(MidSample));
@@ -398,27 +792,25 @@ static void load_instrument(MidSong *song, const char *name,
 	    convert_envelope_offset(tmp[6+j]);
 	}
 
-      /* Then read the sample data */
+      /* Then read the sample data. 8-bit data is kept 8-bit: the
+	 resampler reads it as 16-bit. */
       sp->data = (sample_t *) timi_malloc(sp->data_length+4);
       if (!sp->data) goto nomem;
 
       if (1 != fread(sp->data, sp->data_length, 1, fp))
 	goto badread;
 
-      if (!(sp->modes & MODES_16BIT)) /* convert to 16-bit data */
+      shift = (sp->modes & MODES_16BIT) ? 1 : 0;
+
+      if (!shift)
 	{
-	  sint32 k=sp->data_length;
-	  uint8 *cp=(uint8 *)(sp->data);
-	  uint16 *tmp16,*new16;
-	  sp->data_length *= 2;
-	  sp->loop_start *= 2;
-	  sp->loop_end *= 2;
-	  tmp16 = new16 = (uint16 *) timi_malloc(sp->data_length+4);
-	  if (!new16) goto nomem;
-	  while (k--)
-	    *tmp16++ = (uint16)(*cp++) << 8;
-	  timi_free(sp->data);
-	  sp->data = (sample_t *)new16;
+	  if (sp->modes & MODES_UNSIGNED) /* convert to signed data */
+	    {
+	      sint32 k=sp->data_length;
+	      uint8 *cp=(uint8 *)sp->data;
+	      while (k--)
+		*cp++ ^= 0x80;
+	    }
 	}
 #if defined(WORDS_BIGENDIAN)
       else
@@ -434,7 +826,7 @@ static void load_instrument(MidSong *song, const char *name,
 	}
 #endif
 
-      if (sp->modes & MODES_UNSIGNED) /* convert to signed data */
+      if (shift && (sp->modes & MODES_UNSIGNED)) /* convert to signed data */
 	{
 	  sint32 k=sp->data_length/2;
 	  sint16 *tmp16=(sint16 *)sp->data;
@@ -450,7 +842,10 @@ static void load_instrument(MidSong *song, const char *name,
 	     whole sample. We do the same because the GUS does not SUCK. */
 
 	  DEBUG_MSG("Reverse loop in %s\n", name);
-	  reverse_data((sint16 *)sp->data, 0, sp->data_length/2);
+	  if (shift)
+	    reverse_data((sint16 *)sp->data, 0, sp->data_length/2);
+	  else
+	    reverse_data8((sint8 *)sp->data, 0, sp->data_length);
 
 	  t=sp->loop_start;
 	  sp->loop_start=sp->data_length - sp->loop_end;
@@ -468,12 +863,13 @@ static void load_instrument(MidSong *song, const char *name,
 	  /* Try to determine a volume scaling factor for the sample.
 	     This is a very crude adjustment, but things sound more
 	     balanced with it. Still, this should be a runtime option. */
-	  sint32 k=sp->data_length/2;
+	  sint32 k=sp->data_length >> shift;
 	  sint16 maxamp=0,a;
 	  sint16 *tmp16=(sint16 *)sp->data;
+	  sint8 *tmp8=(sint8 *)sp->data;
 	  while (k--)
 	    {
-	      a=*tmp16++;
+	      a=(shift) ? *tmp16++ : *tmp8++ * 256;
 	      if (a<0) a=-a;
 	      if (a>maxamp)
 		maxamp=a;
@@ -488,12 +884,16 @@ static void load_instrument(MidSong *song, const char *name,
 	sp->volume=1.0;
 #endif
 
-      sp->data_length /= 2; /* These are in bytes. Convert into samples. */
-      sp->loop_start /= 2;
-      sp->loop_end /= 2;
+      sp->data_length >>= shift; /* These are in bytes. Convert into samples. */
+      sp->loop_start >>= shift;
+      sp->loop_end >>= shift;
 
-      /* initialize the 2 extra samples at the end (those +4 bytes) */
-      sp->data[sp->data_length] = sp->data[sp->data_length+1] = 0;
+      /* initialize the 2 extra samples at the end (of those +4 bytes) */
+      if (shift)
+	sp->data[sp->data_length] = sp->data[sp->data_length+1] = 0;
+      else
+	((sint8 *)sp->data)[sp->data_length] =
+	  ((sint8 *)sp->data)[sp->data_length+1] = 0;
 
       /* Then fractional samples */
       sp->data_length <<= FRACTION_BITS;
@@ -510,8 +910,8 @@ static void load_instrument(MidSong *song, const char *name,
       /* If this instrument will always be played on the same note,
 	 and it's not looped, we can resample it now. */
       if (sp->note_to_use && !(sp->modes & MODES_LOOPING)) {
-	pre_resample(song, sp);
-	if (song->oom) goto fail;
+	if (pre_resample(song, sp, name, i) < 0)
+	  goto nomem;
       }
 
       if (strip_tail==1)
@@ -523,21 +923,150 @@ static void load_instrument(MidSong *song, const char *name,
     }
 
   fclose(fp);
-  return;
+  *out = cache_instrument(&key, ip);
+  return 0;
 
 nomem:
-  song->oom=1;
-  goto fail;
+  free_instrument (ip);
+  fclose(fp);
+  *out = NULL;
+  return -1;
 badread:
   DEBUG_MSG("Error reading sample %d\n", i);
-fail:
   free_instrument (ip);
 badpat:
   fclose(fp);
   *out = NULL;
+  return 0;
 }
 
-static int fill_bank(MidSong *song, int dr, int b)
+/* An instrument slot to load: done by one of the loader threads */
+#define JOB_PENDING	0
+#define JOB_LOADING	1
+#define JOB_DONE	2
+
+typedef struct _LoadJob {
+  int dr, b, i;
+  sint32 time;	/* of the first note-on, -1 if it is never played */
+  int state;
+  MidInstrument *ip;
+  int oom;
+} LoadJob;
+
+/* Runs the jobs, either while the song is loaded or in the background
+   while it is played. In the background, the slots of the instruments
+   still marked MAGIC_LOAD_INSTRUMENT are only accessed under the lock. */
+typedef struct _MidLoader MidLoader;
+struct _MidLoader {
+  MidSong *song;
+  LoadJob *jobs;
+  int count, next;
+  int stop, running;
+  timi_mutex lock;
+  timi_cond cond;
+  timi_thread thread;
+};
+
+static void load_job(MidSong *song, LoadJob *job)
+{
+  int dr = job->dr, b = job->b, i = job->i;
+  MidToneBank *bank=((dr) ? song->drumset[b] : song->tonebank[b]);
+
+  job->ip = NULL;
+  job->oom = 0;
+
+  /* preload soundfont */
+  if (load_soundfont(song, 0, (dr)? 128 : b, (dr)? b : i,
+			 (dr)? i : -1, &job->ip) < 0)
+    goto nomem;
+  if (job->ip)
+    return;
+  /* try gus patch */
+  if (load_instrument(song,
+			   bank->tone[i].name, 
+			   &job->ip,
+			   (dr) ? 1 : 0,
+			   bank->tone[i].pan,
+			   bank->tone[i].amp,
+			   (bank->tone[i].note!=-1) ? 
+			   bank->tone[i].note :
+			   ((dr) ? i : -1),
+			   (bank->tone[i].strip_loop!=-1) ?
+			   bank->tone[i].strip_loop :
+			   ((dr) ? 1 : -1),
+			   (bank->tone[i].strip_envelope != -1) ? 
+			   bank->tone[i].strip_envelope :
+			   ((dr) ? 1 : -1),
+			   bank->tone[i].strip_tail) < 0)
+    goto nomem;
+  if (job->ip)
+    return;
+  /* no patch; search soundfont again. */
+  if (load_soundfont(song, 1, (dr)? 128 : b, (dr)? b : i,
+			 (dr)? i : -1, &job->ip) < 0)
+    goto nomem;
+  return;
+nomem:
+  job->oom = 1;
+}
+
+static void *loader_thread(void *arg)
+{
+  MidLoader *l = (MidLoader *) arg;
+  int n;
+  for (;;)
+    {
+      timi_mutex_lock(&l->lock);
+      n = l->next++;
+      timi_mutex_unlock(&l->lock);
+      if (n >= l->count)
+	break;
+      load_job(l->song, &l->jobs[n]);
+    }
+  return NULL;
+}
+
+/* Runs the jobs on up to the given number of threads, including the
+   calling one. Without thread support, or if no thread can be created,
+   everything is loaded here. */
+static void run_jobs(MidSong *song, LoadJob *jobs, int count, int threads)
+{
+  MidLoader l;
+  timi_thread *tid = NULL;
+  int i, started = 0;
+
+  l.song = song;
+  l.jobs = jobs;
+  l.count = count;
+  l.next = 0;
+  timi_mutex_init(&l.lock);
+
+  if (threads > count)
+    threads = count;
+  if (threads > 1)
+    tid = (timi_thread *) timi_malloc((threads - 1) * sizeof(timi_thread));
+  if (tid)
+    {
+      for (i = 0; i < threads - 1; i++)
+	{
+	  if (timi_thread_create(&tid[started], loader_thread, &l) != 0)
+	    break;
+	  started++;
+	}
+    }
+  DEBUG_MSG("Loading %d instruments with %d threads\n", count, started + 1);
+
+  loader_thread(&l);
+
+  for (i = 0; i < started; i++)
+    timi_thread_join(tid[i]);
+  timi_free(tid);
+  timi_mutex_destroy(&l.lock);
+}
+
+/* Deals with the slots that have no instrument mapped to them, and
+   adds the ones to be loaded to jobs. */
+static int mark_bank(MidSong *song, int dr, int b, LoadJob *jobs, int *count)
 {
   int i, errors=0;
   MidToneBank *bank=((dr) ? song->drumset[b] : song->tonebank[b]);
@@ -578,65 +1107,305 @@ static int fill_bank(MidSong *song, int dr, int b)
 	    }
 	  else
 	    {
-	      /* preload soundfont */
-	      bank->instrument[i] = load_soundfont(song, 0,
-							(dr)? 128 : b,
-							(dr)? b : i,
-							(dr)? i : -1);
-	      if (bank->instrument[i])
-		  continue;
-	      /* try gus patch */
-	      load_instrument(song,
-				     bank->tone[i].name, 
-				     &bank->instrument[i],
-				     (dr) ? 1 : 0,
-				     bank->tone[i].pan,
-				     bank->tone[i].amp,
-				     (bank->tone[i].note!=-1) ? 
-				     bank->tone[i].note :
-				     ((dr) ? i : -1),
-				     (bank->tone[i].strip_loop!=-1) ?
-				     bank->tone[i].strip_loop :
-				     ((dr) ? 1 : -1),
-				     (bank->tone[i].strip_envelope != -1) ? 
-				     bank->tone[i].strip_envelope :
-				     ((dr) ? 1 : -1),
-				     bank->tone[i].strip_tail);
-	      if (bank->instrument[i])
-		  continue;
-	      /* no patch; search soundfont again. */
-	      bank->instrument[i] = load_soundfont(song, 1,
-							(dr)? 128 : b,
-							(dr)? b : i,
-							(dr)? i : -1);
-	      if (!bank->instrument[i]) {
-		DEBUG_MSG("Couldn't load instrument %s (%s %d, program %d)\n",
-		   bank->tone[i].name,
-		   (dr)? "drum set" : "tone bank", b, i);
-		errors++;
-	      }
+	      jobs[*count].dr = dr;
+	      jobs[*count].b = b;
+	      jobs[*count].i = i;
+	      jobs[*count].time = 0;
+	      jobs[*count].state = JOB_PENDING;
+	      (*count)++;
 	    }
 	}
     }
   return errors;
 }
 
-int load_missing_instruments(MidSong *song)
+static int count_marked(MidToneBank *bank)
+{
+  int i, n=0;
+  if (bank)
+    for (i=0; i<128; i++)
+      if (bank->instrument[i]==MAGIC_LOAD_INSTRUMENT)
+	n++;
+  return n;
+}
+
+/* Finds when each instrument is first played, going through the
+   events just like play_midi() does. */
+static void time_jobs(MidSong *song, LoadJob *jobs, int count)
+{
+  int *index, bank[16], program[16];
+  int c, dr, b, i, n;
+  MidEvent *e;
+
+  index = (int *) timi_calloc(2 * 128 * 128, sizeof(int));
+  if (!index)
+    return; /* everything is loaded now, then */
+  for (n = 0; n < count; n++)
+    {
+      index[(jobs[n].dr * 128 + jobs[n].b) * 128 + jobs[n].i] = n + 1;
+      jobs[n].time = -1;
+    }
+  for (c = 0; c < 16; c++)
+    {
+      bank[c] = 0;
+      program[c] = song->default_program;
+    }
+
+  for (e = song->events; e->type != ME_EOT; e++)
+    {
+      c = e->channel;
+      dr = ISDRUMCHANNEL(song, c) ? 1 : 0;
+      switch (e->type)
+	{
+	case ME_PROGRAM:
+	  if (dr)
+	    bank[c] = e->a;
+	  else
+	    program[c] = e->a;
+	  break;
+
+	case ME_TONE_BANK:
+	  bank[c] = e->a;
+	  break;
+
+	case ME_NOTEON:
+	  if (dr)
+	    i = e->a;
+	  else if (program[c] == SPECIAL_PROGRAM)
+	    break;
+	  else
+	    i = program[c];
+	  b = bank[c];
+	  /* the slots left empty fall back to bank 0 */
+	  if (!(n = index[(dr * 128 + b) * 128 + i]))
+	    n = index[dr * 128 * 128 + i];
+	  if (n && jobs[n - 1].time < 0)
+	    jobs[n - 1].time = e->time;
+	  break;
+	}
+    }
+  timi_free(index);
+}
+
+static int compare_jobs(const void *a, const void *b)
 {
-  int i=128,errors=0;
+  const LoadJob *ja = (const LoadJob *) a, *jb = (const LoadJob *) b;
+  /* the ones never played go last */
+  uint32 ta = (uint32) ja->time, tb = (uint32) jb->time;
+  if (ta != tb)
+    return (ta < tb) ? -1 : 1;
+  if (ja->dr != jb->dr)
+    return ja->dr - jb->dr;
+  if (ja->b != jb->b)
+    return jb->b - ja->b;
+  return ja->i - jb->i;
+}
+
+static void store_job(MidSong *song, LoadJob *job)
+{
+  MidToneBank *bank=((job->dr) ? song->drumset[job->b] : song->tonebank[job->b]);
+  bank->instrument[job->i] = job->ip;
+  job->state = JOB_DONE;
+  if (!job->ip && !job->oom)
+    {
+      DEBUG_MSG("Couldn't load instrument %s (%s %d, program %d)\n",
+		bank->tone[job->i].name,
+		(job->dr)? "drum set" : "tone bank", job->b, job->i);
+    }
+}
+
+/* loads the rest of the instruments one at a time, in the order they
+   are played */
+static void *background_thread(void *arg)
+{
+  MidLoader *l = (MidLoader *) arg;
+  LoadJob *job;
+
+  timi_mutex_lock(&l->lock);
+  while (!l->stop && l->next < l->count)
+    {
+      job = &l->jobs[l->next++];
+      if (job->state != JOB_PENDING)
+	continue; /* the song took it already */
+      job->state = JOB_LOADING;
+      timi_mutex_unlock(&l->lock);
+      load_job(l->song, job);
+      timi_mutex_lock(&l->lock);
+      if (job->oom) /* too late to fail the song: it goes missing */
+	{
+	  DEBUG_MSG("Out of memory loading instrument %d\n", job->i);
+	}
+      store_job(l->song, job);
+      timi_cond_broadcast(&l->cond);
+    }
+  l->running = 0;
+  timi_cond_broadcast(&l->cond);
+  timi_mutex_unlock(&l->lock);
+  return NULL;
+}
+
+static void end_loader(MidSong *song)
+{
+  MidLoader *l = song->loader;
+  int n;
+
+  timi_mutex_lock(&l->lock);
+  l->stop = 1;
+  timi_mutex_unlock(&l->lock);
+  timi_thread_join(l->thread);
+
+  /* forget the ones never loaded */
+  for (n = 0; n < l->count; n++)
+    {
+      LoadJob *job = &l->jobs[n];
+      MidToneBank *bank=((job->dr) ? song->drumset[job->b] : song->tonebank[job->b]);
+      if (job->state != JOB_DONE)
+	bank->instrument[job->i] = NULL;
+    }
+  timi_cond_destroy(&l->cond);
+  timi_mutex_destroy(&l->lock);
+  timi_free(l->jobs);
+  timi_free(l);
+  song->loader = NULL;
+}
+
+/* Returns the instrument in a slot, waiting for it if it is still being
+   loaded in the background. One that nobody has started loading yet is
+   loaded right here. */
+MidInstrument *get_instrument(MidSong *song, int dr, int b, int i)
+{
+  MidToneBank *bank=((dr) ? song->drumset[b] : song->tonebank[b]);
+  MidLoader *l = song->loader;
+  MidInstrument *ip;
+  LoadJob *job;
+  int n, done;
+
+  if (!l)
+    return bank->instrument[i];
+
+  timi_mutex_lock(&l->lock);
+  while ((ip = bank->instrument[i]) == MAGIC_LOAD_INSTRUMENT)
+    {
+      for (n = 0, job = l->jobs; n < l->count; n++, job++)
+	if (job->dr == dr && job->b == b && job->i == i)
+	  break;
+      if (n == l->count)
+	{
+	  ip = NULL;
+	  break;
+	}
+      if (job->state == JOB_PENDING)
+	{
+	  job->state = JOB_LOADING;
+	  timi_mutex_unlock(&l->lock);
+	  load_job(song, job);
+	  timi_mutex_lock(&l->lock);
+	  store_job(song, job);
+	  timi_cond_broadcast(&l->cond);
+	}
+      else
+	timi_cond_wait(&l->cond, &l->lock);
+    }
+  done = !l->running;
+  timi_mutex_unlock(&l->lock);
+
+  if (done)
+    end_loader(song);
+  return ip;
+}
+
+/* Loads the marked instruments. With preload >= 0, only the ones played
+   in the first preload samples of the song are loaded here, and a thread
+   loads the rest while the song is played. */
+int load_missing_instruments(MidSong *song, int threads, sint32 preload)
+{
+  LoadJob *jobs;
+  MidLoader *l = NULL;
+  int i=128, n=0, count=0, now, errors=0;
+
+  /* each marked slot may have the same one in bank 0 marked, too */
+  while (i--)
+    n += count_marked(song->tonebank[i]) + count_marked(song->drumset[i]);
+  if (!n)
+    return 0;
+  jobs = (LoadJob *) timi_malloc(2 * n * sizeof(LoadJob));
+  if (!jobs)
+    {
+      song->oom = 1;
+      return 0;
+    }
+
+  i=128;
   while (i--)
     {
       if (song->tonebank[i])
-	errors+=fill_bank(song,0,i);
+	errors+=mark_bank(song,0,i,jobs,&count);
       if (song->drumset[i])
-	errors+=fill_bank(song,1,i);
+	errors+=mark_bank(song,1,i,jobs,&count);
+    }
+
+  now = count;
+  if (preload >= 0 && count)
+    {
+      time_jobs(song, jobs, count);
+      qsort(jobs, count, sizeof(LoadJob), compare_jobs);
+      for (now = 0; now < count; now++)
+	if ((uint32) jobs[now].time > (uint32) preload)
+	  break;
+      if (now < count)
+	l = (MidLoader *) timi_malloc(sizeof(MidLoader));
+      if (l)
+	{
+	  l->song = song;
+	  l->jobs = jobs;
+	  l->count = count;
+	  l->next = now;
+	  l->stop = 0;
+	  l->running = 1;
+	  timi_mutex_init(&l->lock);
+	  timi_cond_init(&l->cond);
+	  if (timi_thread_create(&l->thread, background_thread, l) == 0)
+	    {
+	      DEBUG_MSG("Loading %d instruments in the background\n", count - now);
+	      song->loader = l;
+	    }
+	  else
+	    {
+	      timi_cond_destroy(&l->cond);
+	      timi_mutex_destroy(&l->lock);
+	      timi_free(l);
+	      l = NULL;
+	    }
+	}
+      if (!l)
+	now = count;
+    }
+
+  /* the background thread only looks at the jobs after these */
+  run_jobs(song, jobs, now, threads);
+
+  if (l)
+    timi_mutex_lock(&l->lock);
+  for (n = 0; n < now; n++)
+    {
+      store_job(song, &jobs[n]);
+      if (jobs[n].oom)
+	song->oom = 1;
+      else if (!jobs[n].ip)
+	errors++;
     }
+  if (l)
+    timi_mutex_unlock(&l->lock);
+  else
+    timi_free(jobs);
   return errors;
 }
 
 void free_instruments(MidSong *song)
 {
   int i=128;
+  if (song->loader)
+    end_loader(song);
   while(i--)
     {
       if (song->tonebank[i])
@@ -644,11 +1413,14 @@ void free_instruments(MidSong *song)
       if (song->drumset[i])
 	free_bank(song, 1, i);
     }
+  release_instrument(song->default_instrument);
+  song->default_instrument = NULL;
 }
 
 int set_default_instrument(MidSong *song, const char *name)
 {
-  load_instrument(song, name, &song->default_instrument, 0, -1, -1, -1, 0, 0, 0);
+  if (load_instrument(song, name, &song->default_instrument, 0, -1, -1, -1, 0, 0, 0) < 0)
+    song->oom = 1;
   if (!song->default_instrument)
     return -1;
   song->default_program = SPECIAL_PROGRAM;
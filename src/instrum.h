@@ -46,12 +46,55 @@
 
 #define SPECIAL_PROGRAM -1
 
+/* Everything that makes a loaded instrument different from another
+   one: instruments loaded with equal keys are shared between songs. */
+typedef struct _MidInstKey MidInstKey;
+struct _MidInstKey
+{
+  int type;		/* INST_GUS or INST_SF2 */
+  int context;		/* id of the context whose paths found the file */
+  const char *name;	/* patch name, or soundfont file name */
+  long fsize, mtime;	/* of the file, for telling when it changed */
+  int bank, preset, keynote, order;	/* soundfont presets */
+  int panning, amp, note_to_use;	/* gus patches */
+  int strip_loop, strip_envelope, strip_tail;
+  sint32 rate, control_ratio;
+};
+
 #define load_missing_instruments TIMI_NAMESPACE(load_missing_instruments)
+#define get_instrument TIMI_NAMESPACE(get_instrument)
 #define free_instruments TIMI_NAMESPACE(free_instruments)
 #define set_default_instrument TIMI_NAMESPACE(set_default_instrument)
+#define find_instrument TIMI_NAMESPACE(find_instrument)
+#define cache_instrument TIMI_NAMESPACE(cache_instrument)
+#define release_instrument TIMI_NAMESPACE(release_instrument)
+#define purge_instruments TIMI_NAMESPACE(purge_instruments)
+#define free_sample_data TIMI_NAMESPACE(free_sample_data)
+#define free_instrument TIMI_NAMESPACE(free_instrument)
+#define hold_data_ref TIMI_NAMESPACE(hold_data_ref)
+#define drop_data_ref TIMI_NAMESPACE(drop_data_ref)
+#define hold_live_data_ref TIMI_NAMESPACE(hold_live_data_ref)
+#define data_ref_count TIMI_NAMESPACE(data_ref_count)
+#define set_instrument_budget TIMI_NAMESPACE(set_instrument_budget)
+#define instrument_memory TIMI_NAMESPACE(instrument_memory)
 
-extern int load_missing_instruments(MidSong *song);
+extern int load_missing_instruments(MidSong *song, int threads, sint32 preload);
+extern MidInstrument *get_instrument(MidSong *song, int dr, int b, int i);
 extern void free_instruments(MidSong *song);
 extern int set_default_instrument(MidSong *song, const char *name);
 
+extern MidInstrument *find_instrument(const MidInstKey *key);
+extern MidInstrument *cache_instrument(const MidInstKey *key, MidInstrument *ip);
+extern void release_instrument(MidInstrument *ip);
+extern int purge_instruments(int all);
+extern void set_instrument_budget(size_t bytes);
+extern size_t instrument_memory(size_t *peak);
+
+extern void free_instrument(MidInstrument *ip);
+extern void free_sample_data(MidSample *sp);
+extern void hold_data_ref(MidDataRef *ref);
+extern void drop_data_ref(MidDataRef *ref);
+extern int hold_live_data_ref(MidDataRef *ref);
+extern int data_ref_count(MidDataRef *ref);
+
 #endif /* TIMIDITY_INSTRUM_H */
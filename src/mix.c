@@ -36,8 +36,10 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "timidity_internal.h"
+#include "common.h"
 #include "instrum.h"
 #include "playmidi.h"
 #include "output.h"
@@ -84,6 +86,15 @@ int recompute_envelope(MidSong *song, int v)
   return 0;
 }
 
+/* With PE_FLOAT, the gains are the amplitudes, limited as the integer
+   ones are, and scaled to come out at what the integer mixing does at
+   16 bits, over 32768. left_mix and right_mix are still kept: the
+   voices to cut are picked by them. */
+#define FLOAT_GAIN_SCALE (1.0f / (float)(1L << (31 - AMP_BITS - GUARD_BITS)))
+#define MAX_FLOAT_AMP ((float)MAX_AMP_VALUE / (float)(1 << AMP_BITS))
+#define FLOAT_GAIN(a) \
+  (((a) < MAX_FLOAT_AMP ? (a) : MAX_FLOAT_AMP) * FLOAT_GAIN_SCALE)
+
 void apply_envelope_to_amp(MidSong *song, int v)
 {
   float lamp = song->voice[v].left_amp, ramp;
@@ -102,6 +113,12 @@ void apply_envelope_to_amp(MidSong *song, int v)
 	  ramp *= (float)vol_table[song->voice[v].envelope_volume>>23];
 	}
 
+      if (song->encoding & PE_FLOAT)
+	{
+	  song->voice[v].left_gain = FLOAT_GAIN(lamp);
+	  song->voice[v].right_gain = FLOAT_GAIN(ramp);
+	}
+
       la = (sint32)TIM_FSCALE(lamp,AMP_BITS);
 
       if (la>MAX_AMP_VALUE)
@@ -121,6 +138,9 @@ void apply_envelope_to_amp(MidSong *song, int v)
       if (song->voice[v].sample->modes & MODES_ENVELOPE)
 	lamp *= (float)vol_table[song->voice[v].envelope_volume>>23];
 
+      if (song->encoding & PE_FLOAT)
+	song->voice[v].left_gain = FLOAT_GAIN(lamp);
+
       la = (sint32)TIM_FSCALE(lamp,AMP_BITS);
 
       if (la>MAX_AMP_VALUE)
@@ -148,7 +168,7 @@ static int update_envelope(MidSong *song, int v)
 
 static void update_tremolo(MidSong *song, int v)
 {
-  sint32 depth = song->voice[v].sample->tremolo_depth << 7;
+  sint32 depth = song->voice[v].tremolo_depth;
 
   if (song->voice[v].tremolo_sweep)
     {
@@ -169,21 +189,64 @@ static void update_tremolo(MidSong *song, int v)
   /* if (song->voice[v].tremolo_phase >= (SINE_CYCLE_LENGTH<<RATE_SHIFT))
      song->voice[v].tremolo_phase -= SINE_CYCLE_LENGTH<<RATE_SHIFT;  */
 
-  song->voice[v].tremolo_volume = (float) 
-    (1.0 - TIM_FSCALENEG((timi_sine(song->voice[v].tremolo_phase >> RATE_SHIFT) + 1.0)
-			  * depth * TREMOLO_AMPLITUDE_TUNING,
-			 17));
+  /* (sine + 1) * depth, with the sine scaled to 32768 and the depth
+     below 32768: that's at most 2^31 - 2^16, which still fits. */
+  depth *= lfo_sine(song->voice[v].tremolo_phase >> RATE_SHIFT) + 32768;
+  song->voice[v].tremolo_volume =
+    1.0f - (float) depth * (1.0f / 4294967296.0f);
 
   /* I'm not sure about the +1.0 there -- it makes tremoloed voices'
      volumes on average the lower the higher the tremolo amplitude. */
 }
 
+/* A released note fading below the cull_threshold won't come back up:
+   the tremolo only ever takes from its volume, so it's left out. */
+static int inaudible(MidSong *song, int v)
+{
+  MidVoice *vp = song->voice + v;
+  float amp;
+
+  if ((vp->status != VOICE_OFF && vp->status != VOICE_SUSTAINED) ||
+      vp->envelope_increment > 0)
+    return 0;
+  amp = vp->left_amp;
+  if (vp->panned == PANNED_MYSTERY && vp->right_amp > amp)
+    amp = vp->right_amp;
+  if (vp->sample->modes & MODES_ENVELOPE)
+    amp *= (float)vol_table[vp->envelope_volume>>23];
+  return amp < song->cull_amp;
+}
+
+/* Returns 1 if the note was freed */
+static int cull_voice(MidSong *song, int v)
+{
+  if (song->cull_amp <= 0 || !inaudible(song, v))
+    return 0;
+  /* counted as the voice is dropped, by the thread playing the song */
+  song->voice[v].status = VOICE_FREE;
+  song->voice[v].culled = 1;
+  return 1;
+}
+
+/* update_signal() culls the voices it updates. The volume of one with
+   no envelope or tremolo doesn't move as it plays, so it's weighed as
+   its block starts, which is as soon as it's released. */
+static int cull_steady_voice(MidSong *song, MidVoice *vp, int v)
+{
+  if (vp->envelope_increment || vp->tremolo_phase_increment)
+    return 0;
+  return cull_voice(song, v);
+}
+
 /* Returns 1 if the note died */
 static int update_signal(MidSong *song, int v)
 {
   if (song->voice[v].envelope_increment && update_envelope(song, v))
     return 1;
 
+  if (cull_voice(song, v))
+    return 1;
+
   if (song->voice[v].tremolo_phase_increment)
     update_tremolo(song, v);
 
@@ -515,24 +578,149 @@ static void ramp_out(MidSong *song, sample_t *sp, sint32 *lp, int v, sint32 c)
 }
 
 
-/**************** interface function ******************/
+/* Mixes the samples in as they're resampled, without going through the
+   resample buffer. Does the same as the mix_* functions above. */
+static void mix_resampling(MidSong *song, sint32 *lp, int v, sint32 count)
+{
+  MidVoice *vp = song->voice + v;
+  MidMixer mx;
+  sint32 n;
+  int cc;
+
+  mx.lp = lp;
+  mx.mono = (song->encoding & PE_MONO) != 0;
+  mx.panned = vp->panned;
+  if (!mx.mono && vp->panned == PANNED_RIGHT)
+    mx.lp++;
+  mx.left = vp->left_mix;
+  mx.right = vp->right_mix;
+  mx.ramp = 0;
+  mx.fp = NULL;
 
-void mix_voice(MidSong *song, sint32 *buf, int v, sint32 c)
+  if (!(vp->envelope_increment || vp->tremolo_phase_increment))
+    {
+      resample_mix(song, v, count, &mx);
+      return;
+    }
+
+  cc = vp->control_counter;
+  while (count)
+    {
+      if (!cc)
+	{
+	  cc = song->control_ratio;
+	  if (update_signal(song, v))
+	    return;	/* Envelope ran out */
+	  mx.left = vp->left_mix;
+	  mx.right = vp->right_mix;
+	}
+      n = (cc < count) ? cc : count;
+      resample_mix(song, v, n, &mx);
+      cc -= n;
+      count -= n;
+    }
+  vp->control_counter = cc;
+}
+
+/* With song->ramping, the volumes slide from where they were to
+   left_mix and right_mix over the rest of each control block, instead
+   of jumping there at its start. Until they get there, the voices go
+   through here even if nothing else changes the volumes. */
+static int voice_ramping(MidSong *song, MidVoice *vp)
+{
+  if (vp->envelope_increment || vp->tremolo_phase_increment)
+    return 1;
+  if (vp->left_ramp != (vp->left_mix << RAMP_BITS))
+    return 1;
+  return (vp->panned == PANNED_MYSTERY && !(song->encoding & PE_MONO) &&
+	  vp->right_ramp != (vp->right_mix << RAMP_BITS));
+}
+
+static void mix_ramping(MidSong *song, sint32 *lp, sample_t *rbuf, int v,
+			sint32 count)
+{
+  MidVoice *vp = song->voice + v;
+  MidMixer mx;
+  sample_t *sp = NULL;
+  sint32 n;
+  int cc, direct = can_resample_mix(song, v, count);
+
+  if (!direct)
+    sp = resample_voice(song, rbuf, v, &count);
+
+  mx.lp = lp;
+  mx.mono = (song->encoding & PE_MONO) != 0;
+  mx.panned = vp->panned;
+  if (!mx.mono && vp->panned == PANNED_RIGHT)
+    mx.lp++;
+  mx.ramp = 1;
+  mx.fp = NULL;
+  mx.left_ramp = vp->left_ramp;
+  mx.right_ramp = vp->right_ramp;
+
+  cc = vp->control_counter;
+  while (count > 0)
+    {
+      if (!cc)
+	{
+	  cc = song->control_ratio;
+	  if (update_signal(song, v))
+	    return;	/* Envelope ran out */
+	}
+      /* aim at the volumes for the end of the block */
+      mx.left_step = ((vp->left_mix << RAMP_BITS) - mx.left_ramp) / cc;
+      mx.right_step = ((vp->right_mix << RAMP_BITS) - mx.right_ramp) / cc;
+      n = (cc < count) ? cc : count;
+      if (direct)
+	resample_mix(song, v, n, &mx);
+      else
+	{
+	  mix_window(&mx, sp, n);
+	  sp += n;
+	}
+      cc -= n;
+      count -= n;
+      if (!cc)
+	{
+	  /* there, without what the steps rounded off */
+	  mx.left_ramp = vp->left_mix << RAMP_BITS;
+	  mx.right_ramp = vp->right_mix << RAMP_BITS;
+	}
+    }
+  vp->control_counter = cc;
+  vp->left_ramp = mx.left_ramp;
+  vp->right_ramp = mx.right_ramp;
+}
+
+/* rbuf is the resample buffer of the thread mixing the voice */
+static void mix_voice(MidSong *song, sint32 *buf, sample_t *rbuf, int v, sint32 c)
 {
   MidVoice *vp = song->voice + v;
   sample_t *sp;
+  if (cull_steady_voice(song, vp, v))
+    return;
   if (vp->status==VOICE_DIE)
     {
       if (c>=MAX_DIE_TIME)
 	c=MAX_DIE_TIME;
-      sp=resample_voice(song, v, &c);
+      sp=resample_voice(song, rbuf, v, &c);
+      if (song->ramping)
+	{
+	  /* ramp out from where the volumes are */
+	  vp->left_mix = vp->left_ramp >> RAMP_BITS;
+	  vp->right_mix = vp->right_ramp >> RAMP_BITS;
+	}
       if(c > 0)
 	ramp_out(song, sp, buf, v, c);
       vp->status=VOICE_FREE;
     }
+  else if (song->ramping && voice_ramping(song, vp))
+    mix_ramping(song, buf, rbuf, v, c);
+  else if (can_resample_mix(song, v, c))
+    mix_resampling(song, buf, v, c);
   else
     {
-      sp=resample_voice(song, v, &c);
+      sp=resample_voice(song, rbuf, v, &c);
       if (song->encoding & PE_MONO)
 	{
 	  /* Mono output. */
@@ -572,3 +760,287 @@ void mix_voice(MidSong *song, sint32 *buf, int v, sint32 c)
     }
 }
 
+/**************** the voices of a block, on several threads ****************/
+
+/* Each thread mixes every step-th voice in use, from the first, into a
+   buffer and a resample buffer of its own: the integer sums come out
+   the same whichever thread mixes a voice, so the song sounds the same
+   on any number of them. The voices are only dropped from voice_list
+   once all are mixed, by the thread playing the song. */
+typedef struct _MidMixThread MidMixThread;
+struct _MidMixThread {
+  struct _MidMixPool *pool;
+  int index;			/* its first voice in voice_list */
+  timi_thread tid;
+  sint32 *buffer;
+  sample_t *resample_buffer;
+};
+
+typedef struct _MidMixPool MidMixPool;
+struct _MidMixPool {
+  MidSong *song;
+  int threads;			/* started, besides the one playing the song */
+  MidMixThread *thread;
+  timi_mutex lock;
+  timi_cond start, done;
+  unsigned int round;		/* blocks handed out so far */
+  int pending;			/* threads still mixing the block */
+  int stop;
+  sint32 count;			/* samples in the block */
+};
+
+static void mix_share(MidSong *song, int first, int step, sint32 *buf,
+		      sample_t *rbuf, sint32 count)
+{
+  int n, i;
+  for (n = first; n < song->active_voices; n += step)
+    {
+      i = song->voice_list[n];
+      if (song->voice[i].status != VOICE_FREE)
+	mix_voice(song, buf, rbuf, i, count);
+    }
+}
+
+static void *mixer_thread(void *arg)
+{
+  MidMixThread *t = (MidMixThread *) arg;
+  MidMixPool *p = t->pool;
+  unsigned int round = 0;
+  sint32 count;
+
+  for (;;)
+    {
+      timi_mutex_lock(&p->lock);
+      while (p->round == round && !p->stop)
+	timi_cond_wait(&p->start, &p->lock);
+      if (p->stop)
+	{
+	  timi_mutex_unlock(&p->lock);
+	  break;
+	}
+      round = p->round;
+      count = p->count;
+      timi_mutex_unlock(&p->lock);
+
+      memset(t->buffer, 0, ((p->song->encoding & PE_MONO) ? count : count * 2)
+				* sizeof(sint32));
+      mix_share(p->song, t->index, p->threads + 1, t->buffer,
+		t->resample_buffer, count);
+
+      timi_mutex_lock(&p->lock);
+      if (!--p->pending)
+	timi_cond_signal(&p->done);
+      timi_mutex_unlock(&p->lock);
+    }
+  return NULL;
+}
+
+/**************** interface functions ******************/
+
+/* Mixes the voices in use into buf, which is cleared already. A few
+   voices are not worth waking the threads for. */
+void mix_voices(MidSong *song, sint32 *buf, sint32 count)
+{
+  MidMixPool *p = song->mixers;
+  sint32 *lp, *tp, n;
+  int i, step;
+
+  if (!p || song->active_voices < 2 * (p->threads + 1))
+    {
+      mix_share(song, 0, 1, buf, song->resample_buffer, count);
+      return;
+    }
+  step = p->threads + 1;
+
+  timi_mutex_lock(&p->lock);
+  p->count = count;
+  p->pending = p->threads;
+  p->round++;
+  timi_cond_broadcast(&p->start);
+  timi_mutex_unlock(&p->lock);
+
+  mix_share(song, 0, step, buf, song->resample_buffer, count);
+
+  timi_mutex_lock(&p->lock);
+  while (p->pending)
+    timi_cond_wait(&p->done, &p->lock);
+  timi_mutex_unlock(&p->lock);
+
+  /* always in the same order, though any would do for integers */
+  for (i = 0; i < p->threads; i++)
+    {
+      lp = buf;
+      tp = p->thread[i].buffer;
+      n = (song->encoding & PE_MONO) ? count : count * 2;
+      while (n--)
+	*lp++ += *tp++;
+    }
+}
+
+/* Starts up to threads - 1 threads to mix along with the one playing
+   the song. Without thread support, or if none can be started, the
+   song is mixed on that one alone. */
+void start_mixers(MidSong *song, int threads)
+{
+  MidMixPool *p;
+  MidMixThread *t;
+  int i;
+
+  if (threads < 2)
+    return;
+  p = (MidMixPool *) timi_calloc(1, sizeof(MidMixPool));
+  if (!p)
+    return;
+  p->thread = (MidMixThread *) timi_calloc(threads - 1, sizeof(MidMixThread));
+  if (!p->thread)
+    {
+      timi_free(p);
+      return;
+    }
+  p->song = song;
+  timi_mutex_init(&p->lock);
+  timi_cond_init(&p->start);
+  timi_cond_init(&p->done);
+  song->mixers = p;
+
+  for (i = 0; i < threads - 1; i++)
+    {
+      t = &p->thread[i];
+      t->pool = p;
+      t->index = i + 1;
+      t->buffer = (sint32 *) timi_malloc(song->buffer_size * 2 * sizeof(sint32));
+      t->resample_buffer = (sample_t *) timi_malloc(song->buffer_size * sizeof(sample_t));
+      if (!t->buffer || !t->resample_buffer ||
+	  timi_thread_create(&t->tid, mixer_thread, t) != 0)
+	{
+	  timi_free(t->buffer);
+	  timi_free(t->resample_buffer);
+	  break;
+	}
+      p->threads++;
+    }
+  DEBUG_MSG("Mixing with %d threads\n", p->threads + 1);
+
+  if (!p->threads)
+    stop_mixers(song);
+}
+
+void stop_mixers(MidSong *song)
+{
+  MidMixPool *p = song->mixers;
+  int i;
+
+  if (!p)
+    return;
+  timi_mutex_lock(&p->lock);
+  p->stop = 1;
+  timi_cond_broadcast(&p->start);
+  timi_mutex_unlock(&p->lock);
+
+  for (i = 0; i < p->threads; i++)
+    {
+      timi_thread_join(p->thread[i].tid);
+      timi_free(p->thread[i].buffer);
+      timi_free(p->thread[i].resample_buffer);
+    }
+  timi_cond_destroy(&p->start);
+  timi_cond_destroy(&p->done);
+  timi_mutex_destroy(&p->lock);
+  timi_free(p->thread);
+  timi_free(p);
+  song->mixers = NULL;
+}
+
+/* The float engine mixes every voice here, the same way as the integer
+   functions above do between them, ramping and dying included. */
+void mix_voice_float(MidSong *song, float *buf, int v, sint32 count)
+{
+  MidVoice *vp = song->voice + v;
+  MidMixer mx;
+  sample_t *sp = NULL;
+  sint32 n;
+  int cc, direct;
+
+  if (cull_steady_voice(song, vp, v))
+    return;
+  mx.mono = (song->encoding & PE_MONO) != 0;
+  mx.panned = vp->panned;
+  mx.fp = buf;
+  if (!mx.mono && vp->panned == PANNED_RIGHT)
+    mx.fp++;
+  mx.fleft = (song->ramping) ? vp->left_gain_ramp : vp->left_gain;
+  mx.fright = (song->ramping) ? vp->right_gain_ramp : vp->right_gain;
+  mx.fleft_step = mx.fright_step = 0;
+
+  if (vp->status == VOICE_DIE)
+    {
+      if (count >= MAX_DIE_TIME)
+	count = MAX_DIE_TIME;
+      sp = resample_voice(song, song->resample_buffer, v, &count);
+      if (count > 0)
+	{
+	  /* like ramp_out() */
+	  mx.fleft_step = -mx.fleft / count;
+	  mx.fright_step = -mx.fright / count;
+	  mx.fleft += mx.fleft_step;
+	  mx.fright += mx.fright_step;
+	  mix_window(&mx, sp, count);
+	}
+      vp->status = VOICE_FREE;
+      return;
+    }
+
+  direct = can_resample_mix(song, v, count);
+  if (!direct)
+    sp = resample_voice(song, song->resample_buffer, v, &count);
+
+  if (!(vp->envelope_increment || vp->tremolo_phase_increment ||
+	(song->ramping && (mx.fleft != vp->left_gain ||
+			   mx.fright != vp->right_gain))))
+    {
+      if (direct)
+	resample_mix(song, v, count, &mx);
+      else
+	mix_window(&mx, sp, count);
+      return;
+    }
+
+  cc = vp->control_counter;
+  while (count > 0)
+    {
+      if (!cc)
+	{
+	  cc = song->control_ratio;
+	  if (update_signal(song, v))
+	    return;	/* Envelope ran out */
+	}
+      if (song->ramping)
+	{
+	  mx.fleft_step = (vp->left_gain - mx.fleft) / cc;
+	  mx.fright_step = (vp->right_gain - mx.fright) / cc;
+	}
+      else
+	{
+	  mx.fleft = vp->left_gain;
+	  mx.fright = vp->right_gain;
+	}
+      n = (cc < count) ? cc : count;
+      if (direct)
+	resample_mix(song, v, n, &mx);
+      else
+	{
+	  mix_window(&mx, sp, n);
+	  sp += n;
+	}
+      cc -= n;
+      count -= n;
+      if (!cc)
+	{
+	  mx.fleft = vp->left_gain;
+	  mx.fright = vp->right_gain;
+	}
+    }
+  vp->control_counter = cc;
+  vp->left_gain_ramp = mx.fleft;
+  vp->right_gain_ramp = mx.fright;
+}
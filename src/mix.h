@@ -31,11 +31,17 @@
 #ifndef TIMIDITY_MIX_H
 #define TIMIDITY_MIX_H
 
-#define mix_voice TIMI_NAMESPACE(mix_voice)
+#define mix_voices TIMI_NAMESPACE(mix_voices)
+#define start_mixers TIMI_NAMESPACE(start_mixers)
+#define stop_mixers TIMI_NAMESPACE(stop_mixers)
+#define mix_voice_float TIMI_NAMESPACE(mix_voice_float)
 #define recompute_envelope TIMI_NAMESPACE(recompute_envelope)
 #define apply_envelope_to_amp TIMI_NAMESPACE(apply_envelope_to_amp)
 
-extern void mix_voice(MidSong *song, sint32 *buf, int v, sint32 c);
+extern void mix_voices(MidSong *song, sint32 *buf, sint32 count);
+extern void start_mixers(MidSong *song, int threads);
+extern void stop_mixers(MidSong *song);
+extern void mix_voice_float(MidSong *song, float *buf, int v, sint32 c);
 extern int recompute_envelope(MidSong *song, int v);
 extern void apply_envelope_to_amp(MidSong *song, int v);
 
@@ -48,8 +48,26 @@
 /* In percent. */
 #define DEFAULT_AMPLIFICATION	70
 
-/* Default polyphony */
+/* Default polyphony, and the most a song can be loaded with */
 #define DEFAULT_VOICES	32
+#define MAX_VOICES	4096
+
+/* Voices kept back for fading out the notes cut to make room for new
+   ones, by default and at most */
+#define DEFAULT_RESERVE_VOICES	4
+#define MAX_RESERVE_VOICES	64
+
+/* How much the notes of a channel are worth keeping when voices are
+   stolen, 0 to 127. Drums are short, and missed the most when cut. */
+#define DEFAULT_PRIORITY	64
+#define DEFAULT_DRUM_PRIORITY	96
+
+/* How many of the voices cheapest to cut are kept track of, so that
+   the whole polyphony needn't be gone through for every note stolen */
+#define STEAL_CANDIDATES	16
+
+/* Most threads the voices of a song can be mixed on */
+#define MAX_MIX_THREADS	16
 
 /* 1000 here will give a control ratio of 22:1 with 22 kHz output.
    Higher CONTROLS_PER_SECOND values allow more accurate rendering
@@ -81,11 +99,6 @@
    click removal. */
 #define MAX_DIE_TIME 20
 
-/* On some machines (especially PCs without math coprocessors),
-   looking up sine values in a table will be significantly faster than
-   computing them on the fly. Uncomment this to use lookups. */
-/* #define LOOKUP_SINE */
-
 
 /**************************************************************************/
 /* Anything below this shouldn't need to be changed unless you're porting
@@ -98,7 +111,11 @@
 #define FRACTION_MASK (~ INTEGER_MASK)
 
 /* This is enforced by some computations that must fit in an int */
-#define MAX_CONTROL_RATIO 255
+#define MAX_CONTROL_RATIO 1023
+
+/* Envelope increments at least this large get from any volume to any
+   other in one control update */
+#define MAX_ENVELOPE_RATE ((1<<30)-1)
 
 #define MAX_AMPLIFICATION 800
 
@@ -113,6 +130,10 @@
 
 #define MAX_AMP_VALUE ((1<<(AMP_BITS+1))-1)
 
+/* Fraction bits of the volumes sliding across a control block when
+   ramp_amplitude is on */
+#define RAMP_BITS 16
+
 #define TIM_FSCALE(a,b) (float)((a) * (double)(1<<(b)))
 #define TIM_FSCALENEG(a,b) (float)((a) * (1.0L / (double)(1<<(b))))
 
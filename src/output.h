@@ -36,6 +36,8 @@
 #define PE_MONO 	0x01  /* versus stereo */
 #define PE_SIGNED	0x02  /* versus unsigned */
 #define PE_16BIT 	0x04  /* versus 8-bit */
+#define PE_FLOAT 	0x08  /* mixed in float, for float output */
+#define PE_PLANAR 	0x10  /* all of the left channel, then the right */
 
 /* Conversion functions -- These overwrite the sint32 data in *lp with
    data in another format */
@@ -52,9 +52,97 @@ static void adjust_amplification(MidSong *song)
 
 static void reset_voices(MidSong *song)
 {
-  int i;
-  for (i=0; i<MID_MAX_VOICES; i++)
-    song->voice[i].status=VOICE_FREE;
+  int i, j;
+  for (i=0; i<song->voices+song->reserve_voices; i++)
+    {
+      song->voice[i].status=VOICE_FREE;
+      song->voice_list[i]=i;
+      song->voice[i].list_pos=i;
+    }
+  song->active_voices=0;
+  for (i=0; i<16; i++)
+    {
+      for (j=0; j<128; j++)
+	song->key_voices[i][j]=-1;
+      song->channel_voices[i]=-1;
+    }
+  song->victims=-1;
+}
+
+/* The voices in use are kept at the front of voice_list, so that the
+   event handlers and the mixing only go through those: a voice is
+   moved in when its note starts, and out once it's been mixed for the
+   last time. While in use, a voice is also linked in with the others
+   on its channel and key, and on its channel, for the events that
+   are only for those. */
+static void link_voice(MidSong *song, int i)
+{
+  MidVoice *vp = &song->voice[i];
+  int *head = &song->key_voices[vp->channel][vp->note & 0x7f];
+
+  vp->key_prev = -1;
+  vp->key_next = *head;
+  if (*head >= 0)
+    song->voice[*head].key_prev = i;
+  *head = i;
+
+  head = &song->channel_voices[vp->channel];
+  vp->channel_prev = -1;
+  vp->channel_next = *head;
+  if (*head >= 0)
+    song->voice[*head].channel_prev = i;
+  *head = i;
+}
+
+static void unlink_voice(MidSong *song, int i)
+{
+  MidVoice *vp = &song->voice[i];
+
+  if (vp->key_prev >= 0)
+    song->voice[vp->key_prev].key_next = vp->key_next;
+  else
+    song->key_voices[vp->channel][vp->note & 0x7f] = vp->key_next;
+  if (vp->key_next >= 0)
+    song->voice[vp->key_next].key_prev = vp->key_prev;
+
+  if (vp->channel_prev >= 0)
+    song->voice[vp->channel_prev].channel_next = vp->channel_next;
+  else
+    song->channel_voices[vp->channel] = vp->channel_next;
+  if (vp->channel_next >= 0)
+    song->voice[vp->channel_next].channel_prev = vp->channel_prev;
+}
+
+static void swap_voices(MidSong *song, int pos, int to)
+{
+  int i = song->voice_list[pos], j = song->voice_list[to];
+
+  song->voice_list[pos] = j;
+  song->voice[j].list_pos = pos;
+  song->voice_list[to] = i;
+  song->voice[i].list_pos = to;
+}
+
+/* A voice still in use is taken over when its note is cut with no
+   voice to spare for fading it out */
+static void take_voice(MidSong *song, int i, int channel, int note)
+{
+  if (song->voice[i].list_pos >= song->active_voices)
+    swap_voices(song, song->voice[i].list_pos, song->active_voices++);
+  else
+    unlink_voice(song, i);
+  song->voice[i].channel = channel;
+  song->voice[i].note = note;
+  link_voice(song, i);
+}
+
+static void drop_voice(MidSong *song, int i)
+{
+  if (song->voice[i].list_pos < song->active_voices)
+    {
+      unlink_voice(song, i);
+      swap_voices(song, song->voice[i].list_pos, --song->active_voices);
+    }
 }
 
 /* Process the Reset All Controllers event */
@@ -92,16 +180,6 @@ static void recompute_freq(MidSong *song, int v)
   if (!song->voice[v].sample->sample_rate)
     return;
 
-  if (song->voice[v].vibrato_control_ratio)
-    {
-      /* This instrument has vibrato. Invalidate any precomputed
-         sample_increments. */
-
-      int i=MID_VIBRATO_SAMPLE_INCREMENTS;
-      while (i--)
-	song->voice[v].vibrato_sample_increment[i]=0;
-    }
-
   if (pb==0x2000 || pb<0 || pb>0x3FFF)
     song->voice[v].frequency = song->voice[v].orig_frequency;
   else
@@ -132,6 +210,9 @@ static void recompute_freq(MidSong *song, int v)
 		  (double)(song->rate)),
 		 FRACTION_BITS);
 
+  /* the vibrato bends this one */
+  song->voice[v].base_increment = (sint32)(a);
+
   if (sign)
     a = -a; /* need to preserve the loop direction */
 
@@ -196,6 +277,7 @@ static void recompute_amp(MidSong *song, int v)
 }
 
 static int find_voice(MidSong *song, MidEvent *e);
+static void offer_victim(MidSong *song, int i);
 
 static int find_samples(MidSong *song, MidEvent *e, int *vlist)
 {
@@ -206,9 +288,9 @@ static int find_samples(MidSong *song, MidEvent *e, int *vlist)
 
   if (ISDRUMCHANNEL(song, e->channel))
     {
-      if (!(ip=song->drumset[song->channel[e->channel].bank]->instrument[e->a]))
+      if (!(ip=get_instrument(song, 1, song->channel[e->channel].bank, e->a)))
 	{
-	  if (!(ip=song->drumset[0]->instrument[e->a]))
+	  if (!(ip=get_instrument(song, 1, 0, e->a)))
 	    return 0; /* No instrument? Then we can't play. */
 	}
       if (ip->type == INST_GUS && ip->samples != 1)
@@ -221,10 +303,10 @@ static int find_samples(MidSong *song, MidEvent *e, int *vlist)
     {
       if (song->channel[e->channel].program == SPECIAL_PROGRAM)
 	ip=song->default_instrument;
-      else if (!(ip=song->tonebank[song->channel[e->channel].bank]->
-		 instrument[song->channel[e->channel].program]))
+      else if (!(ip=get_instrument(song, 0, song->channel[e->channel].bank,
+				   song->channel[e->channel].program)))
 	{
-	  if (!(ip=song->tonebank[0]->instrument[song->channel[e->channel].program]))
+	  if (!(ip=get_instrument(song, 0, 0, song->channel[e->channel].program)))
 	    return 0; /* No instrument? Then we can't play. */
 	}
     }
@@ -241,7 +323,8 @@ static int find_samples(MidSong *song, MidEvent *e, int *vlist)
     {
       if (sp->low_freq <= f && sp->high_freq >= f)
 	{
-	  vlist[nv] = find_voice(song, e);
+	  if ((vlist[nv] = find_voice(song, e)) < 0)
+	    return nv;
 	  song->voice[vlist[nv]].orig_frequency = f;
 	  song->voice[vlist[nv]].sample = sp;
 	  if (++nv == maxnv) break;
@@ -262,7 +345,8 @@ static int find_samples(MidSong *song, MidEvent *e, int *vlist)
 	      closest = sp;
 	    }
 	}
-      vlist[nv] = find_voice(song, e);
+      if ((vlist[nv] = find_voice(song, e)) < 0)
+	return 0;
       song->voice[vlist[nv]].orig_frequency = f;
       song->voice[vlist[nv]].sample = closest;
       nv++;
@@ -271,16 +355,19 @@ static int find_samples(MidSong *song, MidEvent *e, int *vlist)
   return nv;
 }
 
-static void start_note(MidSong *song, MidEvent *e, int i)
+static sint32 lfo_depth(uint8 depth, double tuning)
 {
-  int j;
+  double d = (double)(depth << 7) * tuning;
+  return (d < 32767.0) ? (sint32)d : 32767;
+}
 
+static void start_note(MidSong *song, MidEvent *e, int i)
+{
   song->voice[i].status = VOICE_ON;
-  song->voice[i].channel = e->channel;
-  song->voice[i].note = e->a;
   song->voice[i].velocity = e->b;
   song->voice[i].sample_offset = 0;
   song->voice[i].sample_increment = 0; /* make sure it isn't negative */
+  song->voice[i].base_increment = 0;
 
   song->voice[i].tremolo_phase = 0;
   song->voice[i].tremolo_phase_increment = song->voice[i].sample->tremolo_phase_increment;
@@ -291,8 +378,12 @@ static void start_note(MidSong *song, MidEvent *e, int i)
   song->voice[i].vibrato_sweep_position = 0;
   song->voice[i].vibrato_control_ratio = song->voice[i].sample->vibrato_control_ratio;
   song->voice[i].vibrato_control_counter = song->voice[i].vibrato_phase = 0;
-  for (j=0; j<MID_VIBRATO_SAMPLE_INCREMENTS; j++)
-    song->voice[i].vibrato_sample_increment[j] = 0;
+
+  /* the depths as the LFOs use them, scaled to under 32768 */
+  song->voice[i].tremolo_depth =
+    lfo_depth(song->voice[i].sample->tremolo_depth, TREMOLO_AMPLITUDE_TUNING);
+  song->voice[i].vibrato_depth =
+    lfo_depth(song->voice[i].sample->vibrato_depth, VIBRATO_AMPLITUDE_TUNING);
 
   if (song->channel[e->channel].panning != NO_PANNING)
     song->voice[i].panning = song->channel[e->channel].panning;
@@ -313,8 +404,15 @@ static void start_note(MidSong *song, MidEvent *e, int i)
   else
     {
       song->voice[i].envelope_increment = 0;
+      song->voice[i].control_counter = 0;
       apply_envelope_to_amp(song, i);
     }
+  /* notes start right at their volumes: there's nothing to ramp from */
+  song->voice[i].left_ramp = song->voice[i].left_mix << RAMP_BITS;
+  song->voice[i].right_ramp = song->voice[i].right_mix << RAMP_BITS;
+  song->voice[i].left_gain_ramp = song->voice[i].left_gain;
+  song->voice[i].right_gain_ramp = song->voice[i].right_gain;
+  offer_victim(song, i);
 }
 
 static void kill_note(MidSong *song, int i)
@@ -322,60 +420,238 @@ static void kill_note(MidSong *song, int i)
   song->voice[i].status = VOICE_DIE;
 }
 
-/* Only one instance of a note can be playing on a single channel. */
-static int find_voice(MidSong *song, MidEvent *e)
+/* What a voice is worth keeping when one has to be cut: released notes
+   go before sustained ones, and those before the ones still held, then
+   the quietest first, weighed by the priority of their channel. */
+static sint32 voice_worth(MidSong *song, int i)
+{
+  MidVoice *vp = &song->voice[i];
+  sint32 v = vp->left_mix;
+
+  if (vp->panned == PANNED_MYSTERY && vp->right_mix > v)
+    v = vp->right_mix;
+  v *= song->channel[vp->channel].priority + 1;
+  if (vp->status == VOICE_SUSTAINED)
+    v += 1 << 24;
+  else if (vp->status == VOICE_ON)
+    v += 2 << 24;
+  return v;
+}
+
+static void weigh_victim(MidSong *song, int i, int *lowest, sint32 *lv)
 {
-  int i = song->voices, lowest=-1;
-  sint32 lv=0x7FFFFFFF, v;
+  sint32 v;
 
-  while (i--)
+  if (song->voice[i].status == VOICE_FREE ||
+      song->voice[i].status == VOICE_DIE)
+    return; /* about to start, or already on its way out */
+  v = voice_worth(song, i);
+  if (v < *lv)
     {
-      if (song->voice[i].status == VOICE_FREE)
-	lowest=i; /* Can't get a lower volume than silence */
-      else if (song->voice[i].channel==e->channel && 
-	       (song->voice[i].note==e->a || song->channel[song->voice[i].channel].mono))
-	kill_note(song, i);
+      *lv = v;
+      *lowest = i;
     }
+}
 
-  if (lowest != -1)
+/* Of two voices worth the same, the one further down voice_list goes
+   first, as it always has */
+static int worth_less(sint32 v, int pos, sint32 than, int than_pos)
+{
+  return v < than || (v == than && pos > than_pos);
+}
+
+/* With every voice in use, a note that starts cuts the one worth the
+   least of all, so the STEAL_CANDIDATES cheapest are kept in
+   song->victim, and the others are worth at least victim_limit. The
+   mixing moves the volumes, so they are found again after each block,
+   at the first note that needs one. Until then, every voice that
+   changes in worth is offered to them, which keeps victim_worth up to
+   date; a voice in use keeps its place in voice_list too, which
+   settles the ties. */
+static void offer_victim(MidSong *song, int i)
+{
+  int k, top = 0, pos = song->voice[i].list_pos;
+  sint32 v;
+
+  if (song->victims < 0)
+    return;
+  v = voice_worth(song, i);
+  for (k = 0; k < song->victims; k++)
+    if (song->victim[k] == i)
+      {
+	song->victim_worth[k] = v;
+	return;
+      }
+  if (song->voice[i].status == VOICE_FREE ||
+      song->voice[i].status == VOICE_DIE ||
+      !worth_less(v, pos, song->victim_limit, song->victim_limit_pos))
+    return;
+  if (song->victims < STEAL_CANDIDATES)
     {
-      /* Found a free voice. */
-      return lowest;
+      song->victim[song->victims] = i;
+      song->victim_worth[song->victims++] = v;
+      return;
     }
 
-  /* Look for the decaying note with the lowest volume */
-  i = song->voices;
-  while (i--)
+  /* one has to go, and whatever it's worth is the limit now */
+  for (k = 0; k < STEAL_CANDIDATES; k++)
     {
-      if ((song->voice[i].status != VOICE_ON) &&
-	  (song->voice[i].status != VOICE_DIE))
+      if (song->voice[song->victim[k]].status == VOICE_FREE ||
+	  song->voice[song->victim[k]].status == VOICE_DIE)
+	break; /* cut already */
+      if (worth_less(song->victim_worth[top],
+		     song->voice[song->victim[top]].list_pos,
+		     song->victim_worth[k],
+		     song->voice[song->victim[k]].list_pos))
+	top = k;
+    }
+  if (k < STEAL_CANDIDATES)
+    top = k;
+  else if (worth_less(song->victim_worth[top],
+		      song->voice[song->victim[top]].list_pos, v, pos))
+    {
+      song->victim_limit = v;
+      song->victim_limit_pos = pos;
+      return;
+    }
+  else if (worth_less(song->victim_worth[top],
+		      song->voice[song->victim[top]].list_pos,
+		      song->victim_limit, song->victim_limit_pos))
+    {
+      song->victim_limit = song->victim_worth[top];
+      song->victim_limit_pos = song->voice[song->victim[top]].list_pos;
+    }
+  song->victim[top] = i;
+  song->victim_worth[top] = v;
+}
+
+static void find_victims(MidSong *song)
+{
+  int n;
+
+  song->victims = 0;
+  song->victim_limit = 0x7FFFFFFF;
+  song->victim_limit_pos = -1;
+  for (n = song->active_voices; n--; )
+    offer_victim(song, song->voice_list[n]);
+}
+
+static int cheapest_victim(MidSong *song)
+{
+  int k, i, lowest = -1;
+  sint32 lv = 0;
+
+  for (k = 0; k < song->victims; k++)
+    {
+      i = song->victim[k];
+      if (song->voice[i].status == VOICE_FREE ||
+	  song->voice[i].status == VOICE_DIE)
+	continue;
+      if (lowest < 0 || worth_less(song->victim_worth[k],
+				   song->voice[i].list_pos,
+				   lv, song->voice[lowest].list_pos))
 	{
-	  v = song->voice[i].left_mix;
-	  if ((song->voice[i].panned == PANNED_MYSTERY)
-	      && (song->voice[i].right_mix > v))
-	    v = song->voice[i].right_mix;
-	  if (v<lv)
-	    {
-	      lv=v;
-	      lowest=i;
-	    }
+	  lv = song->victim_worth[k];
+	  lowest = i;
 	}
     }
+  if (lowest >= 0 && !worth_less(lv, song->voice[lowest].list_pos,
+				 song->victim_limit, song->victim_limit_pos))
+    return -1; /* some have gone up, and one of the others may be less */
+  return lowest;
+}
 
-  if (lowest != -1)
-    {
-      /* This can still cause a click, but if we had a free voice to
-	 spare for ramping down this note, we wouldn't need to kill it
-	 in the first place... Still, this needs to be fixed. Perhaps
-	 we could use a reserve of voices to play dying notes only. */
+/* The voice to cut, of a channel or of all of them (c = -1), or -1 */
+static int find_victim(MidSong *song, int c)
+{
+  int i, lowest=-1;
+  sint32 lv=0x7FFFFFFF;
 
-      song->cut_notes++;
-      song->voice[lowest].status=VOICE_FREE;
+  if (c >= 0)
+    {
+      for (i = song->channel_voices[c]; i >= 0; i = song->voice[i].channel_next)
+	weigh_victim(song, i, &lowest, &lv);
       return lowest;
     }
+
+  if (song->victims >= 0 && (lowest = cheapest_victim(song)) >= 0)
+    return lowest;
+  find_victims(song);
+  return cheapest_victim(song);
+}
+
+/* The notes a channel plays, not counting the ones dying */
+static int channel_notes(MidSong *song, int c)
+{
+  int i, n = 0;
+
+  for (i = song->channel_voices[c]; i >= 0; i = song->voice[i].channel_next)
+    if (song->voice[i].status != VOICE_DIE)
+      n++;
+  return n;
+}
+
+/* Only one instance of a note can be playing on a single channel.
+   The voice found is taken for the note right away, so that the other
+   samples of the note get voices of their own. Returns -1 if the note
+   is lost. */
+static int find_voice(MidSong *song, MidEvent *e)
+{
+  int c = e->channel, i, victim;
+
+  if (song->channel[c].mono)
+    {
+      for (i = song->channel_voices[c]; i >= 0; i = song->voice[i].channel_next)
+	if (song->voice[i].status != VOICE_FREE)
+	  kill_note(song, i);
+    }
   else
-    song->lost_notes++;
-  return 0;
+    {
+      for (i = song->key_voices[c][e->a & 0x7f]; i >= 0; i = song->voice[i].key_next)
+	if (song->voice[i].status != VOICE_FREE)
+	  kill_note(song, i);
+    }
+
+  if (song->channel[c].max_voices > 0 &&
+      channel_notes(song, c) >= song->channel[c].max_voices)
+    victim = find_victim(song, c);
+  else if (song->active_voices < song->voices)
+    {
+      /* Found a free voice. Can't get a lower volume than silence. */
+      i = song->voice_list[song->active_voices];
+      take_voice(song, i, c, e->a);
+      return i;
+    }
+  else
+    {
+      victim = find_victim(song, -1);
+      /* a note held on a channel that comes first isn't cut for it */
+      if (victim >= 0 && song->voice[victim].status == VOICE_ON &&
+	  song->channel[song->voice[victim].channel].priority > song->channel[c].priority)
+	victim = -1;
+    }
+
+  if (victim < 0)
+    {
+      song->lost_notes++;
+      return -1;
+    }
+
+  song->cut_notes++;
+  if (song->active_voices < song->voices + song->reserve_voices)
+    {
+      /* fade the note out on the voice it's on, and take another */
+      kill_note(song, victim);
+      i = song->voice_list[song->active_voices];
+    }
+  else
+    {
+      /* no voice to spare: this can still cause a click */
+      song->voice[victim].status = VOICE_FREE;
+      i = victim;
+    }
+  take_voice(song, i, c, e->a);
+  return i;
 }
 
 static void note_on(MidSong *song)
@@ -407,21 +683,21 @@ static void finish_note(MidSong *song, int i)
 	 hits the end of its data (ofs>=data_length). */
       song->voice[i].status = VOICE_OFF;
     }
+  offer_victim(song, i);
 }
 
 static void note_off(MidSong *song)
 {
-  int i = song->voices;
   MidEvent *e = song->current_event;
+  int i = song->key_voices[e->channel][e->a & 0x7f];
 
-  while (i--)
-    if (song->voice[i].status == VOICE_ON &&
-	song->voice[i].channel == e->channel &&
-	song->voice[i].note == e->a)
+  for (; i >= 0; i = song->voice[i].key_next)
+    if (song->voice[i].status == VOICE_ON)
       {
 	if (song->channel[e->channel].sustain)
 	  {
 	    song->voice[i].status = VOICE_SUSTAINED;
+	    offer_victim(song, i);
 	  }
 	else
 	  finish_note(song, i);
@@ -431,16 +707,18 @@ static void note_off(MidSong *song)
 /* Process the All Notes Off event */
 static void all_notes_off(MidSong *song)
 {
-  int i = song->voices;
   int c = song->current_event->channel;
+  int i = song->channel_voices[c];
 
   DEBUG_MSG("All notes off on channel %d\n", c);
-  while (i--)
-    if (song->voice[i].status == VOICE_ON &&
-	song->voice[i].channel == c)
+  for (; i >= 0; i = song->voice[i].channel_next)
+    if (song->voice[i].status == VOICE_ON)
       {
 	if (song->channel[c].sustain) 
-	  song->voice[i].status = VOICE_SUSTAINED;
+	  {
+	    song->voice[i].status = VOICE_SUSTAINED;
+	    offer_victim(song, i);
+	  }
 	else
 	  finish_note(song, i);
       }
@@ -449,12 +727,11 @@ static void all_notes_off(MidSong *song)
 /* Process the All Sounds Off event */
 static void all_sounds_off(MidSong *song)
 {
-  int i = song->voices;
   int c = song->current_event->channel;
+  int i = song->channel_voices[c];
 
-  while (i--)
-    if (song->voice[i].channel == c && 
-	song->voice[i].status != VOICE_FREE &&
+  for (; i >= 0; i = song->voice[i].channel_next)
+    if (song->voice[i].status != VOICE_FREE &&
 	song->voice[i].status != VOICE_DIE)
       {
 	kill_note(song, i);
@@ -464,37 +741,36 @@ static void all_sounds_off(MidSong *song)
 static void adjust_pressure(MidSong *song)
 {
   MidEvent *e = song->current_event;
-  int i = song->voices;
+  int i = song->key_voices[e->channel][e->a & 0x7f];
 
-  while (i--)
-    if (song->voice[i].status == VOICE_ON &&
-	song->voice[i].channel == e->channel &&
-	song->voice[i].note == e->a)
+  for (; i >= 0; i = song->voice[i].key_next)
+    if (song->voice[i].status == VOICE_ON)
       {
 	song->voice[i].velocity = e->b;
 	recompute_amp(song, i);
 	apply_envelope_to_amp(song, i);
+	offer_victim(song, i);
 	return;
       }
 }
 
 static void drop_sustain(MidSong *song)
 {
-  int i = song->voices;
   int c = song->current_event->channel;
+  int i = song->channel_voices[c];
 
-  while (i--)
-    if (song->voice[i].status == VOICE_SUSTAINED && song->voice[i].channel == c)
+  for (; i >= 0; i = song->voice[i].channel_next)
+    if (song->voice[i].status == VOICE_SUSTAINED)
       finish_note(song, i);
 }
 
 static void adjust_pitchbend(MidSong *song)
 {
   int c = song->current_event->channel;
-  int i = song->voices;
+  int i = song->channel_voices[c];
 
-  while (i--)
-    if (song->voice[i].status != VOICE_FREE && song->voice[i].channel == c)
+  for (; i >= 0; i = song->voice[i].channel_next)
+    if (song->voice[i].status != VOICE_FREE)
       {
 	recompute_freq(song, i);
       }
@@ -503,14 +779,14 @@ static void adjust_pitchbend(MidSong *song)
 static void adjust_volume(MidSong *song)
 {
   int c = song->current_event->channel;
-  int i = song->voices;
+  int i = song->channel_voices[c];
 
-  while (i--)
-    if (song->voice[i].channel == c &&
-	(song->voice[i].status==VOICE_ON || song->voice[i].status==VOICE_SUSTAINED))
+  for (; i >= 0; i = song->voice[i].channel_next)
+    if (song->voice[i].status==VOICE_ON || song->voice[i].status==VOICE_SUSTAINED)
       {
 	recompute_amp(song, i);
 	apply_envelope_to_amp(song, i);
+	offer_victim(song, i);
       }
 }
 
@@ -598,19 +874,68 @@ static void skip_to(MidSong *song, sint32 until_time)
     seek_forward(song, until_time);
 }
 
+/* Going through the list from the back, a voice that ends is swapped
+   with one that has been mixed already */
 static void do_compute_data(MidSong *song, sint32 count)
 {
-  int i;
-  memset(song->common_buffer, 0,
-	 (song->encoding & PE_MONO) ? (count * 4) : (count * 8));
-  for (i = 0; i < song->voices; i++)
+  int n = song->active_voices, i;
+  if (song->encoding & PE_FLOAT)
+    memset(song->float_buffer, 0,
+	   (song->encoding & PE_MONO) ? (count * 4) : (count * 8));
+  else
+    memset(song->common_buffer, 0,
+	   (song->encoding & PE_MONO) ? (count * 4) : (count * 8));
+  if (song->encoding & PE_FLOAT)
     {
-      if(song->voice[i].status != VOICE_FREE)
-	mix_voice(song, song->common_buffer, i, count);
+      while (n--)
+	{
+	  i = song->voice_list[n];
+	  if(song->voice[i].status != VOICE_FREE)
+	    mix_voice_float(song, song->float_buffer, i, count);
+	}
+    }
+  else
+    mix_voices(song, song->common_buffer, count);
+
+  /* the voices that ended are dropped once all are mixed */
+  n = song->active_voices;
+  while (n--)
+    {
+      i = song->voice_list[n];
+      if(song->voice[i].status == VOICE_FREE)
+	{
+	  if (song->voice[i].culled)
+	    {
+	      song->culled_notes++;
+	      song->voice[i].culled = 0;
+	    }
+	  drop_voice(song, i);
+	}
     }
+  song->victims = -1; /* the volumes have moved */
   song->current_sample += count;
 }
 
+/* float output needs no converting: it is copied as it was mixed, or
+   parted into the two planes */
+static void write_float(MidSong *song, sint8 *stream, sint32 count)
+{
+  float *lp = song->float_buffer, *left, *right;
+
+  if (!(song->encoding & PE_PLANAR))
+    {
+      memcpy(stream, lp, count * song->bytes_per_sample);
+      return;
+    }
+  left = (float *) stream;
+  right = (float *) (stream + song->plane_bytes);
+  while (count--)
+    {
+      *left++ = *lp++;
+      *right++ = *lp++;
+    }
+}
+
 /* count=0 means flush remaining buffered data to output device, then
    flush the device itself */
 static void compute_data(MidSong *song, sint8 **stream, sint32 count)
@@ -627,8 +952,14 @@ static void compute_data(MidSong *song, sint8 **stream, sint32 count)
     if (block > song->buffer_size)
       block = song->buffer_size;
     do_compute_data(song, block);
-    song->write(*stream, song->common_buffer, channels * block);
-    *stream += song->bytes_per_sample * block;
+    if (song->encoding & PE_FLOAT)
+      write_float(song, *stream, block);
+    else
+      song->write(*stream, song->common_buffer, channels * block);
+    if (song->encoding & PE_PLANAR)
+      *stream += sizeof(float) * block; /* along the left plane */
+    else
+      *stream += song->bytes_per_sample * block;
     count -= block;
   }
 }
@@ -661,6 +992,11 @@ uint32 mid_song_get_time(MidSong *song)
   return retvalue;
 }
 
+uint32 mid_song_get_culled_notes(MidSong *song)
+{
+  return song->culled_notes;
+}
+
 char *mid_song_get_meta(MidSong *song, MidSongMetaId what)
 {
   return (what < 0 || what >= MID_META_MAX)? NULL : song->meta_data[what];
@@ -669,11 +1005,13 @@ char *mid_song_get_meta(MidSong *song, MidSongMetaId what)
 size_t mid_song_read_wave(MidSong *song, sint8 *ptr, size_t size)
 {
   sint32 start_sample, end_sample, samples;
+  sint8 *base = ptr;
 
   if (!song->playing)
     return 0;
 
   samples = size / song->bytes_per_sample;
+  song->plane_bytes = samples * sizeof(float);
 
   start_sample = song->current_sample;
   end_sample = song->current_sample+samples;
@@ -770,8 +1108,13 @@ size_t mid_song_read_wave(MidSong *song, sint8 *ptr, size_t size)
 		     song->current_sample/song->rate+2);
 	  DEBUG_MSG("Notes cut: %d\n", song->cut_notes);
 	  DEBUG_MSG("Notes lost totally: %d\n", song->lost_notes);
+	  DEBUG_MSG("Notes culled: %d\n", song->culled_notes);
 	  song->playing = 0;
-	  return (song->current_sample - start_sample) * song->bytes_per_sample;
+	  samples = song->current_sample - start_sample;
+	  if (song->encoding & PE_PLANAR) /* the right plane follows the left */
+	    memmove(base + samples * sizeof(float), base + song->plane_bytes,
+		    samples * sizeof(float));
+	  return samples * song->bytes_per_sample;
         }
       song->current_event++;
     }
@@ -785,7 +1128,7 @@ size_t mid_song_read_wave(MidSong *song, sint8 *ptr, size_t size)
 
 void mid_song_set_volume(MidSong *song, int volume)
 {
-  int i;
+  int n, i;
   if (volume > MAX_AMPLIFICATION)
     song->amplification = MAX_AMPLIFICATION;
   else
@@ -794,10 +1137,27 @@ void mid_song_set_volume(MidSong *song, int volume)
   else
     song->amplification = volume;
   adjust_amplification(song);
-  for (i = 0; i < song->voices; i++)
-    if (song->voice[i].status != VOICE_FREE)
-      {
-	recompute_amp(song, i);
-	apply_envelope_to_amp(song, i);
-      }
+  for (n = 0; n < song->active_voices; n++)
+    {
+      i = song->voice_list[n];
+      if (song->voice[i].status != VOICE_FREE)
+	{
+	  recompute_amp(song, i);
+	  apply_envelope_to_amp(song, i);
+	}
+    }
+  song->victims = -1;
+}
+
+void mid_song_set_channel_voices(MidSong *song, int channel, int priority, int max_voices)
+{
+  if (channel < 0 || channel > 15)
+    return;
+  if (priority < 0)
+    priority = 0;
+  else if (priority > 127)
+    priority = 127;
+  song->channel[channel].priority = priority;
+  song->victims = -1;
+  song->channel[channel].max_voices = (max_voices > 0) ? max_voices : 0;
 }
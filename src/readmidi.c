@@ -42,6 +42,20 @@
 #include "readmidi.h"
 #include "playmidi.h"
 
+/* Everything kept while reading the events of a file: each song load
+   has its own, so that several files can be read at the same time. */
+typedef struct _MidParser MidParser;
+struct _MidParser
+{
+  MidIStream *stream;
+  MidSong *song;
+  MidEventList *evlist;
+  sint32 event_count;
+  sint32 at;
+  uint8 laststatus, lastchan;
+  uint8 nrpn, rpn_msb[16], rpn_lsb[16]; /* one per channel */
+};
+
 /* Computes how many (fractional) samples one MIDI delta-time unit contains */
 static void compute_sample_increment(MidSong *song, sint32 tempo,
 				     sint32 divisions)
@@ -129,17 +143,17 @@ static int read_meta_data(MidIStream *stream, MidSong *song, sint32 len, uint8 t
 
 /* Read a MIDI event, returning a freshly allocated element that can
    be linked to the event list */
-static MidEventList *read_midi_event(MidIStream *stream, MidSong *song)
+static MidEventList *read_midi_event(MidParser *p)
 {
-  static uint8 laststatus, lastchan;
-  static uint8 nrpn=0, rpn_msb[16], rpn_lsb[16]; /* one per channel */
+  MidIStream *stream = p->stream;
+  MidSong *song = p->song;
   uint8 me, type, a,b,c;
   sint32 len;
   MidEventList *newlist;
 
   for (;;)
     {
-      song->at += getvl(stream);
+      p->at += getvl(stream);
       if (mid_istream_read(stream, &me, 1, 1) != 1)
 	{
 	  DEBUG_MSG("read_midi_event: mid_istream_read() failure\n");
@@ -169,7 +183,7 @@ static MidEventList *read_midi_event(MidIStream *stream, MidSong *song)
 		mid_istream_read(stream, &a, 1, 1);
 		mid_istream_read(stream, &b, 1, 1);
 		mid_istream_read(stream, &c, 1, 1);
-		MIDIEVENT(song->at, ME_TEMPO, c, a, b);
+		MIDIEVENT(p->at, ME_TEMPO, c, a, b);
 
 	      default:
 		DEBUG_MSG("(Meta event type 0x%02x, length %d)\n", type, len);
@@ -182,27 +196,27 @@ static MidEventList *read_midi_event(MidIStream *stream, MidSong *song)
 	  a=me;
 	  if (a & 0x80) /* status byte */
 	    {
-	      lastchan=a & 0x0F;
-	      laststatus=(a>>4) & 0x07;
+	      p->lastchan=a & 0x0F;
+	      p->laststatus=(a>>4) & 0x07;
 	      mid_istream_read(stream, &a, 1, 1);
 	      a &= 0x7F;
 	    }
-	  switch(laststatus)
+	  switch(p->laststatus)
 	    {
 	    case 0: /* Note off */
 	      mid_istream_read(stream, &b, 1, 1);
 	      b &= 0x7F;
-	      MIDIEVENT(song->at, ME_NOTEOFF, lastchan, a,b);
+	      MIDIEVENT(p->at, ME_NOTEOFF, p->lastchan, a,b);
 
 	    case 1: /* Note on */
 	      mid_istream_read(stream, &b, 1, 1);
 	      b &= 0x7F;
-	      MIDIEVENT(song->at, ME_NOTEON, lastchan, a,b);
+	      MIDIEVENT(p->at, ME_NOTEON, p->lastchan, a,b);
 
 	    case 2: /* Key Pressure */
 	      mid_istream_read(stream, &b, 1, 1);
 	      b &= 0x7F;
-	      MIDIEVENT(song->at, ME_KEYPRESSURE, lastchan, a, b);
+	      MIDIEVENT(p->at, ME_KEYPRESSURE, p->lastchan, a, b);
 
 	    case 3: /* Control change */
 	      mid_istream_read(stream, &b, 1, 1);
@@ -236,20 +250,20 @@ static MidEventList *read_midi_event(MidIStream *stream, MidSong *song)
 #endif
 		    break;
 
-		  case 100: nrpn=0; rpn_msb[lastchan]=b; break;
-		  case 101: nrpn=0; rpn_lsb[lastchan]=b; break;
-		  case 99: nrpn=1; rpn_msb[lastchan]=b; break;
-		  case 98: nrpn=1; rpn_lsb[lastchan]=b; break;
+		  case 100: p->nrpn=0; p->rpn_msb[p->lastchan]=b; break;
+		  case 101: p->nrpn=0; p->rpn_lsb[p->lastchan]=b; break;
+		  case 99: p->nrpn=1; p->rpn_msb[p->lastchan]=b; break;
+		  case 98: p->nrpn=1; p->rpn_lsb[p->lastchan]=b; break;
 
 		  case 6:
-		    if (nrpn)
+		    if (p->nrpn)
 		      {
 			DEBUG_MSG("(Data entry (MSB) for NRPN %02x,%02x: %d)\n",
-				rpn_msb[lastchan], rpn_lsb[lastchan], b);
+				p->rpn_msb[p->lastchan], p->rpn_lsb[p->lastchan], b);
 			break;
 		      }
 
-		    switch((rpn_msb[lastchan]<<8) | rpn_lsb[lastchan])
+		    switch((p->rpn_msb[p->lastchan]<<8) | p->rpn_lsb[p->lastchan])
 		      {
 		      case 0x0000: /* Pitch bend sensitivity */
 			control=ME_PITCH_SENS;
@@ -257,11 +271,11 @@ static MidEventList *read_midi_event(MidIStream *stream, MidSong *song)
 
 		      case 0x7F7F: /* RPN reset */
 			/* reset pitch bend sensitivity to 2 */
-			MIDIEVENT(song->at, ME_PITCH_SENS, lastchan, 2, 0);
+			MIDIEVENT(p->at, ME_PITCH_SENS, p->lastchan, 2, 0);
 
 		      default:
 			DEBUG_MSG("(Data entry (MSB) for RPN %02x,%02x: %d)\n",
-				rpn_msb[lastchan], rpn_lsb[lastchan], b);
+				p->rpn_msb[p->lastchan], p->rpn_lsb[p->lastchan], b);
 			break;
 		      }
 		    break;
@@ -272,14 +286,14 @@ static MidEventList *read_midi_event(MidIStream *stream, MidSong *song)
 		  }
 		if (control != 255)
 		  {
-		    MIDIEVENT(song->at, control, lastchan, b, 0);
+		    MIDIEVENT(p->at, control, p->lastchan, b, 0);
 		  }
 	      }
 	      break;
 
 	    case 4: /* Program change */
 	      a &= 0x7f;
-	      MIDIEVENT(song->at, ME_PROGRAM, lastchan, a, 0);
+	      MIDIEVENT(p->at, ME_PROGRAM, p->lastchan, a, 0);
 
 	    case 5: /* Channel pressure - NOT IMPLEMENTED */
 	      break;
@@ -287,11 +301,11 @@ static MidEventList *read_midi_event(MidIStream *stream, MidSong *song)
 	    case 6: /* Pitch wheel */
 	      mid_istream_read(stream, &b, 1, 1);
 	      b &= 0x7F;
-	      MIDIEVENT(song->at, ME_PITCHWHEEL, lastchan, a, b);
+	      MIDIEVENT(p->at, ME_PITCHWHEEL, p->lastchan, a, b);
 
 	    default:
 	      DEBUG_MSG("*** Can't happen: status 0x%02X, channel 0x%02X\n",
-		      laststatus, lastchan);
+		      p->laststatus, p->lastchan);
 	      break;
 	    }
 	}
@@ -304,24 +318,25 @@ static MidEventList *read_midi_event(MidIStream *stream, MidSong *song)
 
 /* Read a midi track into the linked list, either merging with any previous
    tracks or appending to them. */
-static int read_track(MidIStream *stream, MidSong *song, int append)
+static int read_track(MidParser *p, int append)
 {
+  MidIStream *stream = p->stream;
   MidEventList *meep;
   MidEventList *next, *newlist;
   sint32 len;
   long next_pos, pos;
   char tmp[4];
 
-  meep = song->evlist;
+  meep = p->evlist;
   if (append && meep)
     {
       /* find the last event in the list */
       for (; meep->next; meep=meep->next)
 	;
-      song->at = meep->event.time;
+      p->at = meep->event.time;
     }
   else
-    song->at=0;
+    p->at=0;
 
   /* Check the formalities */
   if (mid_istream_read(stream, tmp, 1, 4) != 4 || mid_istream_read(stream, &len, 4, 1) != 1)
@@ -339,7 +354,7 @@ static int read_track(MidIStream *stream, MidSong *song, int append)
 
   for (;;)
     {
-      if (!(newlist=read_midi_event(stream, song))) /* Some kind of error  */
+      if (!(newlist=read_midi_event(p))) /* Some kind of error  */
 	return -2;
 
       if (newlist==MAGIC_EOT) /* End-of-track Hack. */
@@ -362,32 +377,33 @@ static int read_track(MidIStream *stream, MidSong *song, int append)
       newlist->next=next;
       meep->next=newlist;
 
-      song->event_count++; /* Count the event. (About one?) */
+      p->event_count++; /* Count the event. (About one?) */
       meep=newlist;
     }
 }
 
 /* Free the linked event list from memory. */
-static void free_midi_list(MidSong *song)
+static void free_midi_list(MidParser *p)
 {
   MidEventList *meep, *next;
-  meep = song->evlist;
+  meep = p->evlist;
   while (meep)
     {
       next=meep->next;
       timi_free(meep);
       meep=next;
     }
-  song->evlist = NULL;
+  p->evlist = NULL;
 }
 
 /* Allocate an array of MidiEvents and fill it from the linked list of
    events, marking used instruments for loading. Convert event times to
    samples: handle tempo changes. Strip unnecessary events from the list.
    Free the linked list. */
-static MidEvent *groom_list(MidSong *song, sint32 divisions,sint32 *eventsp,
+static MidEvent *groom_list(MidParser *p, sint32 divisions,sint32 *eventsp,
 			     sint32 *samplesp)
 {
+  MidSong *song = p->song;
   MidEvent *groomed_list, *lp;
   MidEventList *meep;
   sint32 i, our_event_count, tempo, skip_this_event, new_value;
@@ -407,19 +423,19 @@ static MidEvent *groom_list(MidSong *song, sint32 divisions,sint32 *eventsp,
   compute_sample_increment(song, tempo, divisions);
 
   /* This may allocate a bit more than we need */
-  groomed_list=lp=(MidEvent *) timi_malloc(sizeof(MidEvent) * (song->event_count+1));
+  groomed_list=lp=(MidEvent *) timi_malloc(sizeof(MidEvent) * (p->event_count+1));
   if (!groomed_list) {
     song->oom=1;
-    free_midi_list(song);
+    free_midi_list(p);
     return NULL;
   }
-  meep=song->evlist;
+  meep=p->evlist;
 
   our_event_count=0;
   st=at=sample_cum=0;
   counting_time=2; /* We strip any silence before the first NOTE ON. */
 
-  for (i = 0; i < song->event_count; i++)
+  for (i = 0; i < p->event_count; i++)
     {
       skip_this_event=0;
 
@@ -516,7 +532,7 @@ static MidEvent *groom_list(MidSong *song, sint32 divisions,sint32 *eventsp,
 	  if (st >= 2147483647 - samples_to_do) {
 	  _overflow:
 	      DEBUG_MSG("Overflow in sample counter\n");
-	      free_midi_list(song);
+	      free_midi_list(p);
 	      timi_free(groomed_list);
 	      return NULL;
 	    }
@@ -544,7 +560,7 @@ static MidEvent *groom_list(MidSong *song, sint32 divisions,sint32 *eventsp,
   lp->time=st;
   lp->type=ME_EOT;
   our_event_count++;
-  free_midi_list(song);
+  free_midi_list(p);
 
   *eventsp=our_event_count;
   *samplesp=st;
@@ -555,12 +571,13 @@ MidEvent *read_midi_file(MidIStream *stream, MidSong *song, sint32 *count, sint3
 {
   sint32 len, divisions;
   sint16 format, tracks, divisions_tmp;
+  MidParser parser;
   int i;
   char tmp[4];
 
-  song->event_count=0;
-  song->at=0;
-  song->evlist = NULL;
+  memset(&parser, 0, sizeof(parser));
+  parser.stream = stream;
+  parser.song = song;
 
   if (mid_istream_read(stream, tmp, 1, 4) != 4 ||
       mid_istream_read(stream, &len, 4, 1) != 1)
@@ -629,42 +646,42 @@ MidEvent *read_midi_file(MidIStream *stream, MidSong *song, sint32 *count, sint3
 	  format, tracks, divisions);
 
   /* Put a do-nothing event first in the list for easier processing */
-  song->evlist=(MidEventList *) timi_calloc(1, sizeof(MidEventList));
-  if (!song->evlist) {
+  parser.evlist=(MidEventList *) timi_calloc(1, sizeof(MidEventList));
+  if (!parser.evlist) {
     song->oom=1;
     return NULL;
   }
-  song->evlist->event.type=ME_NONE;
-  song->event_count++;
+  parser.evlist->event.type=ME_NONE;
+  parser.event_count++;
 
   switch(format)
     {
     case 0:
-      if (read_track(stream, song, 0))
+      if (read_track(&parser, 0))
 	{
-	  free_midi_list(song);
+	  free_midi_list(&parser);
 	  return NULL;
 	}
       break;
 
     case 1:
       for (i=0; i<tracks; i++)
-	if (read_track(stream, song, 0))
+	if (read_track(&parser, 0))
 	  {
-	    free_midi_list(song);
+	    free_midi_list(&parser);
 	    return NULL;
 	  }
       break;
 
     case 2: /* We simply play the tracks sequentially */
       for (i=0; i<tracks; i++)
-	if (read_track(stream, song, 1))
+	if (read_track(&parser, 1))
 	  {
-	    free_midi_list(song);
+	    free_midi_list(&parser);
 	    return NULL;
 	  }
       break;
     }
 
-  return groom_list(song, divisions, count, sp);
+  return groom_list(&parser, divisions, count, sp);
 }
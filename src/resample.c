@@ -35,6 +35,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "timidity_internal.h"
 #include "common.h"
@@ -45,24 +46,903 @@
 
 #define PRECALC_LOOP_COUNT(start, end, incr) (((end) - (start) + (incr) - 1) / (incr))
 
+/* SIMD versions of the inner loops, where the compiler has them, picked
+   by what the CPU can do when they're run: on x86, AVX2 for 16-bit
+   samples, then SSSE3 or SSE2 for increments below 2; on ARM, NEON for
+   increments below 2. The sinc and cubic dot products use SSE2 or NEON.
+   Configure with --disable-simd to use plain C only. */
+#if !defined(TIMIDITY_NO_SIMD) && (FRACTION_BITS <= 14)
+#if defined(__x86_64__) || defined(__i386__)
+#if (defined(__clang__) && (__clang_major__ >= 4)) || \
+    (!defined(__clang__) && defined(__GNUC__) && \
+     ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define RESAMPLE_SSE2
+#define RESAMPLE_SSSE3
+#define RESAMPLE_AVX2
+#define SIMD_TARGET(x) __attribute__((target(x)))
+#ifdef __SSE2__
+#define CPU_HAS_SSE2 1
+#else
+#define CPU_HAS_SSE2 __builtin_cpu_supports("sse2")
+#endif
+#define CPU_HAS_SSSE3 __builtin_cpu_supports("ssse3")
+#define CPU_HAS_AVX2 __builtin_cpu_supports("avx2")
+#endif
+#elif defined(_MSC_VER) && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RESAMPLE_SSE2
+#define SIMD_TARGET(x)
+#define CPU_HAS_SSE2 1
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)) && \
+      !defined(__ARM_BIG_ENDIAN)
+#define RESAMPLE_NEON
+#endif
+#endif /* TIMIDITY_NO_SIMD */
+
+#if defined(RESAMPLE_SSE2)
+#include <emmintrin.h>
+#endif
+#if defined(RESAMPLE_SSSE3)
+#include <tmmintrin.h>
+#endif
+#if defined(RESAMPLE_AVX2)
+#include <immintrin.h>
+#endif
+#if defined(RESAMPLE_NEON)
+#include <arm_neon.h>
+#endif
+
 /*************** resampling with fixed increment *****************/
 
-static sample_t *rs_plain(MidSong *song, int v, sint32 *countptr)
+/* The inner loops: count samples linearly interpolated from the sample
+   data, from *ofsp on by incr. 8-bit data is read as the 16-bit data it
+   used to be expanded to when it was loaded, so it sounds just the same
+   from half the memory. */
+static sample_t *run_16(sample_t *dest, const sint16 *src, sint32 *ofsp,
+			sint32 incr, sint32 count)
 {
-  /* Play sample until end, then free the voice. */
+  sample_t v1, v2;
+  sint32 ofs = *ofsp;
 
+  for (; count > 0; count--)
+    {
+      v1 = src[ofs >> FRACTION_BITS];
+      v2 = src[(ofs >> FRACTION_BITS)+1];
+      *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
+      ofs += incr;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+
+static sample_t *run_8(sample_t *dest, const sint8 *src, sint32 *ofsp,
+		       sint32 incr, sint32 count)
+{
   sample_t v1, v2;
+  sint32 ofs = *ofsp;
+
+  for (; count > 0; count--)
+    {
+      v1 = src[ofs >> FRACTION_BITS] * 256;
+      v2 = src[(ofs >> FRACTION_BITS)+1] * 256;
+      *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
+      ofs += incr;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+
+#if defined(RESAMPLE_SSE2) || defined(RESAMPLE_AVX2) || defined(RESAMPLE_NEON)
+/* All of these compute run_16 and run_8's
+
+     v1 + (((v2 - v1) * f) >> FRACTION_BITS)
+
+   for exactly the same results. The x86 ones have v1 in the low and v2
+   in the high half of 32 bits, and compute it as the
+   (v1 * ((1 << FRACTION_BITS) - f) + v2 * f) >> FRACTION_BITS it
+   equals: the two products of 16-bit numbers add up to one 32-bit
+   number. */
+
+#define FRACTION_ONE (1 << FRACTION_BITS)
+#endif
+
+#if defined(RESAMPLE_SSE2) || defined(RESAMPLE_NEON)
+/* For 0 < incr < 2, the samples a block is computed from lie close
+   together, so the ones around it are loaded at once and the pairs
+   picked out of them in the registers, instead of being fetched one by
+   one. A block stops at the last one whose samples are all in the
+   data, its guard samples included, and leaves the rest to run_16 or
+   run_8. Played faster than that, the samples are too far apart for a
+   window to hold much of them. */
+#define WINDOW_INCR (2 * FRACTION_ONE)
+#endif
+
+#if defined(RESAMPLE_SSE2)
+/* SSE2 has no shuffle by a register, so each 4 samples are computed
+   from the 8 pairs after the first one's, (s[j], s[j + 1]) for j up to
+   7, each of them spread over a register and kept where it's the one
+   wanted. j only goes up to 3 for incr < 1. */
+#define PICK_PAIR_SSE2(j, pairs)					\
+  p = _mm_or_si128(p, _mm_and_si128(_mm_cmpeq_epi32(d, _mm_set1_epi32(j)),	\
+				    _mm_shuffle_epi32(pairs, ((j) & 3) * 0x55)))
+
+SIMD_TARGET("sse2")
+static __m128i interpolate_sse2(__m128i w, __m128i w1, __m128i ofs,
+				sint32 i, int wide)
+{
+  __m128i lo = _mm_unpacklo_epi16(w, w1), hi = _mm_unpackhi_epi16(w, w1),
+    d = _mm_sub_epi32(_mm_srai_epi32(ofs, FRACTION_BITS), _mm_set1_epi32(i)),
+    p = _mm_setzero_si128(), f, g;
+
+  PICK_PAIR_SSE2(0, lo);
+  PICK_PAIR_SSE2(1, lo);
+  PICK_PAIR_SSE2(2, lo);
+  PICK_PAIR_SSE2(3, lo);
+  if (wide)
+    {
+      PICK_PAIR_SSE2(4, hi);
+      PICK_PAIR_SSE2(5, hi);
+      PICK_PAIR_SSE2(6, hi);
+    }
+  f = _mm_and_si128(ofs, _mm_set1_epi32(FRACTION_MASK));
+  g = _mm_or_si128(_mm_slli_epi32(f, 16),
+		   _mm_sub_epi32(_mm_set1_epi32(FRACTION_ONE), f));
+  return _mm_srai_epi32(_mm_madd_epi16(p, g), FRACTION_BITS);
+}
+
+/* the 9 samples from i on, 8-bit ones times 256 */
+SIMD_TARGET("sse2")
+static void window_sse2(const MidSample *sp, sint32 i, __m128i *w, __m128i *w1)
+{
+  if (sp->modes & MODES_16BIT)
+    {
+      const sint16 *src = (const sint16 *) sp->data + i;
+      *w = _mm_loadu_si128((const __m128i *) src);
+      *w1 = _mm_loadu_si128((const __m128i *) (src + 1));
+    }
+  else
+    {
+      const sint8 *src = (const sint8 *) sp->data + i;
+      *w = _mm_unpacklo_epi8(_mm_setzero_si128(),
+			     _mm_loadl_epi64((const __m128i *) src));
+      *w1 = _mm_unpacklo_epi8(_mm_setzero_si128(),
+			      _mm_loadl_epi64((const __m128i *) (src + 1)));
+    }
+}
+
+/* 8 samples at a time, as two blocks of 4. Returns where dest got to. */
+SIMD_TARGET("sse2")
+static sample_t *run_sse2(sample_t *dest, const MidSample *sp, sint32 *ofsp,
+			  sint32 incr, sint32 blocks)
+{
+  sint32 offsets[8], ofs = *ofsp, i,
+    end = (sp->data_length >> FRACTION_BITS) + 1 - 8;
+  __m128i a, b, step, w, w1, lo;
+  int k, wide = (incr >= FRACTION_ONE);
+
+  for (k = 0; k < 8; k++)
+    offsets[k] = ofs + incr * k;
+  a = _mm_loadu_si128((const __m128i *) offsets);
+  b = _mm_loadu_si128((const __m128i *) (offsets + 4));
+  step = _mm_set1_epi32(incr * 8);
+  for (; blocks > 0 && ((ofs + incr * 4) >> FRACTION_BITS) <= end; blocks--)
+    {
+      i = ofs >> FRACTION_BITS;
+      window_sse2(sp, i, &w, &w1);
+      lo = interpolate_sse2(w, w1, a, i, wide);
+      i = (ofs + incr * 4) >> FRACTION_BITS;
+      window_sse2(sp, i, &w, &w1);
+      _mm_storeu_si128((__m128i *) dest,
+		       _mm_packs_epi32(lo, interpolate_sse2(w, w1, b, i, wide)));
+      a = _mm_add_epi32(a, step);
+      b = _mm_add_epi32(b, step);
+      dest += 8;
+      ofs += incr * 8;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+#endif
+
+#if defined(RESAMPLE_SSSE3)
+/* With SSSE3, the 8 samples of a block are computed from the 16 after
+   the first one's, shuffled into place. */
+SIMD_TARGET("ssse3")
+static __m128i interpolate_ssse3(__m128i v1, __m128i v2, __m128i f)
+{
+  __m128i g = _mm_sub_epi16(_mm_set1_epi16(FRACTION_ONE), f);
+  __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(v1, v2), _mm_unpacklo_epi16(g, f)),
+	  hi = _mm_madd_epi16(_mm_unpackhi_epi16(v1, v2), _mm_unpackhi_epi16(g, f));
+  return _mm_packs_epi32(_mm_srai_epi32(lo, FRACTION_BITS),
+			 _mm_srai_epi32(hi, FRACTION_BITS));
+}
+
+/* the bytes of 16 bytes in two registers that ctl picks, 0 to 31: the
+   ones of lo made to look 112 higher, which leaves the high bit of the
+   others set, and those of hi 16 lower, which sets it for the others */
+SIMD_TARGET("ssse3")
+static __m128i shuffle2_ssse3(__m128i lo, __m128i hi, __m128i ctl)
+{
+  return _mm_or_si128(_mm_shuffle_epi8(lo, _mm_adds_epu8(ctl, _mm_set1_epi8(112))),
+		      _mm_shuffle_epi8(hi, _mm_sub_epi8(ctl, _mm_set1_epi8(16))));
+}
+
+/* 8 samples at a time. Returns where dest got to. */
+SIMD_TARGET("ssse3")
+static sample_t *run_ssse3(sample_t *dest, const MidSample *sp, sint32 *ofsp,
+			   sint32 incr, sint32 blocks)
+{
+  sint32 offsets[8], ofs = *ofsp, i,
+    end = (sp->data_length >> FRACTION_BITS) + 1 - 16;
+  __m128i a, b, step, d, ctl, f, lo, hi;
+  int k;
+
+  for (k = 0; k < 8; k++)
+    offsets[k] = ofs + incr * k;
+  a = _mm_loadu_si128((const __m128i *) offsets);
+  b = _mm_loadu_si128((const __m128i *) (offsets + 4));
+  step = _mm_set1_epi32(incr * 8);
+  for (; blocks > 0 && (i = ofs >> FRACTION_BITS) <= end; blocks--)
+    {
+      /* where each sample is from the first one's, 0 to 14 */
+      d = _mm_packs_epi32(_mm_sub_epi32(_mm_srai_epi32(a, FRACTION_BITS),
+					_mm_set1_epi32(i)),
+			  _mm_sub_epi32(_mm_srai_epi32(b, FRACTION_BITS),
+					_mm_set1_epi32(i)));
+      f = _mm_packs_epi32(_mm_and_si128(a, _mm_set1_epi32(FRACTION_MASK)),
+			  _mm_and_si128(b, _mm_set1_epi32(FRACTION_MASK)));
+      if (sp->modes & MODES_16BIT)
+	{
+	  const sint16 *src = (const sint16 *) sp->data + i;
+	  lo = _mm_loadu_si128((const __m128i *) src);
+	  hi = _mm_loadu_si128((const __m128i *) (src + 8));
+	  /* bytes 2d and 2d+1, then the sample after */
+	  ctl = _mm_add_epi16(_mm_mullo_epi16(d, _mm_set1_epi16(0x0202)),
+			      _mm_set1_epi16(0x0100));
+	  _mm_storeu_si128((__m128i *) dest, interpolate_ssse3(
+	    shuffle2_ssse3(lo, hi, ctl),
+	    shuffle2_ssse3(lo, hi, _mm_add_epi16(ctl, _mm_set1_epi16(0x0202))),
+	    f));
+	}
+      else
+	{
+	  const sint8 *src = (const sint8 *) sp->data + i;
+	  /* byte d as the high byte: times 256 */
+	  lo = _mm_loadu_si128((const __m128i *) src);
+	  ctl = _mm_or_si128(_mm_slli_epi16(d, 8), _mm_set1_epi16(0x80));
+	  _mm_storeu_si128((__m128i *) dest, interpolate_ssse3(
+	    _mm_shuffle_epi8(lo, ctl),
+	    _mm_shuffle_epi8(lo, _mm_add_epi16(ctl, _mm_set1_epi16(0x0100))),
+	    f));
+	}
+      a = _mm_add_epi32(a, step);
+      b = _mm_add_epi32(b, step);
+      dest += 8;
+      ofs += incr * 8;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+#endif
+
+#if defined(RESAMPLE_NEON)
+/* The same as run_ssse3, with table lookups for the shuffles. Bytes
+   past the 32 of the table come out 0. */
+static uint8x16_t lookup2_neon(uint8x16x2_t t, uint8x16_t ctl)
+{
+#if defined(__aarch64__) || defined(_M_ARM64)
+  return vqtbl2q_u8(t, ctl);
+#else
+  uint8x8x4_t t4;
+  t4.val[0] = vget_low_u8(t.val[0]);
+  t4.val[1] = vget_high_u8(t.val[0]);
+  t4.val[2] = vget_low_u8(t.val[1]);
+  t4.val[3] = vget_high_u8(t.val[1]);
+  return vcombine_u8(vtbl4_u8(t4, vget_low_u8(ctl)),
+		     vtbl4_u8(t4, vget_high_u8(ctl)));
+#endif
+}
+
+static int16x4_t interpolate_neon(int16x4_t v1, int16x4_t v2, int32x4_t ofs)
+{
+  int32x4_t f = vandq_s32(ofs, vdupq_n_s32(FRACTION_MASK));
+  return vmovn_s32(vaddw_s16(vshrq_n_s32(vmulq_s32(vsubl_s16(v2, v1), f),
+					 FRACTION_BITS), v1));
+}
+
+static sample_t *run_neon(sample_t *dest, const MidSample *sp, sint32 *ofsp,
+			  sint32 incr, sint32 blocks)
+{
+  sint32 offsets[8], ofs = *ofsp, i,
+    end = (sp->data_length >> FRACTION_BITS) + 1 - 16;
+  int32x4_t a, b, step;
+  uint16x8_t ctl, next;
+  uint8x16x2_t t;
+  int16x8_t v1, v2;
+  int k;
+
+  for (k = 0; k < 8; k++)
+    offsets[k] = ofs + incr * k;
+  a = vld1q_s32(offsets);
+  b = vld1q_s32(offsets + 4);
+  step = vdupq_n_s32(incr * 8);
+  for (; blocks > 0 && (i = ofs >> FRACTION_BITS) <= end; blocks--)
+    {
+      /* where each sample is from the first one's, 0 to 14 */
+      ctl = vreinterpretq_u16_s16(vcombine_s16(
+	vmovn_s32(vsubq_s32(vshrq_n_s32(a, FRACTION_BITS), vdupq_n_s32(i))),
+	vmovn_s32(vsubq_s32(vshrq_n_s32(b, FRACTION_BITS), vdupq_n_s32(i)))));
+      if (sp->modes & MODES_16BIT)
+	{
+	  const sint16 *src = (const sint16 *) sp->data + i;
+	  t.val[0] = vreinterpretq_u8_s16(vld1q_s16(src));
+	  t.val[1] = vreinterpretq_u8_s16(vld1q_s16(src + 8));
+	  /* bytes 2d and 2d+1, then the sample after */
+	  ctl = vmlaq_u16(vdupq_n_u16(0x0100), ctl, vdupq_n_u16(0x0202));
+	  next = vaddq_u16(ctl, vdupq_n_u16(0x0202));
+	}
+      else
+	{
+	  const sint8 *src = (const sint8 *) sp->data + i;
+	  t.val[0] = vreinterpretq_u8_s8(vld1q_s8(src));
+	  t.val[1] = vdupq_n_u8(0);
+	  /* byte d as the high byte: times 256 */
+	  ctl = vorrq_u16(vshlq_n_u16(ctl, 8), vdupq_n_u16(0xFF));
+	  next = vaddq_u16(ctl, vdupq_n_u16(0x0100));
+	}
+      v1 = vreinterpretq_s16_u8(lookup2_neon(t, vreinterpretq_u8_u16(ctl)));
+      v2 = vreinterpretq_s16_u8(lookup2_neon(t, vreinterpretq_u8_u16(next)));
+      vst1q_s16(dest, vcombine_s16(
+	interpolate_neon(vget_low_s16(v1), vget_low_s16(v2), a),
+	interpolate_neon(vget_high_s16(v1), vget_high_s16(v2), b)));
+      a = vaddq_s32(a, step);
+      b = vaddq_s32(b, step);
+      dest += 8;
+      ofs += incr * 8;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+#endif
+
+#if defined(RESAMPLE_SSE2) || defined(RESAMPLE_NEON)
+/* the fastest of the above the CPU runs */
+static sample_t *run_window(sample_t *dest, const MidSample *sp, sint32 *ofsp,
+			    sint32 incr, sint32 blocks)
+{
+#if defined(RESAMPLE_SSSE3)
+  if (CPU_HAS_SSSE3)
+    return run_ssse3(dest, sp, ofsp, incr, blocks);
+#endif
+#if defined(RESAMPLE_SSE2)
+  /* picking out of 7 pairs takes SSE2 longer than run_16 does */
+  if (CPU_HAS_SSE2 && (incr < FRACTION_ONE || !(sp->modes & MODES_16BIT)))
+    return run_sse2(dest, sp, ofsp, incr, blocks);
+  return dest;
+#else
+  return run_neon(dest, sp, ofsp, incr, blocks);
+#endif
+}
+#endif
+
+#if defined(RESAMPLE_AVX2)
+SIMD_TARGET("avx2")
+static __m256i interpolate_avx2(const sint16 *src, __m256i ofs)
+{
+  __m256i f, w, pairs;
+  pairs = _mm256_i32gather_epi32((const int *) src,
+				 _mm256_srai_epi32(ofs, FRACTION_BITS), 2);
+  f = _mm256_and_si256(ofs, _mm256_set1_epi32(FRACTION_MASK));
+  w = _mm256_or_si256(_mm256_slli_epi32(f, 16),
+		      _mm256_sub_epi32(_mm256_set1_epi32(FRACTION_ONE), f));
+  return _mm256_srai_epi32(_mm256_madd_epi16(pairs, w), FRACTION_BITS);
+}
+
+/* 16 samples at a time from 16-bit data, gathering the pairs */
+SIMD_TARGET("avx2")
+static sample_t *run_16_avx2(sample_t *dest, const sint16 *src, sint32 *ofsp,
+			     sint32 incr, sint32 blocks)
+{
+  sint32 offsets[8], ofs = *ofsp;
+  __m256i a, b, step;
+  int k;
+
+  for (k = 0; k < 8; k++)
+    offsets[k] = ofs + incr * k;
+  a = _mm256_loadu_si256((const __m256i *) offsets);
+  step = _mm256_set1_epi32(incr * 8);
+  for (; blocks > 0; blocks--)
+    {
+      /* the packs interleave the halves of a and b: put them back */
+      b = _mm256_add_epi32(a, step);
+      _mm256_storeu_si256((__m256i *) dest,
+			  _mm256_permute4x64_epi64(
+			    _mm256_packs_epi32(interpolate_avx2(src, a),
+					       interpolate_avx2(src, b)),
+			    0xD8));
+      a = _mm256_add_epi32(b, step);
+      dest += 16;
+      ofs += incr * 16;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+
+/* the same without interpolating, for MID_INTERP_NONE */
+SIMD_TARGET("avx2")
+static __m256i nearest_avx2(const sint16 *src, __m256i ofs)
+{
+  __m256i pairs = _mm256_i32gather_epi32((const int *) src,
+					 _mm256_srai_epi32(ofs, FRACTION_BITS), 2);
+  return _mm256_srai_epi32(_mm256_slli_epi32(pairs, 16), 16);
+}
+
+SIMD_TARGET("avx2")
+static sample_t *run_16_none_avx2(sample_t *dest, const sint16 *src, sint32 *ofsp,
+				  sint32 incr, sint32 blocks)
+{
+  sint32 offsets[8], ofs = *ofsp;
+  __m256i a, b, step;
+  int k;
+
+  for (k = 0; k < 8; k++)
+    offsets[k] = ofs + incr * k;
+  a = _mm256_loadu_si256((const __m256i *) offsets);
+  step = _mm256_set1_epi32(incr * 8);
+  for (; blocks > 0; blocks--)
+    {
+      b = _mm256_add_epi32(a, step);
+      _mm256_storeu_si256((__m256i *) dest,
+			  _mm256_permute4x64_epi64(
+			    _mm256_packs_epi32(nearest_avx2(src, a),
+					       nearest_avx2(src, b)),
+			    0xD8));
+      a = _mm256_add_epi32(b, step);
+      dest += 16;
+      ofs += incr * 16;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+#endif
+
+static sample_t *run_linear(const MidSample *sp, sample_t *dest,
+			    sint32 *ofsp, sint32 incr, sint32 count)
+{
+#if defined(RESAMPLE_AVX2)
+  /* gathering is quicker, where there's AVX2, and works at any incr */
+  if (count >= 16 && (sp->modes & MODES_16BIT) && CPU_HAS_AVX2)
+    {
+      dest = run_16_avx2(dest, (const sint16 *) sp->data, ofsp, incr, count >> 4);
+      count &= 15;
+    }
+#endif
+#if defined(RESAMPLE_SSE2) || defined(RESAMPLE_NEON)
+  if (count >= 8 && incr > 0 && incr < WINDOW_INCR)
+    {
+      sample_t *start = dest;
+      dest = run_window(dest, sp, ofsp, incr, count >> 3);
+      count -= dest - start;
+    }
+#endif
+  if (sp->modes & MODES_16BIT)
+    return run_16(dest, (const sint16 *) sp->data, ofsp, incr, count);
+  return run_8(dest, (const sint8 *) sp->data, ofsp, incr, count);
+}
+
+static sample_t sample_at(const MidSample *sp, sint32 i)
+{
+  if (sp->modes & MODES_16BIT)
+    return ((const sint16 *) sp->data)[i];
+  return ((const sint8 *) sp->data)[i] * 256;
+}
+
+/*************** the other interpolations *****************/
+
+/* Cubic and sinc interpolation are done with a table of fir_taps
+   coefficients for each of FIR_PHASES fractions of a sample, for the
+   samples from fir_taps/2 - 1 before the position on. They're fixed
+   point, so that the C and SIMD versions come out the same. */
+#define FIR_PHASE_BITS 9
+#define FIR_PHASES (1 << FIR_PHASE_BITS)
+#define FIR_BITS 14
+#define MAX_FIR_TAPS 32
+
+int init_interpolation(MidSong *song, int interpolation, int taps)
+{
+  double c[MAX_FIR_TAPS], x, d, u, sum;
+  sint16 *row;
+  int p, k, total, center;
+
+  song->interpolation = interpolation;
+  if (interpolation == MID_INTERP_CUBIC)
+    taps = 4;
+  else if (interpolation == MID_INTERP_SINC)
+    taps = (taps < 4) ? 4 : ((taps > MAX_FIR_TAPS) ? MAX_FIR_TAPS : (taps + 3) & ~3);
+  else
+    return 0;
+
+  song->fir_taps = taps;
+  song->fir_table = (sint16 *) timi_malloc(FIR_PHASES * taps * sizeof(sint16));
+  if (!song->fir_table)
+    return -1;
+
+  for (p = 0; p < FIR_PHASES; p++)
+    {
+      x = (double) p / FIR_PHASES;
+      if (interpolation == MID_INTERP_CUBIC)
+	{
+	  /* Lagrange, through the samples at -1, 0, 1 and 2 */
+	  c[0] = -x * (x - 1) * (x - 2) / 6;
+	  c[1] = (x + 1) * (x - 1) * (x - 2) / 2;
+	  c[2] = -(x + 1) * x * (x - 2) / 2;
+	  c[3] = (x + 1) * x * (x - 1) / 6;
+	}
+      else
+	for (k = 0; k < taps; k++)
+	  {
+	    /* Blackman windowed */
+	    d = (k - (taps / 2 - 1) - x) * M_PI;
+	    u = d / (taps / 2);
+	    c[k] = (d == 0) ? 1.0 : sin(d) / d;
+	    c[k] *= 0.42 + 0.5 * cos(u) + 0.08 * cos(2 * u);
+	  }
+
+      /* quantize so that they add up to one exactly */
+      for (k = 0, sum = 0; k < taps; k++)
+	sum += c[k];
+      row = song->fir_table + p * taps;
+      for (k = 0, total = 0; k < taps; k++)
+	{
+	  row[k] = (sint16) floor(c[k] / sum * (1 << FIR_BITS) + 0.5);
+	  total += row[k];
+	}
+      center = taps / 2 - 1 + ((x >= 0.5) ? 1 : 0);
+      row[center] += (1 << FIR_BITS) - total;
+    }
+  return 0;
+}
+
+static sint32 dot_c(const sint16 *x, const sint16 *c, int n)
+{
+  sint32 sum = 0;
+  while (n--)
+    sum += *x++ * *c++;
+  return sum;
+}
+
+#if defined(RESAMPLE_SSE2)
+SIMD_TARGET("sse2")
+static sint32 dot_sse2(const sint16 *x, const sint16 *c, int n)
+{
+  __m128i sum = _mm_setzero_si128();
+  for (; n >= 8; n -= 8, x += 8, c += 8)
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadu_si128((const __m128i *) x),
+					    _mm_loadu_si128((const __m128i *) c)));
+  if (n) /* 4 more */
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_loadl_epi64((const __m128i *) x),
+					    _mm_loadl_epi64((const __m128i *) c)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+  return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+#if defined(RESAMPLE_NEON)
+static sint32 dot_neon(const sint16 *x, const sint16 *c, int n)
+{
+  int32x4_t sum = vdupq_n_s32(0);
+  int32x2_t s;
+  for (; n >= 4; n -= 4, x += 4, c += 4)
+    sum = vmlal_s16(sum, vld1_s16(x), vld1_s16(c));
+  s = vadd_s32(vget_low_s32(sum), vget_high_s32(sum));
+  return vget_lane_s32(vpadd_s32(s, s), 0);
+}
+#endif
+
+static sint32 dot(const sint16 *x, const sint16 *c, int n)
+{
+#if defined(RESAMPLE_SSE2)
+  if (CPU_HAS_SSE2)
+    return dot_sse2(x, c, n);
+#elif defined(RESAMPLE_NEON)
+  return dot_neon(x, c, n);
+#endif
+  return dot_c(x, c, n);
+}
+
+static sample_t *run_fir(const MidSong *song, const MidSample *sp,
+			 sample_t *dest, sint32 *ofsp, sint32 incr,
+			 sint32 count)
+{
+  sint16 taps[MAX_FIR_TAPS];
+  const sint16 *x, *c;
+  sint32 ofs = *ofsp, i, k, v,
+    n = song->fir_taps,
+    last = (sp->data_length >> FRACTION_BITS) + 1; /* the guard sample */
+
+  for (; count > 0; count--)
+    {
+      i = (ofs >> FRACTION_BITS) - (n / 2 - 1);
+      c = song->fir_table +
+	  ((ofs & FRACTION_MASK) >> (FRACTION_BITS - FIR_PHASE_BITS)) * n;
+      if ((sp->modes & MODES_16BIT) && i >= 0 && i + n - 1 <= last)
+	x = (const sint16 *) sp->data + i;
+      else
+	{
+	  /* there's nothing around the data */
+	  for (k = 0; k < n; k++)
+	    taps[k] = (i + k >= 0 && i + k <= last) ? sample_at(sp, i + k) : 0;
+	  x = taps;
+	}
+      v = (dot(x, c, n) + (1 << (FIR_BITS - 1))) >> FIR_BITS;
+      *dest++ = (sample_t) ((v > 32767) ? 32767 : ((v < -32768) ? -32768 : v));
+      ofs += incr;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+
+/* drop-sample: no interpolation at all */
+static sample_t *run_none(const MidSample *sp, sample_t *dest,
+			  sint32 *ofsp, sint32 incr, sint32 count)
+{
+  sint32 ofs;
+
+#if defined(RESAMPLE_AVX2)
+  if (count >= 16 && (sp->modes & MODES_16BIT) && CPU_HAS_AVX2)
+    {
+      dest = run_16_none_avx2(dest, (const sint16 *) sp->data, ofsp, incr, count >> 4);
+      count &= 15;
+    }
+#endif
+  ofs = *ofsp;
+  if (sp->modes & MODES_16BIT)
+    {
+      const sint16 *src = (const sint16 *) sp->data;
+      for (; count > 0; count--, ofs += incr)
+	*dest++ = src[ofs >> FRACTION_BITS];
+    }
+  else
+    {
+      const sint8 *src = (const sint8 *) sp->data;
+      for (; count > 0; count--, ofs += incr)
+	*dest++ = src[ofs >> FRACTION_BITS] * 256;
+    }
+  *ofsp = ofs;
+  return dest;
+}
+
+/* Whole samples apart, from a whole sample on: there's nothing to
+   interpolate, at any interpolation. Played at the pitch it was
+   recorded at, that's a copy, and a decimation at whole octaves etc. */
+#define RUNS_WHOLE(ofs, incr) (!(((ofs) | (incr)) & FRACTION_MASK))
+
+static sample_t *run_whole(const MidSample *sp, sample_t *dest,
+			   sint32 *ofsp, sint32 incr, sint32 count)
+{
+  sint32 i = *ofsp >> FRACTION_BITS, step = incr >> FRACTION_BITS;
+
+  *ofsp += incr * count;
+  if (sp->modes & MODES_16BIT)
+    {
+      const sint16 *src = (const sint16 *) sp->data + i;
+      if (step == 1)
+	{
+	  memcpy(dest, src, count * sizeof(sample_t));
+	  return dest + count;
+	}
+      for (; count > 0; count--, src += step)
+	*dest++ = *src;
+    }
+  else
+    {
+      const sint8 *src = (const sint8 *) sp->data + i;
+      for (; count > 0; count--, src += step)
+	*dest++ = *src * 256;
+    }
+  return dest;
+}
+
+static sample_t *resample_run(const MidSong *song, const MidSample *sp,
+			      sample_t *dest, sint32 *ofsp, sint32 incr,
+			      sint32 count)
+{
+  /* picked for each span, so that pitch bends and vibrato that move
+     the increment off or onto whole samples are followed */
+  if (RUNS_WHOLE(*ofsp, incr))
+    return run_whole(sp, dest, ofsp, incr, count);
+  switch (song->interpolation)
+    {
+    case MID_INTERP_NONE:
+      return run_none(sp, dest, ofsp, incr, count);
+    case MID_INTERP_CUBIC:
+    case MID_INTERP_SINC:
+      return run_fir(song, sp, dest, ofsp, incr, count);
+    default:
+      return run_linear(sp, dest, ofsp, incr, count);
+    }
+}
+
+/* Mixing right as the samples are resampled: they go through a short
+   window on the stack on their way, instead of a whole block of them
+   through a resample buffer. */
+#define MIX_WINDOW 64
+
+static void mix_ramp(MidMixer *mx, const sample_t *sp, sint32 count)
+{
+  sint32 *lp = mx->lp;
+  sint32 left = mx->left_ramp, right = mx->right_ramp,
+    li = mx->left_step, ri = mx->right_step;
+  sample_t s;
+
+  if (mx->mono)
+    while (count--)
+      {
+	s = *sp++;
+	*lp++ += (left >> RAMP_BITS) * s;
+	left += li;
+      }
+  else if (mx->panned == PANNED_MYSTERY)
+    while (count--)
+      {
+	s = *sp++;
+	*lp++ += (left >> RAMP_BITS) * s;
+	*lp++ += (right >> RAMP_BITS) * s;
+	left += li;
+	right += ri;
+      }
+  else if (mx->panned == PANNED_CENTER)
+    while (count--)
+      {
+	s = *sp++;
+	*lp++ += (left >> RAMP_BITS) * s;
+	*lp++ += (left >> RAMP_BITS) * s;
+	left += li;
+      }
+  else /* left or right: lp points at the right one already */
+    while (count--)
+      {
+	s = *sp++;
+	*lp += (left >> RAMP_BITS) * s;
+	lp += 2;
+	left += li;
+      }
+  mx->lp = lp;
+  mx->left_ramp = left;
+  mx->right_ramp = right;
+}
+
+/* The gains are worked out from the start of the window at each sample,
+   rather than stepped, so that these loops vectorize. */
+static void mix_float(MidMixer *mx, const sample_t *sp, sint32 count)
+{
+  float *fp = mx->fp;
+  float left = mx->fleft, right = mx->fright,
+    li = mx->fleft_step, ri = mx->fright_step;
+  sint32 i;
+
+  if (mx->mono)
+    {
+      for (i = 0; i < count; i++)
+	fp[i] += (left + li * i) * sp[i];
+      fp += count;
+    }
+  else if (mx->panned == PANNED_MYSTERY)
+    {
+      for (i = 0; i < count; i++)
+	{
+	  fp[2*i] += (left + li * i) * sp[i];
+	  fp[2*i+1] += (right + ri * i) * sp[i];
+	}
+      fp += 2 * count;
+    }
+  else if (mx->panned == PANNED_CENTER)
+    {
+      for (i = 0; i < count; i++)
+	{
+	  fp[2*i] += (left + li * i) * sp[i];
+	  fp[2*i+1] += (left + li * i) * sp[i];
+	}
+      fp += 2 * count;
+    }
+  else /* left or right: fp points at the right one already */
+    {
+      for (i = 0; i < count; i++)
+	fp[2*i] += (left + li * i) * sp[i];
+      fp += 2 * count;
+    }
+  mx->fp = fp;
+  mx->fleft = left + li * count;
+  mx->fright = right + ri * count;
+}
+
+void mix_window(MidMixer *mx, const sample_t *sp, sint32 count)
+{
+  sint32 *lp = mx->lp;
+  final_volume_t left = mx->left, right = mx->right;
+  sample_t s;
+
+  if (mx->fp)
+    {
+      mix_float(mx, sp, count);
+      return;
+    }
+  if (mx->ramp)
+    {
+      mix_ramp(mx, sp, count);
+      return;
+    }
+  if (mx->mono)
+    while (count--)
+      {
+	s = *sp++;
+	*lp++ += left * s;
+      }
+  else if (mx->panned == PANNED_MYSTERY)
+    while (count--)
+      {
+	s = *sp++;
+	*lp++ += left * s;
+	*lp++ += right * s;
+      }
+  else if (mx->panned == PANNED_CENTER)
+    while (count--)
+      {
+	s = *sp++;
+	*lp++ += left * s;
+	*lp++ += left * s;
+      }
+  else /* left or right: lp points at the right one already */
+    while (count--)
+      {
+	s = *sp++;
+	*lp += left * s;
+	lp += 2;
+      }
+  mx->lp = lp;
+}
+
+static sample_t *resample_to(const MidSong *song, const MidSample *sp,
+			     sample_t *dest, MidMixer *mx,
+			     sint32 *ofsp, sint32 incr, sint32 count)
+{
+  sample_t window[MIX_WINDOW];
+  sint32 n;
+
+  if (!mx)
+    return resample_run(song, sp, dest, ofsp, incr, count);
+  if (incr == (1 << FRACTION_BITS) && RUNS_WHOLE(*ofsp, 0) &&
+      (sp->modes & MODES_16BIT))
+    {
+      /* mixed right from the sample data */
+      mix_window(mx, (const sint16 *) sp->data + (*ofsp >> FRACTION_BITS), count);
+      *ofsp += count << FRACTION_BITS;
+      return dest;
+    }
+  for (; count > 0; count -= n)
+    {
+      n = (count < MIX_WINDOW) ? count : MIX_WINDOW;
+      resample_run(song, sp, window, ofsp, incr, n);
+      mix_window(mx, window, n);
+    }
+  return dest;
+}
+
+static sample_t *rs_plain(MidSong *song, sample_t *buf, int v, sint32 *countptr,
+			  MidMixer *mx)
+{
+  /* Play sample until end, then free the voice. */
+
   MidVoice 
     *vp=&(song->voice[v]);
   sample_t 
-    *dest=song->resample_buffer,
-    *src=vp->sample->data;
+    *dest=buf;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
     le=vp->sample->data_length,
     count=*countptr;
-  sint32 i, j;
+  sint32 i;
 
   if (incr<0) incr = -incr; /* In case we're coming out of a bidir loop */
 
@@ -77,40 +957,33 @@ static sample_t *rs_plain(MidSong *song, int v, sint32 *countptr)
     }
   else count -= i;
 
-  for (j = 0; j < i; j++)
-    {
-      v1 = src[ofs >> FRACTION_BITS];
-      v2 = src[(ofs >> FRACTION_BITS)+1];
-      *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-      ofs += incr;
-    }
+  dest = resample_to(song, vp->sample, dest, mx, &ofs, incr, i);
 
   if (ofs >= le)
     {
       if (ofs == le)
-	*dest++ = src[(ofs>>FRACTION_BITS)-1]/2;
+	*dest++ = sample_at(vp->sample, (ofs>>FRACTION_BITS)-1)/2;
       vp->status=VOICE_FREE;
       *countptr-=count+1;
     }
 
   vp->sample_offset=ofs; /* Update offset */
-  return song->resample_buffer;
+  return buf;
 }
 
-static sample_t *rs_loop(MidSong *song, MidVoice *vp, sint32 count)
+static sample_t *rs_loop(MidSong *song, sample_t *buf, MidVoice *vp, sint32 count,
+			 MidMixer *mx)
 {
   /* Play sample until end-of-loop, skip back and continue. */
 
-  sample_t v1, v2;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
     le=vp->sample->loop_end,
     ll=le - vp->sample->loop_start;
   sample_t
-    *dest=song->resample_buffer,
-    *src=vp->sample->data;
-  sint32 i, j;
+    *dest=buf;
+  sint32 i;
 
   while (count)
     {
@@ -124,34 +997,27 @@ static sample_t *rs_loop(MidSong *song, MidVoice *vp, sint32 count)
 	  count = 0;
 	}
       else count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = resample_to(song, vp->sample, dest, mx, &ofs, incr, i);
     }
 
   vp->sample_offset=ofs; /* Update offset */
-  return song->resample_buffer;
+  return buf;
 }
 
-static sample_t *rs_bidir(MidSong *song, MidVoice *vp, sint32 count)
+static sample_t *rs_bidir(MidSong *song, sample_t *buf, MidVoice *vp, sint32 count,
+			  MidMixer *mx)
 {
-  sample_t v1, v2;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
     le=vp->sample->loop_end,
     ls=vp->sample->loop_start;
   sample_t 
-    *dest=song->resample_buffer,
-    *src=vp->sample->data;
+    *dest=buf;
   sint32
     le2 = le<<1,
     ls2 = ls<<1,
-    i, j;
+    i;
   /* Play normally until inside the loop region */
 
   if (incr > 0 && ofs < ls)
@@ -166,13 +1032,7 @@ static sample_t *rs_bidir(MidSong *song, MidVoice *vp, sint32 count)
 	  count = 0;
 	}
       else count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = resample_to(song, vp->sample, dest, mx, &ofs, incr, i);
     }
 
   /* Then do the bidirectional looping */
@@ -186,13 +1046,7 @@ static sample_t *rs_bidir(MidSong *song, MidVoice *vp, sint32 count)
 	  count = 0;
 	}
       else count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = resample_to(song, vp->sample, dest, mx, &ofs, incr, i);
       if (ofs>=le)
 	{
 	  /* fold the overshoot back in */
@@ -208,42 +1062,25 @@ static sample_t *rs_bidir(MidSong *song, MidVoice *vp, sint32 count)
 
   vp->sample_increment=incr;
   vp->sample_offset=ofs; /* Update offset */
-  return song->resample_buffer;
+  return buf;
 }
 
 /*********************** vibrato versions ***************************/
 
 /* We only need to compute one half of the vibrato sine cycle */
-static int vib_phase_to_inc_ptr(int phase)
-{
-  if (phase < MID_VIBRATO_SAMPLE_INCREMENTS/2)
-    return MID_VIBRATO_SAMPLE_INCREMENTS/2-1-phase;
-  else if (phase >= 3*MID_VIBRATO_SAMPLE_INCREMENTS/2)
-    return 5*MID_VIBRATO_SAMPLE_INCREMENTS/2-1-phase;
-  else
-    return phase-MID_VIBRATO_SAMPLE_INCREMENTS/2;
-}
+/* The vibrato bends the pitch by at most 32767/8192 semitones, so
+   biasing the bend by four semitones keeps it positive, and bends down
+   multiply by the bias taken back out instead of dividing. */
+#define VIBRATO_BIAS (4<<13)
+#define VIBRATO_UNBIAS 0.79370052598409973738 /* 1 / bend_coarse[4] */
 
-static sint32 update_vibrato(MidSong *song, MidVoice *vp, int sign)
+static sint32 update_vibrato(MidVoice *vp, int sign)
 {
-  sint32 depth;
-  int phase, pb;
+  sint32 depth=vp->vibrato_depth, pb;
   double a;
 
   if (vp->vibrato_phase++ >= 2*MID_VIBRATO_SAMPLE_INCREMENTS-1)
     vp->vibrato_phase=0;
-  phase=vib_phase_to_inc_ptr(vp->vibrato_phase);
-
-  if (vp->vibrato_sample_increment[phase])
-    {
-      if (sign)
-	return -vp->vibrato_sample_increment[phase];
-      else
-	return vp->vibrato_sample_increment[phase];
-    }
-
-  /* Need to compute this sample increment. */
-  depth=vp->sample->vibrato_depth<<7;
 
   if (vp->vibrato_sweep)
     {
@@ -259,27 +1096,12 @@ static sint32 update_vibrato(MidSong *song, MidVoice *vp, int sign)
 	}
     }
 
-  a = TIM_FSCALE(((double)(vp->sample->sample_rate) *
-		  (double)(vp->frequency)) /
-		 ((double)(vp->sample->root_freq) *
-		  (double)(song->rate)),
-		 FRACTION_BITS);
+  pb = lfo_sine(vp->vibrato_phase *
+		(SINE_CYCLE_LENGTH/(2*MID_VIBRATO_SAMPLE_INCREMENTS)))
+    * depth / 32768 + VIBRATO_BIAS;
 
-  pb=(int)((timi_sine(vp->vibrato_phase * 
-		 (SINE_CYCLE_LENGTH/(2*MID_VIBRATO_SAMPLE_INCREMENTS)))
-	    * (double)(depth) * VIBRATO_AMPLITUDE_TUNING));
-
-  if (pb<0)
-    {
-      pb=-pb;
-      a /= bend_fine[(pb>>5) & 0xFF] * bend_coarse[pb>>13];
-    }
-  else
-    a *= bend_fine[(pb>>5) & 0xFF] * bend_coarse[pb>>13];
-
-  /* If the sweep's over, we can store the newly computed sample_increment */
-  if (!vp->vibrato_sweep)
-    vp->vibrato_sample_increment[phase]=(sint32) a;
+  a = (double)(vp->base_increment) * VIBRATO_UNBIAS *
+    bend_fine[(pb>>5) & 0xFF] * bend_coarse[pb>>13];
 
   if (sign)
     a = -a; /* need to preserve the loop direction */
@@ -287,15 +1109,13 @@ static sint32 update_vibrato(MidSong *song, MidVoice *vp, int sign)
   return (sint32) a;
 }
 
-static sample_t *rs_vib_plain(MidSong *song, int v, sint32 *countptr)
+static sample_t *rs_vib_plain(MidSong *song, sample_t *buf, int v, sint32 *countptr)
 {
   /* Play sample until end, then free the voice. */
 
-  sample_t v1, v2;
   MidVoice *vp=&(song->voice[v]);
   sample_t 
-    *dest=song->resample_buffer, 
-    *src=vp->sample->data;
+    *dest=buf;
   sint32 
     le=vp->sample->data_length,
     ofs=vp->sample_offset, 
@@ -313,16 +1133,13 @@ static sample_t *rs_vib_plain(MidSong *song, int v, sint32 *countptr)
       if (!cc--)
 	{
 	  cc=vp->vibrato_control_ratio;
-	  incr=update_vibrato(song, vp, 0);
+	  incr=update_vibrato(vp, 0);
 	}
-      v1 = src[ofs >> FRACTION_BITS];
-      v2 = src[(ofs >> FRACTION_BITS)+1];
-      *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-      ofs += incr;
+      dest = resample_run(song, vp->sample, dest, &ofs, incr, 1);
       if (ofs >= le)
 	{
 	  if (ofs == le)
-	    *dest++ = src[(ofs>>FRACTION_BITS)-1]/2;
+	    *dest++ = sample_at(vp->sample, (ofs>>FRACTION_BITS)-1)/2;
 	  vp->status=VOICE_FREE;
 	  *countptr-=count+1;
 	  break;
@@ -332,25 +1149,24 @@ static sample_t *rs_vib_plain(MidSong *song, int v, sint32 *countptr)
   vp->vibrato_control_counter=cc;
   vp->sample_increment=incr;
   vp->sample_offset=ofs; /* Update offset */
-  return song->resample_buffer;
+  return buf;
 }
 
-static sample_t *rs_vib_loop(MidSong *song, MidVoice *vp, sint32 count)
+static sample_t *rs_vib_loop(MidSong *song, sample_t *buf, MidVoice *vp,
+			     sint32 count, MidMixer *mx)
 {
   /* Play sample until end-of-loop, skip back and continue. */
 
-  sample_t v1, v2;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
     le=vp->sample->loop_end,
     ll=le - vp->sample->loop_start;
   sample_t 
-    *dest=song->resample_buffer,
-    *src=vp->sample->data;
+    *dest=buf;
   int 
     cc=vp->vibrato_control_counter;
-  sint32 i, j;
+  sint32 i;
   int
     vibflag=0;
 
@@ -370,17 +1186,11 @@ static sample_t *rs_vib_loop(MidSong *song, MidVoice *vp, sint32 count)
 	}
       else cc -= i;
       count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = resample_to(song, vp->sample, dest, mx, &ofs, incr, i);
       if(vibflag)
 	{
 	  cc = vp->vibrato_control_ratio;
-	  incr = update_vibrato(song, vp, 0);
+	  incr = update_vibrato(vp, 0);
 	  vibflag = 0;
 	}
     }
@@ -388,26 +1198,25 @@ static sample_t *rs_vib_loop(MidSong *song, MidVoice *vp, sint32 count)
   vp->vibrato_control_counter=cc;
   vp->sample_increment=incr;
   vp->sample_offset=ofs; /* Update offset */
-  return song->resample_buffer;
+  return buf;
 }
 
-static sample_t *rs_vib_bidir(MidSong *song, MidVoice *vp, sint32 count)
+static sample_t *rs_vib_bidir(MidSong *song, sample_t *buf, MidVoice *vp,
+			      sint32 count, MidMixer *mx)
 {
-  sample_t v1, v2;
   sint32 
     ofs=vp->sample_offset,
     incr=vp->sample_increment,
     le=vp->sample->loop_end,
     ls=vp->sample->loop_start;
   sample_t 
-    *dest=song->resample_buffer,
-    *src=vp->sample->data;
+    *dest=buf;
   int 
     cc=vp->vibrato_control_counter;
   sint32
     le2=le<<1,
     ls2=ls<<1,
-    i, j;
+    i;
   int
     vibflag = 0;
 
@@ -423,17 +1232,11 @@ static sample_t *rs_vib_bidir(MidSong *song, MidVoice *vp, sint32 count)
 	}
       else cc -= i;
       count -= i;
-      for (j = 0; j < i; j++)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = resample_to(song, vp->sample, dest, mx, &ofs, incr, i);
       if (vibflag)
 	{
 	  cc = vp->vibrato_control_ratio;
-	  incr = update_vibrato(song, vp, 0);
+	  incr = update_vibrato(vp, 0);
 	  vibflag = 0;
 	}
     }
@@ -451,17 +1254,11 @@ static sample_t *rs_vib_bidir(MidSong *song, MidVoice *vp, sint32 count)
 	}
       else cc -= i;
       count -= i;
-      while (i--)
-	{
-	  v1 = src[ofs >> FRACTION_BITS];
-	  v2 = src[(ofs >> FRACTION_BITS)+1];
-	  *dest++ = v1 + (((v2 - v1) * (ofs & FRACTION_MASK)) >> FRACTION_BITS);
-	  ofs += incr;
-	}
+      dest = resample_to(song, vp->sample, dest, mx, &ofs, incr, i);
       if (vibflag)
 	{
 	  cc = vp->vibrato_control_ratio;
-	  incr = update_vibrato(song, vp, (incr < 0));
+	  incr = update_vibrato(vp, (incr < 0));
 	  vibflag = 0;
 	}
       if (ofs >= le)
@@ -480,13 +1277,54 @@ static sample_t *rs_vib_bidir(MidSong *song, MidVoice *vp, sint32 count)
   vp->vibrato_control_counter=cc;
   vp->sample_increment=incr;
   vp->sample_offset=ofs; /* Update offset */
-  return song->resample_buffer;
+  return buf;
 }
 
-sample_t *resample_voice(MidSong *song, int v, sint32 *countptr)
+/* Looping voices are played looping until they're released, and those
+   with an envelope until it's done: the others are played to the end. */
+static int voice_loops(const MidVoice *vp)
+{
+  return ((vp->sample->modes & MODES_LOOPING) &&
+	  ((vp->sample->modes & MODES_ENVELOPE) ||
+	   (vp->status==VOICE_ON || vp->status==VOICE_SUSTAINED)));
+}
+
+/* Need to resample. Use the proper function. */
+static sample_t *resample_voice_to(MidSong *song, sample_t *buf, int v,
+				   sint32 *countptr, MidMixer *mx)
+{
+  MidVoice *vp=&(song->voice[v]);
+  uint8 modes=vp->sample->modes;
+
+  if (vp->vibrato_control_ratio)
+    {
+      if (voice_loops(vp))
+	{
+	  if (modes & MODES_PINGPONG)
+	    return rs_vib_bidir(song, buf, vp, *countptr, mx);
+	  else
+	    return rs_vib_loop(song, buf, vp, *countptr, mx);
+	}
+      else
+	return rs_vib_plain(song, buf, v, countptr);
+    }
+  else
+    {
+      if (voice_loops(vp))
+	{
+	  if (modes & MODES_PINGPONG)
+	    return rs_bidir(song, buf, vp, *countptr, mx);
+	  else
+	    return rs_loop(song, buf, vp, *countptr, mx);
+	}
+      else
+	return rs_plain(song, buf, v, countptr, mx);
+    }
+}
+
+sample_t *resample_voice(MidSong *song, sample_t *buf, int v, sint32 *countptr)
 {
   sint32 ofs;
-  uint8 modes;
   MidVoice *vp=&(song->voice[v]);
 
   if (!(vp->sample->sample_rate))
@@ -509,51 +1347,183 @@ sample_t *resample_voice(MidSong *song, int v, sint32 *countptr)
       return vp->sample->data+ofs;
     }
 
-  /* Need to resample. Use the proper function. */
-  modes=vp->sample->modes;
+  return resample_voice_to(song, buf, v, countptr, NULL);
+}
+
+int can_resample_mix(MidSong *song, int v, sint32 count)
+{
+  MidVoice *vp=&(song->voice[v]);
+  sint32 incr=vp->sample_increment;
 
+  if (!(vp->sample->sample_rate))
+    return 0; /* played right from the data already */
+  if (voice_loops(vp))
+    return 1;
   if (vp->vibrato_control_ratio)
+    return 0;
+  /* the note mustn't end in these: see rs_plain() */
+  if (incr<0) incr = -incr;
+  return PRECALC_LOOP_COUNT(vp->sample_offset, vp->sample->data_length, incr) > count;
+}
+
+/* no buffer: what can_resample_mix() lets through never ends in it */
+void resample_mix(MidSong *song, int v, sint32 count, MidMixer *mx)
+{
+  resample_voice_to(song, NULL, v, &count, mx);
+}
+
+/*************** cache of pre-resampled samples *****************/
+
+/* A drum kit is played on fixed notes, and its samples are resampled
+   for them when it is loaded. The results are kept here, so that the
+   next instrument using the same sample at the same output rate (e.g.
+   in another kit, or at another control rate) gets them for free. */
+
+#define RESAMPLE_CACHE_SIZE 256
+
+typedef struct _MidResampled MidResampled;
+struct _MidResampled
+{
+  MidDataRef ref;	/* one for the cache, one for each sample */
+  char *name;		/* where the source came from */
+  int context;		/* whose search paths found name */
+  sint32 pos;
+  sint32 data_length, loop_start, loop_end;	/* of the source */
+  sint32 sample_rate, root_freq;
+  uint8 modes, note;
+  sint32 rate;
+  sample_t *data;	/* the result */
+  sint32 new_length, new_loop_start, new_loop_end;
+  size_t bytes;
+  MidResampled *next;
+};
+
+static MidResampled *resample_cache[RESAMPLE_CACHE_SIZE];
+static size_t resample_cache_bytes;
+static timi_mutex resample_lock = TIMI_MUTEX_INITIALIZER;
+
+static void release_resampled(MidDataRef *ref)
+{
+  MidResampled *p = (MidResampled *) ref;
+  timi_free(p->data);
+  timi_free(p->name);
+  timi_free(p);
+}
+
+static int resampled_hash(const char *name, sint32 pos, int note, sint32 rate)
+{
+  uint32 h = 2166136261U;
+  while (*name)
+    h = (h ^ (unsigned char) *name++) * 16777619U;
+  h = (h ^ (uint32) pos) * 16777619U;
+  h = (h ^ (uint32) note) * 16777619U;
+  h = (h ^ (uint32) rate) * 16777619U;
+  return (int) (h % RESAMPLE_CACHE_SIZE);
+}
+
+static int same_source(const MidResampled *p, int context, const char *name,
+		       sint32 pos, const MidSample *sp, sint32 rate)
+{
+  return (p->pos == pos && p->rate == rate && p->context == context &&
+	  p->note == sp->note_to_use && p->modes == sp->modes &&
+	  p->data_length == sp->data_length &&
+	  p->loop_start == sp->loop_start && p->loop_end == sp->loop_end &&
+	  p->sample_rate == sp->sample_rate && p->root_freq == sp->root_freq &&
+	  !strcmp(p->name, name));
+}
+
+static MidResampled *find_resampled(int h, int context, const char *name,
+				    sint32 pos, const MidSample *sp, sint32 rate)
+{
+  MidResampled *p;
+  for (p = resample_cache[h]; p; p = p->next)
+    if (same_source(p, context, name, pos, sp, rate))
+      return p;
+  return NULL;
+}
+
+static void use_resampled(MidSample *sp, MidResampled *p)
+{
+  sp->data_length = p->new_length;
+  sp->loop_start = p->new_loop_start;
+  sp->loop_end = p->new_loop_end;
+  free_sample_data(sp);
+  sp->data = p->data;
+  sp->data_ref = &p->ref;
+  sp->sample_rate = 0;
+  sp->modes |= MODES_16BIT;
+}
+
+int purge_resampled(int all)
+{
+  MidResampled **pp, *p, *dead = NULL;
+  int i, n = 0;
+  timi_mutex_lock(&resample_lock);
+  for (i = 0; i < RESAMPLE_CACHE_SIZE; i++)
     {
-      if ((modes & MODES_LOOPING) &&
-	  ((modes & MODES_ENVELOPE) ||
-	   (vp->status==VOICE_ON || vp->status==VOICE_SUSTAINED)))
+      pp = &resample_cache[i];
+      while ((p = *pp) != NULL)
 	{
-	  if (modes & MODES_PINGPONG)
-	    return rs_vib_bidir(song, vp, *countptr);
-	  else
-	    return rs_vib_loop(song, vp, *countptr);
+	  /* only the cache uses it? nobody else can get it now. */
+	  if (!all && data_ref_count(&p->ref) > 1)
+	    {
+	      pp = &p->next;
+	      continue;
+	    }
+	  *pp = p->next;
+	  p->next = dead;
+	  dead = p;
+	  resample_cache_bytes -= p->bytes;
 	}
-      else
-	return rs_vib_plain(song, v, countptr);
     }
-  else
+  timi_mutex_unlock(&resample_lock);
+  while ((p = dead) != NULL)
     {
-      if ((modes & MODES_LOOPING) &&
-	  ((modes & MODES_ENVELOPE) ||
-	   (vp->status==VOICE_ON || vp->status==VOICE_SUSTAINED)))
-	{
-	  if (modes & MODES_PINGPONG)
-	    return rs_bidir(song, vp, *countptr);
-	  else
-	    return rs_loop(song, vp, *countptr);
-	}
-      else
-	return rs_plain(song, v, countptr);
+      dead = p->next;
+      drop_data_ref(&p->ref);
+      n++;
     }
+  return n;
 }
 
-void pre_resample(MidSong *song, MidSample *sp)
+size_t resampled_size(void)
+{
+  size_t n;
+  timi_mutex_lock(&resample_lock);
+  n = resample_cache_bytes;
+  timi_mutex_unlock(&resample_lock);
+  return n;
+}
+
+int pre_resample(MidSong *song, MidSample *sp, const char *name, sint32 pos)
 {
   double a, xdiff;
   sint32 incr, ofs, newlen, count;
-  sint16 *newdata, *dest, *src = (sint16 *) sp->data, *vptr;
+  sint16 *newdata, *dest, *src = (sint16 *) sp->data, *vptr, *wide = NULL;
   sint32 v, v1, v2, v3, v4, v5, i;
+  MidResampled *p = NULL, *q;
+  int h = 0;
 #ifdef TIMIDITY_DEBUG
   static const char note_name[12][3] = {
     "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
   };
 #endif
 
+  if (name)
+    {
+      h = resampled_hash(name, pos, sp->note_to_use, song->rate);
+      timi_mutex_lock(&resample_lock);
+      if ((p = find_resampled(h, song->ctx->id, name, pos, sp, song->rate)) != NULL)
+	hold_data_ref(&p->ref);
+      timi_mutex_unlock(&resample_lock);
+      if (p)
+	{
+	  DEBUG_MSG(" * pre-resampled for note %d already\n", sp->note_to_use);
+	  use_resampled(sp, p);
+	  return 0;
+	}
+    }
+
   DEBUG_MSG(" * pre-resampling for note %d (%s%d)\n",
 	  sp->note_to_use,
 	  note_name[sp->note_to_use % 12], (sp->note_to_use & 0x7F) / 12);
@@ -562,7 +1532,7 @@ void pre_resample(MidSong *song, MidSample *sp)
       ((double) (sp->sample_rate) * freq_table[(int) (sp->note_to_use)]);
   if(sp->data_length * a >= 0x7fffffffL) { /* Too large to compute */
     DEBUG_MSG(" *** Can't pre-resampling for note %d\n", sp->note_to_use);
-    return;
+    return 0;
   }
 
   newlen = (sint32)(sp->data_length * a);
@@ -571,14 +1541,27 @@ void pre_resample(MidSong *song, MidSample *sp)
 
   if((double)newlen + incr >= 0x7fffffffL) { /* Too large to compute */
     DEBUG_MSG(" *** Can't pre-resampling for note %d\n", sp->note_to_use);
-    return;
+    return 0;
   }
 
+  if (!(sp->modes & MODES_16BIT))
+    {
+      /* work on 8-bit data as the 16-bit data it plays as */
+      sint32 n = (sp->data_length >> FRACTION_BITS) + 2;
+      wide = (sint16 *) timi_malloc(n * sizeof(sint16));
+      if (!wide)
+	return -1;
+      for (i = 0; i < n; i++)
+	wide[i] = ((sint8 *) sp->data)[i] * 256;
+      src = wide;
+    }
+
   dest = newdata = (sint16 *) timi_malloc((newlen >> (FRACTION_BITS - 1)) + 2);
-  if(!dest) {
-    song->oom = 1;
-    return;
-  }
+  if(!dest)
+    {
+      timi_free(wide);
+      return -1;
+    }
 
   if (--count)
     *dest++ = src[0];
@@ -613,11 +1596,64 @@ void pre_resample(MidSong *song, MidSample *sp)
   *dest = *(dest - 1) / 2;
  ++dest;
   *dest = *(dest - 1) / 2;
+  timi_free(wide);
+
+  if (name && (p = (MidResampled *) timi_malloc(sizeof(MidResampled))) != NULL)
+    {
+      p->name = timi_strdup(name);
+      if (!p->name)
+	{
+	  timi_free(p);
+	  p = NULL;
+	}
+    }
+  if (p)
+    {
+      p->ref.refcount = 2;
+      p->ref.release = release_resampled;
+      p->context = song->ctx->id;
+      p->pos = pos;
+      p->data_length = sp->data_length;
+      p->loop_start = sp->loop_start;
+      p->loop_end = sp->loop_end;
+      p->sample_rate = sp->sample_rate;
+      p->root_freq = sp->root_freq;
+      p->modes = sp->modes;
+      p->note = sp->note_to_use;
+      p->rate = song->rate;
+      p->data = (sample_t *) newdata;
+      p->new_length = newlen;
+      p->new_loop_start = (sint32)(sp->loop_start * a);
+      p->new_loop_end = (sint32)(sp->loop_end * a);
+      p->bytes = (newlen >> (FRACTION_BITS - 1)) + 2;
+      p->ref.bytes = p->bytes;
+
+      timi_mutex_lock(&resample_lock);
+      /* another thread may have got here first */
+      if ((q = find_resampled(h, song->ctx->id, name, pos, sp, song->rate)) != NULL)
+	hold_data_ref(&q->ref);
+      else
+	{
+	  p->next = resample_cache[h];
+	  resample_cache[h] = p;
+	  resample_cache_bytes += p->bytes;
+	}
+      timi_mutex_unlock(&resample_lock);
+      if (q)
+	{
+	  release_resampled(&p->ref);
+	  p = q;
+	}
+      use_resampled(sp, p);
+      return 0;
+    }
 
   sp->data_length = newlen;
   sp->loop_start = (sint32)(sp->loop_start * a);
   sp->loop_end = (sint32)(sp->loop_end * a);
-  timi_free(sp->data);
+  free_sample_data(sp);
   sp->data = (sample_t *) newdata;
   sp->sample_rate = 0;
+  sp->modes |= MODES_16BIT;
+  return 0;
 }
@@ -32,9 +32,52 @@
 #define TIMIDITY_RESAMPLE_H
 
 #define resample_voice TIMI_NAMESPACE(resample_voice)
+#define can_resample_mix TIMI_NAMESPACE(can_resample_mix)
+#define resample_mix TIMI_NAMESPACE(resample_mix)
 #define pre_resample TIMI_NAMESPACE(pre_resample)
+#define purge_resampled TIMI_NAMESPACE(purge_resampled)
+#define resampled_size TIMI_NAMESPACE(resampled_size)
+#define init_interpolation TIMI_NAMESPACE(init_interpolation)
+#define mix_window TIMI_NAMESPACE(mix_window)
 
-extern sample_t *resample_voice(MidSong *song, int v, sint32 *countptr);
-extern void pre_resample(MidSong *song, MidSample *sp);
+/* where resample_mix() mixes the samples of a voice in, and how */
+typedef struct _MidMixer
+{
+  sint32 *lp;
+  final_volume_t left, right;
+  int panned, mono;
+  /* if ramp is set, left and right are not used: the volumes start at
+     left_ramp and right_ramp (<< RAMP_BITS) and move by left_step and
+     right_step every sample. */
+  int ramp;
+  sint32 left_ramp, right_ramp, left_step, right_step;
+  /* if fp is set, none of the above but panned and mono are: the
+     samples go into fp instead, at the float gains, which move by the
+     float steps every sample. */
+  float *fp;
+  float fleft, fright, fleft_step, fright_step;
+} MidMixer;
+
+/* mixes count samples in as mx says, and moves mx on past them */
+extern void mix_window(MidMixer *mx, const sample_t *sp, sint32 count);
+
+/* resample_voice() resamples the next *countptr samples of a voice into
+   buf, of song->buffer_size samples, unless they're played right from
+   the sample data: returns where they are. */
+extern sample_t *resample_voice(MidSong *song, sample_t *buf, int v, sint32 *countptr);
+/* resample_mix() mixes the next count samples of a voice right as they
+   are resampled, if can_resample_mix() says that it comes out the same
+   as mixing the resample_voice() results would. */
+extern int can_resample_mix(MidSong *song, int v, sint32 count);
+extern void resample_mix(MidSong *song, int v, sint32 count, MidMixer *mx);
+/* returns -1 if out of memory, the sample is left untouched then.
+   the result is shared with the other samples resampled from the same
+   source position in the named file, unless name is NULL. */
+extern int pre_resample(MidSong *song, MidSample *sp, const char *name, sint32 pos);
+extern int purge_resampled(int all);
+extern size_t resampled_size(void);
+/* sets up the MID_INTERP_* interpolation of the song.
+   returns -1 if out of memory. */
+extern int init_interpolation(MidSong *song, int interpolation, int taps);
 
 #endif /* TIMIDITY_RESAMPLE_H */
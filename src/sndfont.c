@@ -56,11 +56,31 @@
 
 /*#define SF_CLOSE_EACH_FILE*/
 
+/* map the sample chunk into memory and let little-endian, unfiltered
+   samples point right into it, instead of reading copies of them. */
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && !defined(WORDS_BIGENDIAN)
+#define SF_USE_MMAP
+#endif
+
 /*#define SF_SUPPRESS_ENVELOPE*/
 /*#define SF_SUPPRESS_TREMOLO*/
 /*#define SF_SUPPRESS_VIBRATO*/
 #define SF_SUPPRESS_CUTOFF
 
+/* keep the parsed fonts in index files, where a cache directory is set */
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_SYS_STAT_H) && defined(HAVE_MKSTEMP)
+#define SF_USE_INDEX
+#endif
+
+#if defined(SF_USE_MMAP) || defined(SF_USE_INDEX)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef SF_USE_INDEX
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
 /*----------------------------------------------------------------
  * local parameters
  *----------------------------------------------------------------*/
@@ -82,18 +102,46 @@ typedef struct _InstList {
 	int bank, preset, keynote;
 	int samples;
 	int order;
+	char name[21];		/* of the first sf instrument */
 	SampleList *slist;
 	struct _InstList *next;
+	struct _InstList *hnext;	/* in the hash table */
 } InstList;
 
-typedef struct SFInsts {
+/* drum sets have an entry for each key, the other banks for each preset */
+#define SF_INST_HASH	1024
+#define INST_HASH(bank,preset,keynote) \
+	(((((unsigned)(bank) << 7) + (unsigned)(preset)) * 131 + (unsigned)((keynote) + 1)) % SF_INST_HASH)
+
+/* the sample chunk of a font, mapped once for every song loaded with
+   the same context: the table holds no reference of its own, like the
+   one of the sample data below. */
+typedef struct _SFMap {
+	MidDataRef ref;		/* one for each song, one for each sample */
+	void *addr;
+	size_t size;
+	sint32 offset;		/* file position of addr */
+	int context;		/* whose search paths found fname */
+	char *fname;
+	sint32 samplepos, samplesize;	/* the chunk it was mapped for */
+	struct _SFMap *next;
+} SFMap;
+
+typedef struct _SFInsts {
 	char *fname;
 	FILE *fd;
+	long fsize, mtime;	/* of the file, as it was opened */
+	timi_mutex lock;	/* fd: instruments may be loaded by several threads */
 	uint16 version, minorversion;
 	sint32 samplepos, samplesize;
 	InstList *instlist;
+	InstList *insthash[SF_INST_HASH];
+	SFMap *map;		/* the mapped sample chunk, or NULL */
+	MidContext *ctx;	/* where to look for the file */
 } SFInsts;
 
+/* exclude and order directives, hashed by their exact bank/preset/keynote
+   with -1 for any preset or keynote */
 typedef struct _SFExclude {
 	int bank, preset, keynote;
 	struct _SFExclude *next;
@@ -102,18 +150,51 @@ typedef struct _SFExclude {
 typedef struct _SFOrder {
 	int bank, preset, keynote;
 	int order;
+	int seq;		/* the last one given wins */
 	struct _SFOrder *next;
 } SFOrder;
 
+#define SF_RULE_HASH	64
+#define RULE_HASH(bank,preset,keynote) \
+	(((((unsigned)(bank) << 7) + (unsigned)(preset)) * 131 + (unsigned)((keynote) + 1)) % SF_RULE_HASH)
+
+/* the directives of a context */
+typedef struct _SFRules {
+	SFExclude *exclude[SF_RULE_HASH];
+	SFOrder *order[SF_RULE_HASH];
+	int order_seq;
+} SFRules;
+
+/* sample data read from a font, shared by every zone and preset (of
+   any song) playing the same wave.  the table holds no reference of
+   its own: the last sample using the data frees it. */
+typedef struct _SFSampleData {
+	MidDataRef ref;
+	int context;		/* whose search paths found fname */
+	char *fname;
+	sint32 startsample, endsample;
+	sample_t *data;
+	struct _SFSampleData *next;
+} SFSampleData;
+
+#define SF_DATA_HASH	256
+
+static SFSampleData *sample_table[SF_DATA_HASH];
+static timi_mutex sample_lock = TIMI_MUTEX_INITIALIZER; /* and map_table */
+
+#ifdef SF_USE_MMAP
+static SFMap *map_table;
+#endif
+
 
 /*----------------------------------------------------------------*/
 
 static void free_sample(InstList *ip);
-static MidInstrument *load_from_file(MidSong *song, SFInsts *rec, InstList *ip);
-static int is_excluded(int bank, int preset, int keynote);
-static void free_exclude(void);
-static int is_ordered(int bank, int preset, int keynote);
-static void free_order(void);
+static int load_from_file(MidSong *song, SFInsts *rec, InstList *ip, MidInstrument **out);
+static int is_excluded(SFRules *rules, int bank, int preset, int keynote);
+static void free_exclude(SFRules *rules);
+static int is_ordered(SFRules *rules, int bank, int preset, int keynote);
+static void free_order(SFRules *rules);
 static void parse_preset(MidSong *song, SFInsts *rec, SFInfo *sf, int preset, int order);
 static void parse_gen(Layer *lay, tgenrec *gen);
 static void parse_preset_layer(Layer *lay, SFInfo *sf, int idx);
@@ -150,67 +231,614 @@ static void calc_filterQ(Layer *lay, SFInfo *sf, SampleList *sp);
 /*----------------------------------------------------------------*/
 
 
-static SFInsts sfrec;
-static SFExclude *sfexclude;
-static SFOrder *sforder;
-
 #ifndef SF_SUPPRESS_CUTOFF
 static const int cutoff_allowed = 0;
 #endif
 
 
-void init_soundfont(MidSong *song, const char *fname, int order)
+static void free_instlist(SFInsts *rec);
+static void drop_map(SFInsts *rec);
+
+#ifdef SF_USE_MMAP
+static void release_map(MidDataRef *ref)
+{
+	SFMap *map = (SFMap *) ref, **pp;
+
+	timi_mutex_lock(&sample_lock);
+	for (pp = &map_table; *pp; pp = &(*pp)->next) {
+		if (*pp == map) {
+			*pp = map->next;
+			break;
+		}
+	}
+	timi_mutex_unlock(&sample_lock);
+	munmap(map->addr, map->size);
+	timi_free(map->fname);
+	timi_free(map);
+}
+
+/* with sample_lock held */
+static SFMap *find_map(int context, const char *fname, sint32 pos, sint32 size)
+{
+	SFMap *map;
+	for (map = map_table; map; map = map->next) {
+		if (map->samplepos == pos && map->samplesize == size &&
+		    map->context == context && !strcmp(map->fname, fname) &&
+		    hold_live_data_ref(&map->ref))
+			return map;
+	}
+	return NULL;
+}
+
+/* map the sample chunk, as far as it is really in the file */
+static SFMap *map_samples(FILE *fd, sint32 pos, sint32 size)
+{
+	SFMap *map;
+	void *addr;
+	long pagesize, end;
+	sint32 offset;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (pos <= 0 || size <= 0 || pagesize <= 0)
+		return NULL;
+	if (fseek(fd, 0, SEEK_END) < 0 || (end = ftell(fd)) < 0)
+		return NULL;
+	if (end > (long)pos + size)
+		end = (long)pos + size;
+	if (end <= pos)
+		return NULL;
+
+	offset = pos - (sint32)(pos % pagesize);
+	addr = mmap(NULL, (size_t)(end - offset), PROT_READ, MAP_SHARED, fileno(fd), offset);
+	if (addr == MAP_FAILED) {
+		DEBUG_MSG("can't map soundfont samples\n");
+		return NULL;
+	}
+	map = (SFMap *) timi_malloc(sizeof(SFMap));
+	if (!map) {
+		munmap(addr, (size_t)(end - offset));
+		return NULL;
+	}
+	map->ref.refcount = 1;
+	map->ref.bytes = 0;
+	map->ref.release = release_map;
+	map->addr = addr;
+	map->size = (size_t)(end - offset);
+	map->offset = offset;
+	map->fname = NULL;
+	map->next = NULL;
+	return map;
+}
+
+/* the mapping of the sample chunk of the font, made only if no other
+   song loaded with the same context has it already */
+static SFMap *share_map(SFInsts *rec)
+{
+	SFMap *map, *q;
+
+	timi_mutex_lock(&sample_lock);
+	map = find_map(rec->ctx->id, rec->fname, rec->samplepos, rec->samplesize);
+	timi_mutex_unlock(&sample_lock);
+	if (map)
+		return map;
+
+	if (!(map = map_samples(rec->fd, rec->samplepos, rec->samplesize)))
+		return NULL;
+	if (!(map->fname = timi_strdup(rec->fname))) {
+		munmap(map->addr, map->size);
+		timi_free(map);
+		return NULL;
+	}
+	map->context = rec->ctx->id;
+	map->samplepos = rec->samplepos;
+	map->samplesize = rec->samplesize;
+
+	timi_mutex_lock(&sample_lock);
+	/* another thread may have mapped it meanwhile */
+	if ((q = find_map(map->context, map->fname, map->samplepos, map->samplesize)) == NULL) {
+		map->next = map_table;
+		map_table = map;
+	}
+	timi_mutex_unlock(&sample_lock);
+	if (q) {
+		munmap(map->addr, map->size);
+		timi_free(map->fname);
+		timi_free(map);
+		map = q;
+	}
+	return map;
+}
+
+/* return the sample data right from the mapped file, if it can be used
+   as is (pre-resampling makes a new copy anyway.) the three guard samples the resampler may read past the end of
+   the data must be there, too: the spec requires at least 46 zero data
+   points after each sample, and we're happy with the first three. */
+static sample_t *map_sample(SFInsts *rec, SampleList *sp)
+{
+	SFMap *map = rec->map;
+	sample_t *data;
+	sint32 pos;
+
+	if (!map || sp->endsample < 0)
+		return NULL;
+#ifndef SF_SUPPRESS_CUTOFF
+	if (sp->cutoff_freq > 0 && cutoff_allowed)
+		return NULL; /* will be filtered */
+#endif
+	pos = sp->startsample - map->offset;
+	if (sp->startsample < rec->samplepos || (pos & 1) ||
+	    (size_t)pos + sp->endsample + 6 > map->size)
+		return NULL;
+	data = (sample_t *)((char *)map->addr + pos);
+	if (data[sp->endsample/2] || data[sp->endsample/2 + 1] ||
+	    data[sp->endsample/2 + 2])
+		return NULL;
+	hold_data_ref(&map->ref);
+	return data;
+}
+#endif
+
+static InstList *find_inst(SFInsts *rec, int bank, int preset, int keynote)
+{
+	InstList *ip;
+	for (ip = rec->insthash[INST_HASH(bank, preset, keynote)]; ip; ip = ip->hnext) {
+		if (ip->bank == bank && ip->preset == preset && ip->keynote == keynote)
+			return ip;
+	}
+	return NULL;
+}
+
+static void add_inst(SFInsts *rec, InstList *ip)
+{
+	unsigned h = INST_HASH(ip->bank, ip->preset, ip->keynote);
+	ip->hnext = rec->insthash[h];
+	rec->insthash[h] = ip;
+}
+
+static void alloc_bank(MidSong *song, int bank, int preset)
 {
-	static SFInfo sfinfo;
+	if (bank == 128) {
+		if (!song->drumset[preset]) {
+			song->drumset[preset] = (MidToneBank*)timi_calloc(1, sizeof(MidToneBank));
+			song->drumset[preset]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
+		}
+	} else {
+		if (!song->tonebank[bank]) {
+			song->tonebank[bank] = (MidToneBank*)timi_calloc(1, sizeof(MidToneBank));
+			song->tonebank[bank]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
+		}
+	}
+}
+
+#ifdef SF_USE_INDEX
+/*----------------------------------------------------------------
+ * precompiled index: the parsed instrument list of a font is kept
+ * in a file, so that the next song needn't parse the font again.
+ * it is only good for the same font file, output rate and options,
+ * and for the machine that wrote it: everything is checked.
+ *----------------------------------------------------------------*/
+
+/* bump this whenever MidSample or the records below change */
+#define SF_INDEX_MAGIC	"TiMSFI1"
+
+typedef struct _SFIndexHeader {
+	char magic[8];
+	uint32 byteorder;	/* 0x01020304, as written */
+	uint32 sizes;		/* of the records, and of long */
+	uint32 key;		/* hash of the exclude and order lists */
+	sint32 rate, control_ratio, order;
+	long fsize, mtime;	/* of the font file */
+	uint16 version, minorversion;
+	sint32 samplepos, samplesize;
+	sint32 ninsts, nsamples;
+	sint32 namelen;		/* the font name follows */
+	uint32 checksum;	/* of everything after the header */
+} SFIndexHeader;
+/* then: uint8 banks[256]; the tone banks and drumsets to allocate */
+
+typedef struct _SFIndexInst {
+	sint32 bank, preset, keynote, order, samples;
+	char name[24];
+} SFIndexInst;
+/* each one followed by its samples */
+
+typedef struct _SFIndexSample {
+	MidSample v;
+	sint32 startsample, endsample;
+	sint32 cutoff_freq;
+	float resonance;
+} SFIndexSample;
+
+#define SF_INDEX_SIZES	((uint32)(sizeof(SFIndexHeader) << 20) ^	\
+			 (uint32)(sizeof(SFIndexSample) << 8) ^		\
+			 (uint32)(sizeof(SFIndexInst) << 4) ^ sizeof(long))
+
+static uint32 hash_bytes(uint32 h, const void *p, size_t len)
+{
+	const unsigned char *s = (const unsigned char *) p;
+	while (len--)
+		h = (h ^ *s++) * 16777619U; /* FNV-1a */
+	return h;
+}
+
+static uint32 hash_options(SFRules *rules)
+{
+	uint32 h = 2166136261U;
+	SFExclude *e;
+	SFOrder *o;
 	int i;
+	if (!rules)
+		return h;
+	for (i = 0; i < SF_RULE_HASH; i++) {
+		for (e = rules->exclude[i]; e; e = e->next) {
+			h = hash_bytes(h, &e->bank, sizeof(int));
+			h = hash_bytes(h, &e->preset, sizeof(int));
+			h = hash_bytes(h, &e->keynote, sizeof(int));
+		}
+	}
+	h = hash_bytes(h, "/", 1);
+	for (i = 0; i < SF_RULE_HASH; i++) {
+		for (o = rules->order[i]; o; o = o->next) {
+			h = hash_bytes(h, &o->bank, sizeof(int));
+			h = hash_bytes(h, &o->preset, sizeof(int));
+			h = hash_bytes(h, &o->keynote, sizeof(int));
+			h = hash_bytes(h, &o->order, sizeof(int));
+			h = hash_bytes(h, &o->seq, sizeof(int));
+		}
+	}
+	return h;
+}
+
+static void init_index_header(MidSong *song, SFInsts *rec, int order, SFIndexHeader *hdr)
+{
+	memset(hdr, 0, sizeof(SFIndexHeader));
+	memcpy(hdr->magic, SF_INDEX_MAGIC, 8);
+	hdr->byteorder = 0x01020304;
+	hdr->sizes = SF_INDEX_SIZES;
+	hdr->key = hash_options(song->ctx->sfrules);
+	hdr->rate = song->rate;
+	hdr->control_ratio = song->control_ratio;
+	hdr->order = order;
+	hdr->fsize = rec->fsize;
+	hdr->mtime = rec->mtime;
+	hdr->namelen = (sint32) strlen(rec->fname);
+}
+
+/* the index file for a font, in the cache directory */
+static char *index_name(const char *dir, SFIndexHeader *hdr, const char *fname)
+{
+	char *path;
+	uint32 h = 2166136261U;
+
+	h = hash_bytes(h, fname, strlen(fname));
+	h = hash_bytes(h, &hdr->key, sizeof(uint32));
+	h = hash_bytes(h, &hdr->rate, sizeof(sint32));
+	h = hash_bytes(h, &hdr->control_ratio, sizeof(sint32));
+	h = hash_bytes(h, &hdr->order, sizeof(sint32));
+
+	path = (char *) timi_malloc(strlen(dir) + 14);
+	if (path)
+		sprintf(path, "%s/%08lx.sfi", dir, (unsigned long) h);
+	return path;
+}
+
+static void set_inst_name(MidSong *song, InstList *ip)
+{
+	char **namep;
+	if (ip->bank == 128)
+		namep = &song->drumset[ip->preset]->tone[ip->keynote].name;
+	else
+		namep = &song->tonebank[ip->bank]->tone[ip->preset].name;
+	if (*namep == NULL)
+		*namep = timi_strdup(ip->name);
+}
+
+/* builds the instrument list from the index, if it is good for
+   this font and song. */
+static int read_index(MidSong *song, SFInsts *rec, const char *path, const SFIndexHeader *want)
+{
+	FILE *fp;
+	struct stat st;
+	void *addr;
+	const char *p, *end;
+	SFIndexHeader hdr;
+	SFIndexInst ri;
+	InstList *ip, **ipp;
+	SampleList *sp, **spp;
+	const uint8 *banks;
+	sint32 i, j, nsamples;
+	int ret = -1;
+
+	if ((fp = fopen(path, "rb")) == NULL)
+		return -1;
+	if (fstat(fileno(fp), &st) < 0 || st.st_size < (off_t) sizeof(SFIndexHeader)) {
+		fclose(fp);
+		return -1;
+	}
+	addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+	fclose(fp);
+	if (addr == MAP_FAILED)
+		return -1;
+	p = (const char *) addr;
+	end = p + st.st_size;
+
+	memcpy(&hdr, p, sizeof(hdr));
+	p += sizeof(hdr);
+	if (memcmp(hdr.magic, want->magic, 8) ||
+	    hdr.byteorder != want->byteorder || hdr.sizes != want->sizes ||
+	    hdr.key != want->key || hdr.rate != want->rate ||
+	    hdr.control_ratio != want->control_ratio || hdr.order != want->order ||
+	    hdr.fsize != want->fsize || hdr.mtime != want->mtime ||
+	    hdr.namelen != want->namelen || hdr.ninsts < 0 || hdr.nsamples < 0) {
+		DEBUG_MSG("%s: stale soundfont index\n", path);
+		goto done;
+	}
+	if (end - p < hdr.namelen + 256 || memcmp(p, rec->fname, hdr.namelen) ||
+	    hash_bytes(2166136261U, p, end - p) != hdr.checksum) {
+		DEBUG_MSG("%s: bad soundfont index\n", path);
+		goto done;
+	}
+	p += hdr.namelen;
+	banks = (const uint8 *) p;
+	p += 256;
+
+	ipp = &rec->instlist;
+	nsamples = 0;
+	for (i = 0; i < hdr.ninsts; i++) {
+		if (end - p < (long) sizeof(SFIndexInst))
+			goto bad;
+		memcpy(&ri, p, sizeof(ri));
+		p += sizeof(ri);
+		if (ri.samples <= 0 || ri.samples > hdr.nsamples - nsamples ||
+		    (end - p) / (long) sizeof(SFIndexSample) < ri.samples ||
+		    ri.bank < 0 || ri.bank > 128 || ri.preset < 0 || ri.preset > 127 ||
+		    ri.keynote < -1 || ri.keynote > 127 || (ri.bank == 128 && ri.keynote < 0) ||
+		    !banks[(ri.bank == 128) ? 128 + ri.preset : ri.bank])
+			goto bad;
+		ip = (InstList *) timi_malloc(sizeof(InstList));
+		if (!ip)
+			goto bad;
+		ip->bank = ri.bank;
+		ip->preset = ri.preset;
+		ip->keynote = ri.keynote;
+		ip->order = ri.order;
+		ip->samples = ri.samples;
+		ip->slist = NULL;
+		ip->next = NULL;
+		memcpy(ip->name, ri.name, 20);
+		ip->name[20] = 0;
+		*ipp = ip;
+		ipp = &ip->next;
+		add_inst(rec, ip);
+		spp = &ip->slist;
+		for (j = 0; j < ri.samples; j++) {
+			SFIndexSample rs;
+			memcpy(&rs, p, sizeof(rs));
+			p += sizeof(rs);
+			if (rs.startsample < 0 || rs.endsample < 0)
+				goto bad;
+			sp = (SampleList *) timi_malloc(sizeof(SampleList));
+			if (!sp)
+				goto bad;
+			sp->v = rs.v;
+			sp->v.data = NULL;
+			sp->v.data_ref = NULL;
+			sp->startsample = rs.startsample;
+			sp->endsample = rs.endsample;
+			sp->cutoff_freq = rs.cutoff_freq;
+			sp->resonance = rs.resonance;
+			sp->next = NULL;
+			*spp = sp;
+			spp = &sp->next;
+		}
+		nsamples += ri.samples;
+	}
+	if (p != end || nsamples != hdr.nsamples)
+		goto bad;
+
+	for (i = 0; i < 128; i++) {
+		if (banks[i])
+			alloc_bank(song, i, 0);
+		if (banks[128 + i])
+			alloc_bank(song, 128, i);
+	}
+	for (ip = rec->instlist; ip; ip = ip->next)
+		set_inst_name(song, ip);
+	rec->version = hdr.version;
+	rec->minorversion = hdr.minorversion;
+	rec->samplepos = hdr.samplepos;
+	rec->samplesize = hdr.samplesize;
+	ret = 0;
+	goto done;
+
+bad:
+	DEBUG_MSG("%s: bad soundfont index\n", path);
+	free_instlist(rec);
+done:
+	munmap(addr, (size_t) st.st_size);
+	return ret;
+}
+
+static void write_index(SFInsts *rec, const char *path, SFIndexHeader *hdr, const uint8 *banks)
+{
+	InstList *ip;
+	SampleList *sp;
+	SFIndexInst ri;
+	SFIndexSample rs;
+	char *tmp;
+	FILE *fp;
+	int fd, err;
+
+	hdr->version = rec->version;
+	hdr->minorversion = rec->minorversion;
+	hdr->samplepos = rec->samplepos;
+	hdr->samplesize = rec->samplesize;
+	hdr->ninsts = hdr->nsamples = 0;
+	for (ip = rec->instlist; ip; ip = ip->next) {
+		hdr->ninsts++;
+		hdr->nsamples += ip->samples;
+	}
+
+	/* write a new file and move it in place, so that nobody
+	   reads a half written one */
+	tmp = (char *) timi_malloc(strlen(path) + 8);
+	if (!tmp)
+		return;
+	sprintf(tmp, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) < 0) {
+		DEBUG_MSG("can't write soundfont index %s\n", path);
+		timi_free(tmp);
+		return;
+	}
+	if ((fp = fdopen(fd, "wb")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		timi_free(tmp);
+		return;
+	}
+	hdr->checksum = 2166136261U;
+	err = fwrite(hdr, sizeof(SFIndexHeader), 1, fp) != 1;
+	err |= fwrite(rec->fname, hdr->namelen, 1, fp) != 1;
+	hdr->checksum = hash_bytes(hdr->checksum, rec->fname, hdr->namelen);
+	err |= fwrite(banks, 256, 1, fp) != 1;
+	hdr->checksum = hash_bytes(hdr->checksum, banks, 256);
+	for (ip = rec->instlist; ip && !err; ip = ip->next) {
+		memset(&ri, 0, sizeof(ri));
+		ri.bank = ip->bank;
+		ri.preset = ip->preset;
+		ri.keynote = ip->keynote;
+		ri.order = ip->order;
+		ri.samples = ip->samples;
+		memcpy(ri.name, ip->name, 21);
+		err |= fwrite(&ri, sizeof(ri), 1, fp) != 1;
+		hdr->checksum = hash_bytes(hdr->checksum, &ri, sizeof(ri));
+		for (sp = ip->slist; sp && !err; sp = sp->next) {
+			memset(&rs, 0, sizeof(rs));
+			rs.v = sp->v;
+			rs.v.data = NULL;
+			rs.v.data_ref = NULL;
+			rs.startsample = sp->startsample;
+			rs.endsample = sp->endsample;
+			rs.cutoff_freq = sp->cutoff_freq;
+			rs.resonance = sp->resonance;
+			err |= fwrite(&rs, sizeof(rs), 1, fp) != 1;
+			hdr->checksum = hash_bytes(hdr->checksum, &rs, sizeof(rs));
+		}
+	}
+	/* now that the checksum is known */
+	if (!err)
+		err = fseek(fp, 0, SEEK_SET) < 0 ||
+		      fwrite(hdr, sizeof(SFIndexHeader), 1, fp) != 1;
+	err |= fclose(fp) != 0;
+	if (err || rename(tmp, path) < 0) {
+		DEBUG_MSG("can't write soundfont index %s\n", path);
+		unlink(tmp);
+	}
+	timi_free(tmp);
+}
+#endif /* SF_USE_INDEX */
+
+void init_soundfont(MidSong *song, const char *fname, int order, const char *cache_dir)
+{
+	SFInfo sfinfo;
+	SFInsts *rec;
+	int i;
+#ifdef SF_USE_INDEX
+	SFIndexHeader hdr;
+	char *index = NULL;
+	uint8 banks[256];
+#endif
 
 	DEBUG_MSG("init soundfonts `%s'\n", fname);
 
-	if ((sfrec.fd = timi_openfile(fname)) == NULL) {
+	free_soundfont(song);
+	rec = (SFInsts *) timi_calloc(1, sizeof(SFInsts));
+	if (!rec) {
+		song->oom = 1;
+		return;
+	}
+	if ((rec->fd = timi_openfile(song->ctx, fname)) == NULL) {
 		DEBUG_MSG("can't open soundfont file %s\n", fname);
+		timi_free(rec);
+		return;
+	}
+	rec->ctx = song->ctx;
+	timi_filestamp(rec->fd, &rec->fsize, &rec->mtime);
+	rec->fname = timi_strdup(fname);
+	if (!rec->fname) {
+		fclose(rec->fd);
+		timi_free(rec);
+		song->oom = 1;
 		return;
 	}
-	sfrec.fname = timi_strdup(fname);
-	if (load_sbk(sfrec.fd, &sfinfo) < 0) {
+
+#ifdef SF_USE_INDEX
+	if (cache_dir) {
+		init_index_header(song, rec, order, &hdr);
+		index = index_name(cache_dir, &hdr, fname);
+		if (index && read_index(song, rec, index, &hdr) == 0) {
+			DEBUG_MSG("using soundfont index %s\n", index);
+			timi_free(index);
+			goto parsed;
+		}
+		memset(banks, 0, sizeof(banks));
+	}
+#else
+	TIMI_UNUSED(cache_dir);
+#endif
+
+	if (load_sbk(rec->fd, &sfinfo) < 0) {
 		DEBUG_MSG("%s: bad soundfont file\n", fname);
-		fclose(sfrec.fd);
-		sfrec.fd = NULL;
-		timi_free(sfrec.fname);
-		sfrec.fname = NULL;
+		fclose(rec->fd);
+		timi_free(rec->fname);
+		timi_free(rec);
 		free_sbk(&sfinfo);
+#ifdef SF_USE_INDEX
+		timi_free(index);
+#endif
 		return;
 	}
 
 	for (i = 0; i < sfinfo.nrpresets - 1; i++) {
 		int bank = sfinfo.presethdr[i].bank;
 		int preset = sfinfo.presethdr[i].preset;
-		if (is_excluded(bank, preset, -1))
+		if (is_excluded(song->ctx->sfrules, bank, preset, -1))
 			continue;
-		if (bank == 128) {
-			if (!song->drumset[preset]) {
-				song->drumset[preset] = (MidToneBank*)timi_calloc(1, sizeof(MidToneBank));
-				song->drumset[preset]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
-			}
-		} else {
-			if (!song->tonebank[bank]) {
-				song->tonebank[bank] = (MidToneBank*)timi_calloc(1, sizeof(MidToneBank));
-				song->tonebank[bank]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
-			}
-		}
-		parse_preset(song, &sfrec, &sfinfo, i, order);
+		alloc_bank(song, bank, preset);
+#ifdef SF_USE_INDEX
+		if (bank < 128)
+			banks[bank] = 1;
+		else if (bank == 128)
+			banks[128 + preset] = 1;
+#endif
+		parse_preset(song, rec, &sfinfo, i, order);
 	}
 
 	/* copy header info */
-	sfrec.version = sfinfo.version;
-	sfrec.minorversion = sfinfo.minorversion;
-	sfrec.samplepos = sfinfo.samplepos;
-	sfrec.samplesize = sfinfo.samplesize;
+	rec->version = sfinfo.version;
+	rec->minorversion = sfinfo.minorversion;
+	rec->samplepos = sfinfo.samplepos;
+	rec->samplesize = sfinfo.samplesize;
 
 	free_sbk(&sfinfo);
 
+#ifdef SF_USE_INDEX
+	if (index) {
+		write_index(rec, index, &hdr, banks);
+		timi_free(index);
+	}
+parsed:
+#endif
+	timi_mutex_init(&rec->lock);
+	song->soundfont = rec;
+
+#ifdef SF_USE_MMAP
+	rec->map = share_map(rec);
+#endif
+
 #ifdef SF_CLOSE_EACH_FILE
-	fclose(sfrec.fd);
-	sfrec.fd = NULL;
+	fclose(rec->fd);
+	rec->fd = NULL;
 #endif
 }
 
@@ -225,25 +853,50 @@ static void free_sample(InstList *ip)
 	timi_free(ip);
 }
 
-void end_soundfont(void)
+static void free_instlist(SFInsts *rec)
 {
 	InstList *ip, *next;
 
-	if (sfrec.fd) {
-		fclose(sfrec.fd);
-		sfrec.fd = NULL;
-	}
-	timi_free(sfrec.fname);
-	sfrec.fname = NULL;
-
-	for (ip = sfrec.instlist; ip; ip = next) {
+	for (ip = rec->instlist; ip; ip = next) {
 		next = ip->next;
 		free_sample(ip);
 	}
-	sfrec.instlist = NULL;
+	rec->instlist = NULL;
+	memset(rec->insthash, 0, sizeof(rec->insthash));
+}
 
-	free_exclude();
-	free_order();
+/* the samples using the mapping keep it alive */
+static void drop_map(SFInsts *rec)
+{
+	if (rec->map)
+		drop_data_ref(&rec->map->ref);
+	rec->map = NULL;
+}
+
+void free_soundfont(MidSong *song)
+{
+	SFInsts *rec = song->soundfont;
+
+	if (!rec)
+		return;
+	if (rec->fd)
+		fclose(rec->fd);
+	timi_free(rec->fname);
+	free_instlist(rec);
+	drop_map(rec);
+	timi_mutex_destroy(&rec->lock);
+	timi_free(rec);
+	song->soundfont = NULL;
+}
+
+void end_soundfont(MidContext *ctx)
+{
+	if (!ctx->sfrules)
+		return;
+	free_exclude(ctx->sfrules);
+	free_order(ctx->sfrules);
+	timi_free(ctx->sfrules);
+	ctx->sfrules = NULL;
 }
 
 
@@ -251,70 +904,227 @@ void end_soundfont(void)
  * get converted instrument info and load the wave data from file
  *----------------------------------------------------------------*/
 
-MidInstrument *load_soundfont(MidSong *song, int order, int bank, int preset, int keynote)
+int load_soundfont(MidSong *song, int order, int bank, int preset, int keynote, MidInstrument **out)
 {
+	SFInsts *rec = song->soundfont;
 	InstList *ip;
-	MidInstrument *inst = NULL;
-
-	if (sfrec.fd == NULL) {
-		if (sfrec.fname == NULL)
-			return NULL;
-		if ((sfrec.fd = timi_openfile(sfrec.fname)) == NULL) {
-			DEBUG_MSG("can't open soundfont file %s\n", sfrec.fname);
-			return NULL;
-		}
+	MidInstrument *inst;
+	MidInstKey key;
+
+	*out = NULL;
+	if (rec == NULL)
+		return 0;
+
+	ip = find_inst(rec, bank, preset, keynote);
+	if (!ip || ip->order != order || !ip->samples)
+		return 0;
+
+	memset(&key, 0, sizeof(key));
+	key.type = INST_SF2;
+	key.context = song->ctx->id;
+	key.name = rec->fname;
+	key.fsize = rec->fsize;
+	key.mtime = rec->mtime;
+	key.bank = bank;
+	key.preset = preset;
+	key.keynote = keynote;
+	key.order = order;
+	key.rate = song->rate;
+	key.control_ratio = song->control_ratio;
+	if ((*out = find_instrument(&key)) != NULL)
+		return 0;
+
+	if (load_from_file(song, rec, ip, &inst) < 0)
+		return -1;
+	*out = cache_instrument(&key, inst);
+
+#ifdef SF_CLOSE_EACH_FILE
+	timi_mutex_lock(&rec->lock);
+	if (rec->fd) {
+		fclose(rec->fd);
+		rec->fd = NULL;
 	}
+	timi_mutex_unlock(&rec->lock);
+#endif
 
-	for (ip = sfrec.instlist; ip; ip = ip->next) {
-		if (ip->bank == bank && ip->preset == preset &&
-		    (keynote < 0 || keynote == ip->keynote) &&
-		    ip->order == order)
-			break;
+	return 0;
+}
+
+
+static int sample_data_hash(const char *fname, sint32 startsample, sint32 endsample)
+{
+	uint32 h = 2166136261U;
+	while (*fname)
+		h = (h ^ (unsigned char) *fname++) * 16777619U;
+	h = (h ^ (uint32) startsample) * 16777619U;
+	h = (h ^ (uint32) endsample) * 16777619U;
+	return (int) (h % SF_DATA_HASH);
+}
+
+/* read a copy of the sample data, in machine byte order. returns -1
+   if out of memory; *out is NULL if the font can't be read. */
+static int read_sample(SFInsts *rec, SampleList *sp, sample_t **out)
+{
+	sample_t *data;
+#ifdef WORDS_BIGENDIAN
+	sint32 j;
+	sint16 *tmp, s;
+#endif
+	*out = NULL;
+	data = (sample_t*) timi_malloc(sp->endsample + 6);
+	if (!data)
+		return -1;
+
+	timi_mutex_lock(&rec->lock);
+	if (rec->fd == NULL &&
+	    (rec->fd = timi_openfile(rec->ctx, rec->fname)) == NULL) {
+		timi_mutex_unlock(&rec->lock);
+		DEBUG_MSG("can't open soundfont file %s\n", rec->fname);
+		timi_free(data);
+		return 0;
 	}
-	if (ip && ip->samples)
-		inst = load_from_file(song, &sfrec, ip);
+	fseek(rec->fd, sp->startsample, SEEK_SET);
+	fread(data, sp->endsample, 1, rec->fd);
+	timi_mutex_unlock(&rec->lock);
 
-#ifdef SF_CLOSE_EACH_FILE
-	fclose(sfrec.fd);
-	sfrec.fd = NULL;
+	/* initialize the 3 extra samples at the end (those +6 bytes) */
+	data[sp->endsample/2] = data[sp->endsample/2 + 1] =
+	data[sp->endsample/2 + 2] = 0;
+#ifdef WORDS_BIGENDIAN
+	tmp = (sint16*)data;
+	for (j = 0; j < sp->endsample/2; j++) {
+		s = SWAPLE16(*tmp);
+		*tmp++ = s;
+	}
 #endif
+	*out = data;
+	return 0;
+}
+
+static void release_sample_data(MidDataRef *ref)
+{
+	SFSampleData *p = (SFSampleData *) ref, **pp;
+	int h = sample_data_hash(p->fname, p->startsample, p->endsample);
 
-	return inst;
+	timi_mutex_lock(&sample_lock);
+	for (pp = &sample_table[h]; *pp; pp = &(*pp)->next) {
+		if (*pp == p) {
+			*pp = p->next;
+			break;
+		}
+	}
+	timi_mutex_unlock(&sample_lock);
+	timi_free(p->data);
+	timi_free(p->fname);
+	timi_free(p);
 }
 
+/* with sample_lock held */
+static SFSampleData *find_sample_data(int h, int context, const char *fname,
+				      SampleList *sp)
+{
+	SFSampleData *p;
+	for (p = sample_table[h]; p; p = p->next) {
+		if (p->startsample == sp->startsample && p->endsample == sp->endsample &&
+		    p->context == context && !strcmp(p->fname, fname) &&
+		    hold_live_data_ref(&p->ref))
+			return p;
+	}
+	return NULL;
+}
 
-static MidInstrument *load_from_file(MidSong *song, SFInsts *rec, InstList *ip)
+/* give the sample the data of its wave, read from the file only if no
+   other sample has it already. returns -1 if out of memory; the data
+   is NULL if the font can't be read. */
+static int share_sample(SFInsts *rec, SampleList *sp, MidSample *sample)
+{
+	SFSampleData *p, *q;
+	sample_t *data;
+	int h = sample_data_hash(rec->fname, sp->startsample, sp->endsample);
+
+#ifndef SF_SUPPRESS_CUTOFF
+	if (sp->cutoff_freq > 0 && cutoff_allowed) /* will be filtered */
+		return read_sample(rec, sp, &sample->data);
+#endif
+	timi_mutex_lock(&sample_lock);
+	p = find_sample_data(h, rec->ctx->id, rec->fname, sp);
+	timi_mutex_unlock(&sample_lock);
+	if (!p) {
+		if (read_sample(rec, sp, &data) < 0)
+			return -1;
+		if (!data)
+			return 0;
+		p = (SFSampleData *) timi_malloc(sizeof(SFSampleData));
+		if (p && !(p->fname = timi_strdup(rec->fname))) {
+			timi_free(p);
+			p = NULL;
+		}
+		if (!p) {
+			timi_free(data);
+			return -1;
+		}
+		p->ref.refcount = 1;
+		p->ref.bytes = sp->endsample + 6;
+		p->ref.release = release_sample_data;
+		p->context = rec->ctx->id;
+		p->startsample = sp->startsample;
+		p->endsample = sp->endsample;
+		p->data = data;
+
+		timi_mutex_lock(&sample_lock);
+		/* another thread may have read it meanwhile */
+		if ((q = find_sample_data(h, p->context, p->fname, sp)) == NULL) {
+			p->next = sample_table[h];
+			sample_table[h] = p;
+		}
+		timi_mutex_unlock(&sample_lock);
+		if (q) {
+			timi_free(p->data);
+			timi_free(p->fname);
+			timi_free(p);
+			p = q;
+		}
+	}
+	sample->data = p->data;
+	sample->data_ref = &p->ref;
+	return 0;
+}
+
+static int load_from_file(MidSong *song, SFInsts *rec, InstList *ip, MidInstrument **out)
 {
 	SampleList *sp;
 	MidInstrument *inst;
+	const char *src;
 	int i;
 
+	*out = NULL;
 	DEBUG_MSG("Loading SF bank%d prg%d note%d\n", ip->bank, ip->preset, ip->keynote);
 
 	inst = (MidInstrument*)timi_malloc(sizeof(MidInstrument));
+	if (!inst)
+		return -1;
 	inst->type = INST_SF2;
+	inst->cache = NULL;
 	inst->samples = ip->samples;
 	inst->sample = (MidSample*) timi_calloc(ip->samples, sizeof(MidSample));
+	if (!inst->sample) {
+		timi_free(inst);
+		return -1;
+	}
 	for (i = 0, sp = ip->slist; i < ip->samples && sp; i++, sp = sp->next) {
 		MidSample *sample = inst->sample + i;
-#ifdef WORDS_BIGENDIAN
-		sint32 j;
-		sint16 *tmp, s;
-#endif
 		memcpy(sample, &sp->v, sizeof(MidSample));
-		sample->data = (sample_t*) timi_malloc(sp->endsample + 6);
-		fseek(rec->fd, sp->startsample, SEEK_SET);
-		fread(sample->data, sp->endsample, 1, rec->fd);
-		/* initialize the 3 extra samples at the end (those +6 bytes) */
-		sample->data[sp->endsample/2] = sample->data[sp->endsample/2 + 1] =
-		sample->data[sp->endsample/2 + 2] = 0;
-#ifdef WORDS_BIGENDIAN
-		tmp = (sint16*)sample->data;
-		for (j = 0; j < sp->endsample/2; j++) {
-			s = SWAPLE16(*tmp);
-			*tmp++ = s;
-		}
+		sample->data_ref = NULL;
+#ifdef SF_USE_MMAP
+		if ((sample->data = map_sample(rec, sp)) != NULL)
+			sample->data_ref = &rec->map->ref;
+		else
 #endif
+		if (share_sample(rec, sp, sample) < 0)
+			goto nomem;
+		if (!sample->data)
+			goto fail;
+		src = rec->fname; /* where the data is from, as is */
 
 		/* do some filtering if necessary */
 #ifndef SF_SUPPRESS_CUTOFF
@@ -324,16 +1134,27 @@ static MidInstrument *load_from_file(MidSong *song, SFInsts *rec, InstList *ip)
 			DEBUG_MSG("bank=%d, preset=%d, keynote=%d / cutoff = %d / resonance = %g\n",
 				ip->bank, ip->preset, ip->keynote, sp->cutoff_freq, sp->resonance);
 			do_lowpass(sample, sp->cutoff_freq, sp->resonance);
+			src = NULL;
 			/* convert again to the fractional value */
 			sample->data_length <<= FRACTION_BITS;
 		}
 #endif
 
 		/* resample it if possible */
-		if (sample->note_to_use && !(sample->modes & MODES_LOOPING))
-			pre_resample(song, sample);
+		if (sample->note_to_use && !(sample->modes & MODES_LOOPING)) {
+			if (pre_resample(song, sample, src, sp->startsample) < 0)
+				goto nomem;
+		}
 	}
-	return inst;
+	*out = inst;
+	return 0;
+
+nomem:
+	free_instrument(inst);
+	return -1;
+fail:
+	free_instrument(inst);
+	return 0;
 }
 
 
@@ -341,39 +1162,68 @@ static MidInstrument *load_from_file(MidSong *song, SFInsts *rec, InstList *ip)
  * excluded samples
  *----------------------------------------------------------------*/
 
-void exclude_soundfont(int bank, int preset, int keynote)
+static SFRules *get_rules(MidContext *ctx)
+{
+	if (!ctx->sfrules)
+		ctx->sfrules = (SFRules *) timi_calloc(1, sizeof(SFRules));
+	return ctx->sfrules;
+}
+
+int exclude_soundfont(MidContext *ctx, int bank, int preset, int keynote)
 {
+	SFRules *rules = get_rules(ctx);
 	SFExclude *rec;
+	int h;
+	if (preset < 0) preset = -1;
+	if (keynote < 0) keynote = -1;
+	if (!rules)
+		return -1;
 	rec = (SFExclude*)timi_malloc(sizeof(SFExclude));
+	if (!rec)
+		return -1;
 	rec->bank = bank;
 	rec->preset = preset;
 	rec->keynote = keynote;
-	rec->next = sfexclude;
-	sfexclude = rec;
+	h = RULE_HASH(bank, preset, keynote);
+	rec->next = rules->exclude[h];
+	rules->exclude[h] = rec;
+	return 0;
 }
 
-/* check the instrument is specified to be excluded */
-static int is_excluded(int bank, int preset, int keynote)
+static SFExclude *find_exclude(SFRules *rules, int bank, int preset, int keynote)
 {
 	SFExclude *p;
-	for (p = sfexclude; p; p = p->next) {
-		if (p->bank == bank &&
-		    (p->preset < 0 || p->preset == preset) &&
-		    (p->keynote < 0 || p->keynote == keynote))
-			return 1;
+	for (p = rules->exclude[RULE_HASH(bank, preset, keynote)]; p; p = p->next) {
+		if (p->bank == bank && p->preset == preset && p->keynote == keynote)
+			return p;
 	}
-	return 0;
+	return NULL;
+}
+
+/* check the instrument is specified to be excluded: look for the
+   rules that can match it, instead of going through all of them */
+static int is_excluded(SFRules *rules, int bank, int preset, int keynote)
+{
+	if (!rules)
+		return 0;
+	return (find_exclude(rules, bank, preset, keynote) ||
+		find_exclude(rules, bank, -1, keynote) ||
+		find_exclude(rules, bank, preset, -1) ||
+		find_exclude(rules, bank, -1, -1));
 }
 
 /* free exclude list */
-static void free_exclude(void)
+static void free_exclude(SFRules *rules)
 {
 	SFExclude *p, *next;
-	for (p = sfexclude; p; p = next) {
-		next = p->next;
-		timi_free(p);
+	int i;
+	for (i = 0; i < SF_RULE_HASH; i++) {
+		for (p = rules->exclude[i]; p; p = next) {
+			next = p->next;
+			timi_free(p);
+		}
+		rules->exclude[i] = NULL;
 	}
-	sfexclude = NULL;
 }
 
 
@@ -381,40 +1231,67 @@ static void free_exclude(void)
  * ordered samples
  *----------------------------------------------------------------*/
 
-void order_soundfont(int bank, int preset, int keynote, int order)
+int order_soundfont(MidContext *ctx, int bank, int preset, int keynote, int order)
 {
+	SFRules *rules = get_rules(ctx);
 	SFOrder *rec;
+	int h;
+	if (preset < 0) preset = -1;
+	if (keynote < 0) keynote = -1;
+	if (!rules)
+		return -1;
 	rec = (SFOrder*)timi_malloc(sizeof(SFOrder));
+	if (!rec)
+		return -1;
 	rec->bank = bank;
 	rec->preset = preset;
 	rec->keynote = keynote;
 	rec->order = order;
-	rec->next = sforder;
-	sforder = rec;
+	rec->seq = rules->order_seq++;
+	h = RULE_HASH(bank, preset, keynote);
+	rec->next = rules->order[h];
+	rules->order[h] = rec;
+	return 0;
 }
 
-/* check the instrument is specified to be ordered */
-static int is_ordered(int bank, int preset, int keynote)
+static void find_order(SFRules *rules, int bank, int preset, int keynote, SFOrder **last)
 {
 	SFOrder *p;
-	for (p = sforder; p; p = p->next) {
-		if (p->bank == bank &&
-		    (p->preset < 0 || p->preset == preset) &&
-		    (p->keynote < 0 || p->keynote == keynote))
-			return p->order;
+	for (p = rules->order[RULE_HASH(bank, preset, keynote)]; p; p = p->next) {
+		if (p->bank == bank && p->preset == preset && p->keynote == keynote) {
+			if (!*last || p->seq > (*last)->seq)
+				*last = p;
+			return;
+		}
 	}
-	return -1;
+}
+
+/* check the instrument is specified to be ordered */
+static int is_ordered(SFRules *rules, int bank, int preset, int keynote)
+{
+	SFOrder *p = NULL;
+	if (!rules)
+		return -1;
+	find_order(rules, bank, preset, keynote, &p);
+	find_order(rules, bank, -1, keynote, &p);
+	find_order(rules, bank, preset, -1, &p);
+	find_order(rules, bank, -1, -1, &p);
+	return (p) ? p->order : -1;
 }
 
 /* free order list */
-static void free_order(void)
+static void free_order(SFRules *rules)
 {
 	SFOrder *p, *next;
-	for (p = sforder; p; p = next) {
-		next = p->next;
-		timi_free(p);
+	int i;
+	for (i = 0; i < SF_RULE_HASH; i++) {
+		for (p = rules->order[i]; p; p = next) {
+			next = p->next;
+			timi_free(p);
+		}
+		rules->order[i] = NULL;
 	}
-	sforder = NULL;
+	rules->order_seq = 0;
 }
 
 
@@ -576,9 +1453,9 @@ static void make_inst(MidSong *song, SFInsts *rec, Layer *lay, SFInfo *sf, int p
 		keynote = -1;
 		namep = &song->tonebank[bank]->tone[preset].name;
 	}
-	if (is_excluded(bank, preset, keynote))
+	if (is_excluded(song->ctx->sfrules, bank, preset, keynote))
 		return;
-	if ((n_order = is_ordered(bank, preset, keynote)) >= 0)
+	if ((n_order = is_ordered(song->ctx->sfrules, bank, preset, keynote)) >= 0)
 		order = n_order;
 
 	if (*namep == NULL) {
@@ -588,25 +1465,24 @@ static void make_inst(MidSong *song, SFInsts *rec, Layer *lay, SFInfo *sf, int p
 	}
 
 	/* search current instrument list */
-	for (ip = rec->instlist; ip; ip = ip->next) {
-		if (ip->bank == bank && ip->preset == preset &&
-		    (keynote < 0 || keynote == ip->keynote))
-			break;
-	}
+	ip = find_inst(rec, bank, preset, keynote);
 	if (ip == NULL) {
 		ip = (InstList*)timi_malloc(sizeof(InstList));
 		ip->bank = bank;
 		ip->preset = preset;
 		ip->keynote = keynote;
 		ip->order = order;
+		memcpy(ip->name, sf->insthdr[in_idx].name, 20);
+		ip->name[20] = 0;
 		ip->samples = 0;
 		ip->slist = NULL;
 		ip->next = rec->instlist;
 		rec->instlist = ip;
+		add_inst(rec, ip);
 	}
 
 	/* add a sample */
-	sp = (SampleList*)timi_malloc(sizeof(SampleList));
+	sp = (SampleList*)timi_calloc(1, sizeof(SampleList));
 	sp->next = ip->slist;
 	ip->slist = sp;
 	ip->samples++;
@@ -814,15 +1690,20 @@ static sint32 to_offset(int offset)
 static sint32 calc_rate(MidSong *song, int diff, int time)
 {
 	sint32 rate;
+	double r;
 
 	if (time < 6) time = 6;
 	if (diff == 0) diff = 255;
 	diff <<= (7+15);
-	rate = (diff / song->rate) * song->control_ratio;
-	rate = rate * 1000 / time;
+	rate = diff / song->rate;
+	/* in double: this overflows with the longer control ratios */
+	r = floor((double)rate * song->control_ratio * 1000 / time);
 #ifdef FAST_DECAY
-	rate *= 2;
+	r *= 2;
 #endif
+	if (r >= MAX_ENVELOPE_RATE)
+		return MAX_ENVELOPE_RATE;
+	rate = (sint32)r;
 
 	return rate;
 }
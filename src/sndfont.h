@@ -32,15 +32,18 @@
 #define TIMIDITY_SNDFONT_H
 
 #define init_soundfont    TIMI_NAMESPACE(init_soundfont)
+#define free_soundfont    TIMI_NAMESPACE(free_soundfont)
 #define end_soundfont     TIMI_NAMESPACE(end_soundfont)
 #define load_soundfont    TIMI_NAMESPACE(load_soundfont)
 #define exclude_soundfont TIMI_NAMESPACE(exclude_soundfont)
 #define order_soundfont   TIMI_NAMESPACE(order_soundfont)
 
-void init_soundfont(MidSong *song, const char *fname, int order);
-void end_soundfont(void);
-MidInstrument *load_soundfont(MidSong *song, int order, int bank, int preset, int keynote);
-void exclude_soundfont(int bank, int preset, int keynote);
-void order_soundfont(int bank, int preset, int keynote, int order);
+void init_soundfont(MidSong *song, const char *fname, int order, const char *cache_dir);
+void free_soundfont(MidSong *song);
+void end_soundfont(MidContext *ctx);
+/* returns -1 if out of memory, *out is NULL if there's no such preset */
+int load_soundfont(MidSong *song, int order, int bank, int preset, int keynote, MidInstrument **out);
+int exclude_soundfont(MidContext *ctx, int bank, int preset, int keynote);
+int order_soundfont(MidContext *ctx, int bank, int preset, int keynote, int order);
 
 #endif /* TIMIDITY_SNDFONT_H */
@@ -220,93 +220,53 @@ const double bend_coarse[128] = {
  1290.1591550923506, 1366.8760106701147, 1448.1546878700494, 1534.2664467217226
 };
 
-#ifdef LOOKUP_SINE
-static const float sine_table[257]=
+/* a quarter of a sine wave, scaled to 32768 */
+static const sint32 lfo_sine_table[257]=
 {
- 0, 0.0061358846491544753, 0.012271538285719925, 0.01840672990580482,
- 0.024541228522912288, 0.030674803176636626, 0.036807222941358832, 0.04293825693494082,
- 0.049067674327418015, 0.055195244349689934, 0.061320736302208578, 0.067443919563664051,
- 0.073564563599667426, 0.079682437971430126, 0.085797312344439894, 0.091908956497132724,
- 0.098017140329560604, 0.10412163387205459, 0.11022220729388306, 0.11631863091190475,
- 0.1224106751992162, 0.12849811079379317, 0.13458070850712617, 0.14065823933284921,
- 0.14673047445536175, 0.15279718525844344, 0.15885814333386145, 0.16491312048996989,
- 0.17096188876030122, 0.17700422041214875, 0.18303988795514095, 0.18906866414980619,
- 0.19509032201612825, 0.2011046348420919, 0.20711137619221856, 0.21311031991609136,
- 0.2191012401568698, 0.22508391135979283, 0.23105810828067111, 0.2370236059943672,
- 0.24298017990326387, 0.24892760574572015, 0.25486565960451457, 0.26079411791527551,
- 0.26671275747489837, 0.27262135544994898, 0.27851968938505306, 0.28440753721127188,
- 0.29028467725446233, 0.29615088824362379, 0.30200594931922808, 0.30784964004153487,
- 0.31368174039889152, 0.31950203081601569, 0.32531029216226293, 0.33110630575987643,
- 0.33688985339222005, 0.34266071731199438, 0.34841868024943456, 0.35416352542049034,
- 0.35989503653498811, 0.36561299780477385, 0.37131719395183754, 0.37700741021641826,
- 0.38268343236508978, 0.38834504669882625, 0.3939920400610481, 0.39962419984564679,
- 0.40524131400498986, 0.41084317105790391, 0.41642956009763715, 0.42200027079979968,
- 0.42755509343028208, 0.43309381885315196, 0.43861623853852766, 0.4441221445704292,
- 0.44961132965460654, 0.45508358712634384, 0.46053871095824001, 0.46597649576796618,
- 0.47139673682599764, 0.47679923006332209, 0.48218377207912272, 0.487550160148436,
- 0.49289819222978404, 0.49822766697278187, 0.50353838372571758, 0.50883014254310699,
- 0.51410274419322166, 0.51935599016558964, 0.52458968267846895, 0.52980362468629461,
- 0.53499761988709715, 0.54017147272989285, 0.54532498842204646, 0.55045797293660481,
- 0.55557023301960218, 0.56066157619733603, 0.56573181078361312, 0.57078074588696726,
- 0.57580819141784534, 0.58081395809576453, 0.58579785745643886, 0.59075970185887416,
- 0.59569930449243336, 0.60061647938386897, 0.60551104140432555, 0.61038280627630948,
- 0.61523159058062682, 0.6200572117632891, 0.62485948814238634, 0.62963823891492698,
- 0.63439328416364549, 0.63912444486377573, 0.64383154288979139, 0.64851440102211244,
- 0.65317284295377676, 0.65780669329707864, 0.66241577759017178, 0.66699992230363747,
- 0.67155895484701833, 0.67609270357531592, 0.68060099779545302, 0.68508366777270036,
- 0.68954054473706683, 0.693971460889654, 0.69837624940897292, 0.7027547444572253,
- 0.70710678118654746, 0.71143219574521643, 0.71573082528381859, 0.72000250796138165,
- 0.72424708295146689, 0.7284643904482252, 0.73265427167241282, 0.73681656887736979,
- 0.74095112535495911, 0.74505778544146595, 0.74913639452345926, 0.75318679904361241,
- 0.75720884650648446, 0.76120238548426178, 0.76516726562245896, 0.76910333764557959,
- 0.77301045336273699, 0.77688846567323244, 0.78073722857209438, 0.78455659715557524,
- 0.78834642762660623, 0.79210657730021239, 0.79583690460888346, 0.79953726910790501,
- 0.80320753148064483, 0.80684755354379922, 0.81045719825259477, 0.8140363297059483,
- 0.81758481315158371, 0.82110251499110465, 0.82458930278502529, 0.8280450452577558,
- 0.83146961230254524, 0.83486287498638001, 0.83822470555483797, 0.84155497743689833,
- 0.84485356524970701, 0.84812034480329712, 0.8513551931052652, 0.85455798836540053,
- 0.85772861000027212, 0.86086693863776731, 0.8639728561215867, 0.86704624551569265,
- 0.87008699110871135, 0.87309497841829009, 0.8760700941954066, 0.87901222642863341,
- 0.88192126434835494, 0.88479709843093779, 0.88763962040285393, 0.89044872324475788,
- 0.89322430119551532, 0.89596624975618511, 0.89867446569395382, 0.90134884704602203,
- 0.90398929312344334, 0.90659570451491533, 0.90916798309052227, 0.91170603200542988,
- 0.91420975570353069, 0.9166790599210427, 0.91911385169005777, 0.9215140393420419,
- 0.92387953251128674, 0.92621024213831127, 0.92850608047321548, 0.93076696107898371,
- 0.93299279883473885, 0.9351835099389475, 0.93733901191257496, 0.93945922360218992,
- 0.94154406518302081, 0.94359345816196039, 0.94560732538052128, 0.94758559101774109,
- 0.94952818059303667, 0.95143502096900834, 0.95330604035419375, 0.95514116830577067,
- 0.95694033573220894, 0.9587034748958716, 0.96043051941556579, 0.96212140426904158,
- 0.96377606579543984, 0.9653944416976894, 0.96697647104485207, 0.96852209427441727,
- 0.97003125319454397, 0.97150389098625178, 0.97293995220556007, 0.97433938278557586,
- 0.97570213003852857, 0.97702814265775439, 0.97831737071962765, 0.97956976568544052,
- 0.98078528040323043, 0.98196386910955524, 0.98310548743121629, 0.98421009238692903,
- 0.98527764238894122, 0.98630809724459867, 0.98730141815785843, 0.98825756773074946,
- 0.98917650996478101, 0.99005821026229712, 0.99090263542778001, 0.99170975366909953,
- 0.99247953459870997, 0.9932119492347945, 0.99390697000235606, 0.99456457073425542,
- 0.99518472667219682, 0.99576741446765982, 0.996312612182778, 0.99682029929116567,
- 0.99729045667869021, 0.99772306664419164, 0.99811811290014918, 0.99847558057329477,
- 0.99879545620517241, 0.99907772775264536, 0.99932238458834954, 0.99952941750109314,
- 0.99969881869620425, 0.9998305817958234, 0.9999247018391445, 0.99998117528260111,
- 1
+ 0, 201, 402, 603, 804, 1005, 1206, 1407, 1608, 1809,
+ 2009, 2210, 2411, 2611, 2811, 3012, 3212, 3412, 3612, 3812,
+ 4011, 4211, 4410, 4609, 4808, 5007, 5205, 5404, 5602, 5800,
+ 5998, 6195, 6393, 6590, 6787, 6983, 7180, 7376, 7571, 7767,
+ 7962, 8157, 8351, 8546, 8740, 8933, 9127, 9319, 9512, 9704,
+ 9896, 10088, 10279, 10469, 10660, 10850, 11039, 11228, 11417, 11605,
+ 11793, 11980, 12167, 12354, 12540, 12725, 12910, 13095, 13279, 13463,
+ 13646, 13828, 14010, 14192, 14373, 14553, 14733, 14912, 15091, 15269,
+ 15447, 15624, 15800, 15976, 16151, 16326, 16500, 16673, 16846, 17018,
+ 17190, 17361, 17531, 17700, 17869, 18037, 18205, 18372, 18538, 18703,
+ 18868, 19032, 19195, 19358, 19520, 19681, 19841, 20001, 20160, 20318,
+ 20475, 20632, 20788, 20943, 21097, 21251, 21403, 21555, 21706, 21856,
+ 22006, 22154, 22302, 22449, 22595, 22740, 22884, 23028, 23170, 23312,
+ 23453, 23593, 23732, 23870, 24008, 24144, 24279, 24414, 24548, 24680,
+ 24812, 24943, 25073, 25202, 25330, 25457, 25583, 25708, 25833, 25956,
+ 26078, 26199, 26320, 26439, 26557, 26674, 26791, 26906, 27020, 27133,
+ 27246, 27357, 27467, 27576, 27684, 27791, 27897, 28002, 28106, 28209,
+ 28311, 28411, 28511, 28610, 28707, 28803, 28899, 28993, 29086, 29178,
+ 29269, 29359, 29448, 29535, 29622, 29707, 29792, 29875, 29957, 30038,
+ 30118, 30196, 30274, 30350, 30425, 30499, 30572, 30644, 30715, 30784,
+ 30853, 30920, 30986, 31050, 31114, 31177, 31238, 31298, 31357, 31415,
+ 31471, 31527, 31581, 31634, 31686, 31737, 31786, 31834, 31881, 31927,
+ 31972, 32015, 32058, 32099, 32138, 32177, 32214, 32251, 32286, 32319,
+ 32352, 32383, 32413, 32442, 32470, 32496, 32522, 32546, 32568, 32590,
+ 32610, 32629, 32647, 32664, 32679, 32693, 32706, 32718, 32729, 32738,
+ 32746, 32753, 32758, 32762, 32766, 32767, 32768
 };
 
 /*
-   looks up sin(2 * Pi * x / 1024)
+   looks up 32768 * sin(2 * Pi * x / 1024)
 */
-float _timi_sine(int x)
+sint32 lfo_sine(int x)
 {
   int xx = x & 0xFF;
   switch ((x>>8) & 0x03)
     {
     default: /* just to shut gcc up. */
     case 0:
-      return sine_table[xx];
+      return lfo_sine_table[xx];
     case 1:
-      return sine_table[0x100 - xx];
+      return lfo_sine_table[0x100 - xx];
     case 2:
-      return -sine_table[xx];
+      return -lfo_sine_table[xx];
     case 3:
-      return -sine_table[0x100 - xx];
+      return -lfo_sine_table[0x100 - xx];
     }
 }
-#endif /* LOOKUP_SINE */
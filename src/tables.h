@@ -31,24 +31,21 @@
 #ifndef TIMIDITY_TABLES_H
 #define TIMIDITY_TABLES_H
 
-#ifdef LOOKUP_SINE
-extern float _timi_sine(int);
-#define timi_sine _timi_sine
-#else
-#include <math.h>
-#define timi_sine(x) (sin((2*M_PI/1024.0) * (x)))
-#endif
-
 #define SINE_CYCLE_LENGTH 1024
 
 #define freq_table TIMI_NAMESPACE(freq_table)
 #define vol_table TIMI_NAMESPACE(vol_table)
 #define bend_fine TIMI_NAMESPACE(bend_fine)
 #define bend_coarse TIMI_NAMESPACE(bend_coarse)
+#define lfo_sine TIMI_NAMESPACE(lfo_sine)
 
 extern const sint32 freq_table[];
 extern const double vol_table[];
 extern const double bend_fine[];
 extern const double bend_coarse[];
 
+/* 32768 * sin(2 * Pi * x / SINE_CYCLE_LENGTH), for the tremolo and
+   vibrato */
+extern sint32 lfo_sine(int x);
+
 #endif /* TIMIDITY_TABLES_H */
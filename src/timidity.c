@@ -36,6 +36,7 @@
 #include <sys/param.h>
 #endif
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +45,8 @@
 #include "common.h"
 #include "instrum.h"
 #include "sndfont.h"
+#include "resample.h"
+#include "mix.h"
 #include "playmidi.h"
 #include "readmidi.h"
 #include "output.h"
@@ -51,9 +54,14 @@
 
 #include "ospaths.h"
 
-static MidToneBank *master_tonebank[128], *master_drumset[128];
+/* the configuration mid_init() reads, used by mid_song_load(): made
+   when first needed, and held by the library like by the songs loaded
+   with it, so that mid_exit() leaves it to them if any are left */
+static MidContext *default_context = NULL;
 
-static char def_instr_name[256] = "";
+static int context_serial = 0;	/* the last context id given */
+static int context_count = 0;	/* the contexts not freed yet */
+static timi_mutex context_lock = TIMI_MUTEX_INITIALIZER;
 
 #define MAXWORDS 10
 #define MAX_RCFCOUNT 50
@@ -88,10 +96,14 @@ static char *timi_fgets(char *s, int size, FILE *fp)
     return (num_read != 0)? s : NULL;
 }
 
-static char *sf_file = NULL;
-static int sf_order = 0;
+/* settings for every song loaded: only touched under context_lock, and
+   taken by each load as it starts, since loads may run on any thread */
+static char *sf_cache_dir = NULL;
 
-static int read_config_file(const char *name, int rcf_count)
+static int loader_threads = 1;
+static int preload_msec = -1;
+
+static int read_config_file(MidContext *ctx, const char *name, int rcf_count)
 {
   FILE *fp;
   char  tmp[TIM_MAXPATH];
@@ -105,7 +117,7 @@ static int read_config_file(const char *name, int rcf_count)
     return -1;
   }
 
-  if (!(fp=timi_openfile(name)))
+  if (!(fp=timi_openfile(ctx, name)))
     return -1;
 
   bank = NULL;
@@ -250,7 +262,7 @@ static int read_config_file(const char *name, int rcf_count)
 	goto fail;
       }
       for (i=1; i<words; i++) {
-	if (timi_add_pathlist(w[i], strlen(w[i])) < 0)
+	if (timi_add_pathlist(ctx, w[i], strlen(w[i])) < 0)
 	  goto fail;
       }
     }
@@ -261,7 +273,7 @@ static int read_config_file(const char *name, int rcf_count)
 	goto fail;
       }
       for (i=1; i<words; i++) {
-	r = read_config_file(w[i], rcf_count + 1);
+	r = read_config_file(ctx, w[i], rcf_count + 1);
 	if (r != 0)
 	  goto fail;
       }
@@ -273,7 +285,7 @@ static int read_config_file(const char *name, int rcf_count)
 	DEBUG_MSG("%s: line %d: Must specify exactly one patch name\n", name, line);
 	goto fail;
       }
-      timi_strxcpy(def_instr_name, w[1], 256);
+      timi_strxcpy(ctx->def_instr_name, w[1], 256);
     }
     else if (!strcmp(w[0], "drumset"))
     {
@@ -286,13 +298,13 @@ static int read_config_file(const char *name, int rcf_count)
 	DEBUG_MSG("%s: line %d: Drum set must be between 0 and 127\n", name, line);
 	goto fail;
       }
-      if (!master_drumset[i]) {
-	master_drumset[i] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
-	if (!master_drumset[i]) goto fail;
-	master_drumset[i]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
-	if (!master_drumset[i]->tone) goto fail;
+      if (!ctx->master_drumset[i]) {
+	ctx->master_drumset[i] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
+	if (!ctx->master_drumset[i]) goto fail;
+	ctx->master_drumset[i]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
+	if (!ctx->master_drumset[i]->tone) goto fail;
       }
-      bank=master_drumset[i];
+      bank=ctx->master_drumset[i];
     }
     else if (!strcmp(w[0], "bank"))
     {
@@ -305,13 +317,13 @@ static int read_config_file(const char *name, int rcf_count)
 	DEBUG_MSG("%s: line %d: Tone bank must be between 0 and 127\n", name, line);
 	goto fail;
       }
-      if (!master_tonebank[i]) {
-	master_tonebank[i] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
-	if (!master_tonebank[i]) goto fail;
-	master_tonebank[i]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
-	if (!master_tonebank[i]->tone) goto fail;
+      if (!ctx->master_tonebank[i]) {
+	ctx->master_tonebank[i] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
+	if (!ctx->master_tonebank[i]) goto fail;
+	ctx->master_tonebank[i]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
+	if (!ctx->master_tonebank[i]->tone) goto fail;
       }
-      bank=master_tonebank[i];
+      bank=ctx->master_tonebank[i];
     }
     else if (!strcmp(w[0], "soundfont"))
     {
@@ -319,12 +331,12 @@ static int read_config_file(const char *name, int rcf_count)
 	DEBUG_MSG("%s: line %d: No soundfont file given\n", name, line);
 	goto fail;
       }
-      if (sf_file) {
+      if (ctx->sf_file) {
 	DEBUG_MSG("%s: line %d: Ignoring multiple \"soundfont\" directives.\n", name, line);
       }
      else {
-      sf_file=timi_strdup(w[1]);
-      if (!sf_file) goto fail;
+      ctx->sf_file=timi_strdup(w[1]);
+      if (!ctx->sf_file) goto fail;
       for (j = 2; j < words; j++) {
 	if (!(cp = strchr(w[j], '='))) {
 	  DEBUG_MSG("%s: line %d: bad patch option %s\n", name, line, w[j]);
@@ -337,7 +349,7 @@ static int read_config_file(const char *name, int rcf_count)
 	    DEBUG_MSG("%s: line %d: order must be a digit", name, line);
 	    goto fail;
 	  }
-	  sf_order = k;
+	  ctx->sf_order = k;
 	}
       }
      }
@@ -357,7 +369,8 @@ static int read_config_file(const char *name, int rcf_count)
 	bank = atoi(w[2]);
 	preset = (words >= 4)? atoi(w[3]) : -1;
 	keynote = (words >= 5)? atoi(w[4]) : -1;
-	exclude_soundfont(bank, preset, keynote);
+	if (exclude_soundfont(ctx, bank, preset, keynote) < 0)
+	  goto fail;
       } else if (!strcmp(w[1], "order")) {
 	int order;
 	if (words < 4) {
@@ -368,7 +381,8 @@ static int read_config_file(const char *name, int rcf_count)
 	bank = atoi(w[3]);
 	preset = (words >= 5)? atoi(w[4]) : -1;
 	keynote = (words >= 6)? atoi(w[5]) : -1;
-	order_soundfont(bank, preset, keynote, order);
+	if (order_soundfont(ctx, bank, preset, keynote, order) < 0)
+	  goto fail;
       }
     }
     else
@@ -467,87 +481,299 @@ fail:
   return r;
 }
 
-static int init_alloc_banks (void)
+static void end_context(MidContext *ctx)
+{
+  int i, j;
+
+  for (i = 0; i < 128; i++) {
+    if (ctx->master_tonebank[i]) {
+      MidToneBankElement *e = ctx->master_tonebank[i]->tone;
+      if (e != NULL) {
+	for (j = 0; j < 128; j++) {
+	  timi_free(e[j].name);
+	}
+	timi_free(e);
+      }
+      timi_free(ctx->master_tonebank[i]);
+      ctx->master_tonebank[i] = NULL;
+    }
+    if (ctx->master_drumset[i]) {
+      MidToneBankElement *e = ctx->master_drumset[i]->tone;
+      if (e != NULL) {
+	for (j = 0; j < 128; j++) {
+	  timi_free(e[j].name);
+	}
+	timi_free(e);
+      }
+      timi_free(ctx->master_drumset[i]);
+      ctx->master_drumset[i] = NULL;
+    }
+  }
+
+  end_soundfont(ctx);
+  timi_free(ctx->sf_file);
+  ctx->sf_file = NULL;
+  ctx->sf_order = 0;
+  *ctx->def_instr_name = '\0';
+
+  timi_free_pathlist(ctx);
+}
+
+/* Songs keep the context they were loaded with: it is freed when its
+   last user is gone. */
+static MidContext *hold_context(MidContext *ctx)
+{
+  timi_mutex_lock(&context_lock);
+  ctx->refcount++;
+  timi_mutex_unlock(&context_lock);
+  return ctx;
+}
+
+/* Returns a new reference to the default context, or NULL */
+static MidContext *hold_default_context(void)
+{
+  MidContext *ctx;
+
+  timi_mutex_lock(&context_lock);
+  if (!default_context) {
+    default_context = (MidContext *) timi_calloc(1, sizeof(MidContext));
+    if (default_context) {
+      default_context->refcount = 1;
+      context_count++;
+    }
+  }
+  ctx = default_context;
+  if (ctx)
+    ctx->refcount++;
+  timi_mutex_unlock(&context_lock);
+  return ctx;
+}
+
+static void drop_context(MidContext *ctx)
+{
+  int last;
+
+  if (!ctx)
+    return;
+  timi_mutex_lock(&context_lock);
+  last = (--ctx->refcount == 0);
+  if (last)
+    context_count--;
+  timi_mutex_unlock(&context_lock);
+  if (last) {
+    end_context(ctx);
+    timi_free(ctx);
+  }
+}
+
+static int init_alloc_banks (MidContext *ctx)
 {
   /* Allocate memory for the standard tonebank and drumset */
-  master_tonebank[0] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
-  if (!master_tonebank[0]) goto _nomem;
-  master_tonebank[0]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
-  if (!master_tonebank[0]->tone) goto _nomem;
+  ctx->master_tonebank[0] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
+  if (!ctx->master_tonebank[0]) goto _nomem;
+  ctx->master_tonebank[0]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
+  if (!ctx->master_tonebank[0]->tone) goto _nomem;
 
-  master_drumset[0] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
-  if (!master_drumset[0]) goto _nomem;
-  master_drumset[0]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
-  if (!master_drumset[0]->tone) goto _nomem;
+  ctx->master_drumset[0] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
+  if (!ctx->master_drumset[0]) goto _nomem;
+  ctx->master_drumset[0]->tone = (MidToneBankElement *) timi_calloc(128, sizeof(MidToneBankElement));
+  if (!ctx->master_drumset[0]->tone) goto _nomem;
 
   return 0;
 _nomem:
   DEBUG_MSG("Out of memory\n");
-  mid_exit ();
+  end_context(ctx);
   return -2;
 }
 
-static int init_begin_config(const char *cf)
+static int init_begin_config(MidContext *ctx, const char *cf)
 {
   const char *p = get_last_dirsep(cf);
   if (p != NULL)
-      return timi_add_pathlist(cf, p - cf + 1); /* including DIRSEP */
+      return timi_add_pathlist(ctx, cf, p - cf + 1); /* including DIRSEP */
   return 0;
 }
 
-static int init_with_config(const char *cf)
+static int init_with_config(MidContext *ctx, const char *cf)
 {
-  int rc = init_begin_config(cf);
+  int rc = init_begin_config(ctx, cf);
   if (rc != 0) {
-      mid_exit ();
+      end_context(ctx);
       return rc;
   }
-  rc = read_config_file(cf, 0);
+  rc = read_config_file(ctx, cf, 0);
   if (rc != 0) {
-      mid_exit ();
+      end_context(ctx);
   }
   return rc;
 }
 
-int mid_init_no_config(void)
+static int init_no_config(MidContext *ctx)
 {
-  master_tonebank[0] = NULL;
-  master_drumset[0] = NULL;
-  return init_alloc_banks();
+  /* a new id: nothing cached for an older configuration is used */
+  timi_mutex_lock(&context_lock);
+  ctx->id = ++context_serial;
+  timi_mutex_unlock(&context_lock);
+
+  ctx->master_tonebank[0] = NULL;
+  ctx->master_drumset[0] = NULL;
+  return init_alloc_banks(ctx);
 }
 
-int mid_init(const char *config_file)
+static int init_context(MidContext *ctx, const char *config_file)
 {
-  int rc = mid_init_no_config();
+  int rc = init_no_config(ctx);
   if (rc != 0) {
       return rc;
   }
-  if (sf_file) {
+  if (ctx->sf_file) {
       /* a soundfont specified by mid_set_soundfont().
        * skip config parsing. */
       return 0;
   }
   if (config_file == NULL || *config_file == '\0') {
-      return init_with_config(TIMIDITY_CFG);
+      return init_with_config(ctx, TIMIDITY_CFG);
+  }
+  return init_with_config(ctx, config_file);
+}
+
+int mid_init_no_config(void)
+{
+  MidContext *ctx = hold_default_context();
+  int rc;
+  if (!ctx) return -2;
+  rc = init_no_config(ctx);
+  drop_context(ctx);
+  return rc;
+}
+
+int mid_init(const char *config_file)
+{
+  MidContext *ctx = hold_default_context();
+  int rc;
+  if (!ctx) return -2;
+  rc = init_context(ctx, config_file);
+  drop_context(ctx);
+  return rc;
+}
+
+static MidContext *create_context(const char *config_file, const char *sf2_file)
+{
+  MidContext *ctx = (MidContext *) timi_calloc(1, sizeof(MidContext));
+  if (!ctx) return NULL;
+  if (sf2_file) {
+      ctx->sf_file = timi_strdup(sf2_file);
+      if (!ctx->sf_file) {
+	  timi_free(ctx);
+	  return NULL;
+      }
   }
-  return init_with_config(config_file);
+  if (init_context(ctx, config_file) != 0) {
+      timi_free(ctx);
+      return NULL;
+  }
+  ctx->refcount = 1;
+  timi_mutex_lock(&context_lock);
+  context_count++;
+  timi_mutex_unlock(&context_lock);
+  return ctx;
+}
+
+MidContext *mid_context_create(const char *config_file)
+{
+  return create_context(config_file, NULL);
+}
+
+MidContext *mid_context_create_soundfont(const char *sf2_file)
+{
+  if (!sf2_file) return NULL;
+  return create_context(NULL, sf2_file);
+}
+
+void mid_context_free(MidContext *ctx)
+{
+  drop_context(ctx);
 }
 
 int mid_set_soundfont(const char *file)
 {
+  MidContext *ctx;
   if (file) {
       char *fname = timi_strdup(file);
       if (!fname) return -1;
-      timi_free(sf_file);
-      sf_file = fname;
+      if (!(ctx = hold_default_context())) {
+	  timi_free(fname);
+	  return -1;
+      }
+      timi_free(ctx->sf_file);
+      ctx->sf_file = fname;
+      drop_context(ctx);
+  }
+  return 0;
+}
+
+int mid_set_soundfont_cache(const char *dir)
+{
+  char *d = NULL;
+  if (dir) {
+      d = timi_strdup(dir);
+      if (!d) return -1;
   }
+  timi_mutex_lock(&context_lock);
+  timi_free(sf_cache_dir);
+  sf_cache_dir = d;
+  timi_mutex_unlock(&context_lock);
+  return 0;
+}
+
+int mid_set_loader_threads(int threads)
+{
+#ifdef TIMIDITY_THREADS
+  timi_mutex_lock(&context_lock);
+  loader_threads = (threads < 1) ? 1 : threads;
+  timi_mutex_unlock(&context_lock);
+  return 0;
+#else
+  TIMI_UNUSED(threads);
+  return -1;
+#endif
+}
+
+int mid_set_preload_time(int msec)
+{
+#ifdef TIMIDITY_THREADS
+  timi_mutex_lock(&context_lock);
+  preload_msec = (msec < 0) ? -1 : msec;
+  timi_mutex_unlock(&context_lock);
   return 0;
+#else
+  TIMI_UNUSED(msec);
+  return -1;
+#endif
+}
+
+void mid_song_options_init(MidSongOptions *options)
+{
+  options->interpolation = MID_INTERP_LINEAR;
+  options->sinc_taps = 8;
+  options->control_rate = CONTROLS_PER_SECOND;
+  options->ramp_amplitude = 0;
+  options->voices = DEFAULT_VOICES;
+  options->reserve_voices = DEFAULT_RESERVE_VOICES;
+  options->cull_threshold = 0;
+  options->mix_threads = 1;
 }
 
-static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **out)
+/* ex: the options go on past the ones of mid_song_load() */
+static void do_song_load(MidContext *ctx, MidIStream *stream, MidSongOptions *options, int ex, MidSong **out)
 {
   MidSong *song;
-  int i;
+  sint32 preload;
+  int i, interpolation = MID_INTERP_LINEAR, taps = 0;
+  sint32 control_rate = CONTROLS_PER_SECOND, voices = DEFAULT_VOICES;
+  sint32 reserve = DEFAULT_RESERVE_VOICES, cull = 0, mix_threads = 1;
+  char *cache_dir;
+  int threads, preload_ms, oom;
 
   *out = NULL;
   if (!stream) return;
@@ -566,32 +792,81 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   case MID_AUDIO_S16LSB:
   case MID_AUDIO_S16MSB:
   case MID_AUDIO_U16LSB:
-  case MID_AUDIO_U16MSB: break; /* supported */
+  case MID_AUDIO_U16MSB:
+  case MID_AUDIO_F32:
+  case MID_AUDIO_F32P: break; /* supported */
   default:
     DEBUG_MSG("Bad audio format 0x%x\n", options->format);
     return;
   }
+  if (ex) {
+    interpolation = options->interpolation;
+    taps = options->sinc_taps;
+    if (interpolation < MID_INTERP_NONE || interpolation > MID_INTERP_SINC) {
+      DEBUG_MSG("Bad interpolation %d\n", interpolation);
+      return;
+    }
+    if (interpolation == MID_INTERP_SINC && (taps < 4 || taps > 32)) {
+      DEBUG_MSG("Bad number of sinc taps %d\n", taps);
+      return;
+    }
+    control_rate = options->control_rate;
+    if (control_rate < 1) {
+      DEBUG_MSG("Bad control rate %d\n", control_rate);
+      return;
+    }
+    voices = options->voices;
+    if (voices < 1 || voices > MAX_VOICES) {
+      DEBUG_MSG("Bad number of voices %d\n", voices);
+      return;
+    }
+    reserve = options->reserve_voices;
+    if (reserve < 0 || reserve > MAX_RESERVE_VOICES) {
+      DEBUG_MSG("Bad number of reserve voices %d\n", reserve);
+      return;
+    }
+    cull = options->cull_threshold;
+    if (cull < -200 || cull > 0) {
+      DEBUG_MSG("Bad cull threshold %d\n", cull);
+      return;
+    }
+    mix_threads = options->mix_threads;
+    if (mix_threads < 1 || mix_threads > MAX_MIX_THREADS) {
+      DEBUG_MSG("Bad number of mix threads %d\n", mix_threads);
+      return;
+    }
+  }
 
   /* Allocate memory for the song */
   song = (MidSong *)timi_calloc(1, sizeof(MidSong));
   if (!song) return;
+  song->ctx = hold_context(ctx);
 
   for (i = 0; i < 128; i++) {
-    if (master_tonebank[i]) {
+    if (ctx->master_tonebank[i]) {
       song->tonebank[i] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
       if (!song->tonebank[i]) goto fail;
-      song->tonebank[i]->tone = master_tonebank[i]->tone;
+      song->tonebank[i]->tone = ctx->master_tonebank[i]->tone;
     }
-    if (master_drumset[i]) {
+    if (ctx->master_drumset[i]) {
       song->drumset[i] = (MidToneBank *) timi_calloc(1, sizeof(MidToneBank));
       if (!song->drumset[i]) goto fail;
-      song->drumset[i]->tone = master_drumset[i]->tone;
+      song->drumset[i]->tone = ctx->master_drumset[i]->tone;
     }
   }
 
   song->amplification = DEFAULT_AMPLIFICATION;
-  song->voices = DEFAULT_VOICES;
+  song->voices = voices;
+  song->reserve_voices = reserve;
+  song->voice = (MidVoice *) timi_calloc(voices + reserve, sizeof(MidVoice));
+  if (!song->voice) goto fail;
+  song->voice_list = (int *) timi_calloc(voices + reserve, sizeof(int));
+  if (!song->voice_list) goto fail;
   song->drumchannels = DEFAULT_DRUMCHANNELS;
+  for (i = 0; i < 16; i++) {
+    song->channel[i].priority = ISDRUMCHANNEL(song, i) ? DEFAULT_DRUM_PRIORITY : DEFAULT_PRIORITY;
+    song->channel[i].max_voices = 0;
+  }
 
   song->rate = options->rate;
   song->encoding = 0;
@@ -601,6 +876,10 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
       song->encoding |= PE_SIGNED;
   if (options->channels == 1)
       song->encoding |= PE_MONO;
+  if (options->format == MID_AUDIO_F32 || options->format == MID_AUDIO_F32P)
+      song->encoding |= PE_FLOAT;
+  if (options->format == MID_AUDIO_F32P && options->channels == 2)
+      song->encoding |= PE_PLANAR;
   switch (options->format) {
   case MID_AUDIO_S8:
     song->write = timi_s32tos8;
@@ -620,28 +899,48 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   case MID_AUDIO_U16MSB:
     song->write = timi_s32tou16b;
     break;
+  default: /* float: no conversion */
+    song->write = NULL;
+    break;
   }
 
   song->buffer_size = options->buffer_size;
   song->resample_buffer = (sample_t *) timi_malloc(options->buffer_size * sizeof(sample_t));
   if (!song->resample_buffer) goto fail;
-  song->common_buffer = (sint32 *) timi_malloc(options->buffer_size * 2 * sizeof(sint32));
-  if (!song->common_buffer) goto fail;
+  if (song->encoding & PE_FLOAT) {
+    song->float_buffer = (float *) timi_malloc(options->buffer_size * 2 * sizeof(float));
+    if (!song->float_buffer) goto fail;
+  } else {
+    song->common_buffer = (sint32 *) timi_malloc(options->buffer_size * 2 * sizeof(sint32));
+    if (!song->common_buffer) goto fail;
+    /* float sums depend on the order they are made in */
+    start_mixers(song, mix_threads);
+  }
 
   song->bytes_per_sample = 2;
   if (song->encoding & PE_16BIT)
     song->bytes_per_sample *= 2;
+  else if (song->encoding & PE_FLOAT)
+    song->bytes_per_sample *= 4;
   if (song->encoding & PE_MONO)
     song->bytes_per_sample /= 2;
 
-  song->control_ratio = options->rate / CONTROLS_PER_SECOND;
+  song->control_ratio = options->rate / control_rate;
   if (song->control_ratio < 1)
       song->control_ratio = 1;
   else if (song->control_ratio > MAX_CONTROL_RATIO)
       song->control_ratio = MAX_CONTROL_RATIO;
 
+  song->ramping = (ex && options->ramp_amplitude);
+
+  if (init_interpolation(song, interpolation, taps) < 0)
+    goto fail;
+
   song->lost_notes = 0;
   song->cut_notes = 0;
+  song->culled_notes = 0;
+  /* an amp of 2 plays a full scale sample at full scale */
+  song->cull_amp = (cull) ? 2.0f * (float)pow(10.0, cull / 20.0) : 0.0f;
 
   song->events = read_midi_file(stream, song, &(song->groomed_event_count),
 				&song->samples);
@@ -653,13 +952,29 @@ static void do_song_load(MidIStream *stream, MidSongOptions *options, MidSong **
   song->default_instrument = NULL;
   song->default_program = DEFAULT_PROGRAM;
 
-  if (sf_file)
-    init_soundfont(song, sf_file, sf_order);
+  /* the settings as they are now: another thread may change them */
+  timi_mutex_lock(&context_lock);
+  cache_dir = (sf_cache_dir) ? timi_strdup(sf_cache_dir) : NULL;
+  oom = (sf_cache_dir && !cache_dir);
+  threads = loader_threads;
+  preload_ms = preload_msec;
+  timi_mutex_unlock(&context_lock);
+  if (oom)
+    goto fail;
 
-  if (*def_instr_name)
-    set_default_instrument(song, def_instr_name);
+  if (ctx->sf_file)
+    init_soundfont(song, ctx->sf_file, ctx->sf_order, cache_dir);
+  timi_free(cache_dir);
 
-  load_missing_instruments(song);
+  if (*ctx->def_instr_name)
+    set_default_instrument(song, ctx->def_instr_name);
+
+  preload = -1;
+  if (preload_ms >= 0) {
+    double t = (double)preload_ms * song->rate / 1000.0;
+    preload = (t < 2147483647.0) ? (sint32)t : 2147483647;
+  }
+  load_missing_instruments(song, threads, preload);
 
   if (! song->oom)
       *out = song;
@@ -669,9 +984,33 @@ fail: mid_song_free (song);
 }
 
 MidSong *mid_song_load(MidIStream *stream, MidSongOptions *options)
+{
+  MidContext *ctx = hold_default_context();
+  MidSong *song;
+  if (!ctx) return NULL;
+  do_song_load(ctx, stream, options, 0, &song);
+  drop_context(ctx);
+  return song;
+}
+
+MidSong *mid_song_load_context(MidContext *ctx, MidIStream *stream, MidSongOptions *options)
 {
   MidSong *song;
-  do_song_load(stream, options, &song);
+  if (!ctx) return NULL;
+  do_song_load(ctx, stream, options, 0, &song);
+  return song;
+}
+
+MidSong *mid_song_load_ex(MidContext *ctx, MidIStream *stream, MidSongOptions *options)
+{
+  MidSong *song;
+  if (ctx) {
+    do_song_load(ctx, stream, options, 1, &song);
+    return song;
+  }
+  if (!(ctx = hold_default_context())) return NULL;
+  do_song_load(ctx, stream, options, 1, &song);
+  drop_context(ctx);
   return song;
 }
 
@@ -682,14 +1021,15 @@ void mid_song_free(MidSong *song)
   if (!song) return;
 
   free_instruments(song);
+  free_soundfont(song);
 
   for (i = 0; i < 128; i++) {
-    if (!master_tonebank[i] && song->tonebank[i]) { /* might be alloc'ed by sndfont */
+    if (!song->ctx->master_tonebank[i] && song->tonebank[i]) { /* might be alloc'ed by sndfont */
       for (j = 0; j < 128; j++)
         timi_free(song->tonebank[i]->tone[j].name);
       timi_free(song->tonebank[i]->tone);
     }
-    if (!master_drumset[i] && song->drumset[i]) {   /* might be alloc'ed by sndfont */
+    if (!song->ctx->master_drumset[i] && song->drumset[i]) {   /* might be alloc'ed by sndfont */
       for (j = 0; j < 128; j++)
         timi_free(song->drumset[i]->tone[j].name);
       timi_free(song->drumset[i]->tone);
@@ -698,52 +1038,73 @@ void mid_song_free(MidSong *song)
     timi_free(song->drumset[i]);
   }
 
+  stop_mixers(song);
+  timi_free(song->voice);
+  timi_free(song->voice_list);
   timi_free(song->common_buffer);
+  timi_free(song->float_buffer);
   timi_free(song->resample_buffer);
+  timi_free(song->fir_table);
   timi_free(song->events);
 
   for (i = 0; i < MID_META_MAX; i++) {
     timi_free(song->meta_data[i]);
   }
 
+  drop_context(song->ctx);
   timi_free(song);
 }
 
 void mid_exit(void)
 {
-  int i, j;
+  MidContext *ctx;
+  int others;
+
+  /* the songs still using the configuration keep it, and mid_init()
+     starts a new one */
+  timi_mutex_lock(&context_lock);
+  ctx = default_context;
+  default_context = NULL;
+  timi_mutex_unlock(&context_lock);
+  drop_context(ctx);
+
+  /* the instruments of the contexts still around stay */
+  timi_mutex_lock(&context_lock);
+  others = context_count;
+  timi_mutex_unlock(&context_lock);
+  purge_instruments(!others);
+
+  timi_mutex_lock(&context_lock);
+  timi_free(sf_cache_dir);
+  sf_cache_dir = NULL;
+  timi_mutex_unlock(&context_lock);
+}
 
-  for (i = 0; i < 128; i++) {
-    if (master_tonebank[i]) {
-      MidToneBankElement *e = master_tonebank[i]->tone;
-      if (e != NULL) {
-	for (j = 0; j < 128; j++) {
-	  timi_free(e[j].name);
-	}
-	timi_free(e);
-      }
-      timi_free(master_tonebank[i]);
-      master_tonebank[i] = NULL;
-    }
-    if (master_drumset[i]) {
-      MidToneBankElement *e = master_drumset[i]->tone;
-      if (e != NULL) {
-	for (j = 0; j < 128; j++) {
-	  timi_free(e[j].name);
-	}
-	timi_free(e);
-      }
-      timi_free(master_drumset[i]);
-      master_drumset[i] = NULL;
-    }
-  }
+int mid_purge_instruments(void)
+{
+  return purge_instruments(0);
+}
 
-  end_soundfont();
-  timi_free(sf_file);
-  sf_file = NULL;
-  sf_order = 0;
+size_t mid_get_resample_cache_size(void)
+{
+  return resampled_size();
+}
+
+void mid_set_instrument_budget(size_t bytes)
+{
+  set_instrument_budget(bytes);
+}
 
-  timi_free_pathlist();
+size_t mid_get_instrument_memory(void)
+{
+  return instrument_memory(NULL);
+}
+
+size_t mid_get_instrument_memory_peak(void)
+{
+  size_t peak;
+  instrument_memory(&peak);
+  return peak;
 }
 
 long mid_get_version (void)
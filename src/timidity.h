@@ -61,6 +61,11 @@ extern "C" {
 #define MID_AUDIO_S16MSB  0x9010  /* As above, but big-endian byte order */
 #define MID_AUDIO_U16     MID_AUDIO_U16LSB
 #define MID_AUDIO_S16     MID_AUDIO_S16LSB
+#define MID_AUDIO_F32     0x8120  /* 32-bit float samples, in the native byte
+                                   * order, 1.0 at full scale and not clipped:
+                                   * mixed in float all the way */
+#define MID_AUDIO_F32P    0xC120  /* As above, but planar: see
+                                   * mid_song_read_wave() */
 
 /* Core Library Types
  */
@@ -86,6 +91,7 @@ extern "C" {
   typedef struct _MidIStream MidIStream;
   typedef struct _MidDLSPatches MidDLSPatches;
   typedef struct _MidSong MidSong;
+  typedef struct _MidContext MidContext;
 
   typedef struct _MidSongOptions MidSongOptions;
   struct _MidSongOptions
@@ -96,8 +102,43 @@ extern "C" {
     uint8 _pad;
     uint16 buffer_size; /* Sample buffer size (in samples, not bytes) */
     uint16 _reserved;
+    /* The fields below are only read by mid_song_load_ex(): set them
+     * to their defaults with mid_song_options_init() first. */
+    sint32 interpolation; /* MID_INTERP_*, MID_INTERP_LINEAR by default */
+    sint32 sinc_taps;     /* Taps of MID_INTERP_SINC, 4 to 32 (default 8),
+                           * rounded up to a multiple of 4 */
+    sint32 control_rate;  /* Envelope and tremolo updates per second
+                           * (default 1000), taken as rate/1023 if lower */
+    sint32 ramp_amplitude; /* Nonzero to slide the volumes of the voices
+                            * from one update to the next instead of
+                            * stepping them (default 0): keeps lower
+                            * control rates free of zipper noise */
+    sint32 voices;        /* Most notes played at once, 1 to 4096
+                           * (default 32) */
+    sint32 reserve_voices; /* Voices kept back for fading out the notes
+                            * cut to make room for new ones, 0 to 64
+                            * (default 4) */
+    sint32 cull_threshold; /* Level in dBFS, -200 to -1, below which the
+                            * released notes are stopped early, or 0 to
+                            * play them out (the default) */
+    sint32 mix_threads;   /* Threads mixing the voices, the one reading
+                           * the song included, 1 (the default) to 16.
+                           * The output is the same on any number of
+                           * them. Float formats are mixed on one. */
   };
 
+/* How samples are interpolated when they are played at another pitch
+ * than they were recorded at, from the cheapest to the best sounding:
+ * NONE takes the sample at or before each position, LINEAR (what
+ * mid_song_load() uses) the straight line between the two around it,
+ * CUBIC a curve through the four around it, and SINC a windowed sinc
+ * filter over sinc_taps of them.
+ */
+#define MID_INTERP_NONE     0
+#define MID_INTERP_LINEAR   1
+#define MID_INTERP_CUBIC    2
+#define MID_INTERP_SINC     3
+
   typedef int MidSongMetaId;
 #define MID_SONG_TEXT       0
 #define MID_SONG_COPYRIGHT  1
@@ -150,6 +191,30 @@ extern "C" {
  */
   TIMI_EXPORT extern int mid_set_soundfont (const char *sf2_file);
 
+/* Set a directory to keep precompiled soundfont index files in, so
+ * that songs using a font already seen needn't parse it again.  The
+ * index is rebuilt when the font file changes.  NULL (the default)
+ * disables them.  The index files are not used on systems without
+ * mmap().
+ */
+  TIMI_EXPORT extern int mid_set_soundfont_cache (const char *dir);
+
+/* Set the maximum number of threads to load the instruments of a
+ * song with.  The default is 1: instruments are loaded one after the
+ * other by the thread calling mid_song_load().
+ * Returns -1 if libtimidity was built without thread support.
+ */
+  TIMI_EXPORT extern int mid_set_loader_threads (int threads);
+
+/* Make mid_song_load() return as soon as the instruments played in the
+ * first msec milliseconds of the song are loaded.  The others are loaded
+ * by a background thread in the order they are played, and rendering
+ * waits only if it gets to one that is not there yet.  A negative value
+ * (the default) loads all of them before mid_song_load() returns.
+ * Returns -1 if libtimidity was built without thread support.
+ */
+  TIMI_EXPORT extern int mid_set_preload_time (int msec);
+
 /* Initialize the library. If config_file is NULL
  * search for configuratin file in default directories
  */
@@ -160,10 +225,65 @@ extern "C" {
  */
   TIMI_EXPORT extern int mid_init_no_config (void);
 
-/* Shutdown the library
+/* Shutdown the library.  Songs not freed yet keep the configuration
+ * and instruments they use until they are freed.
  */
   TIMI_EXPORT extern void mid_exit (void);
 
+/* Free the loaded instruments which are no longer used by any song.
+ * Instruments are shared between songs and kept around after a song
+ * is freed, so that loading the next song doesn't need to load them
+ * again.  mid_exit() frees them all.
+ * Returns the number of instruments freed.
+ */
+  TIMI_EXPORT extern int mid_purge_instruments (void);
+
+/* Get the number of bytes of the samples that were resampled for the
+ * fixed note they are played on (drum samples mostly), and are kept
+ * to be shared by the instruments using them.  mid_purge_instruments()
+ * frees the ones no instrument is using.
+ */
+  TIMI_EXPORT extern size_t mid_get_resample_cache_size (void);
+
+/* Limit the memory the samples of the loaded instruments take, in bytes
+ * (0, the default, for no limit).  When it is exceeded, the instruments
+ * no song is using are freed, the ones unused for the longest time first.
+ * Instruments in use are never freed, so the songs loaded may go over
+ * the budget.  Soundfont samples used from a memory mapping of the font
+ * file take no memory here.
+ */
+  TIMI_EXPORT extern void mid_set_instrument_budget (size_t bytes);
+
+/* Get the number of bytes the samples of the loaded instruments take
+ */
+  TIMI_EXPORT extern size_t mid_get_instrument_memory (void);
+
+/* Get the most bytes the samples of the loaded instruments have taken
+ */
+  TIMI_EXPORT extern size_t mid_get_instrument_memory_peak (void);
+
+/* Create a context with a configuration of its own: the tone banks,
+ * search paths and soundfont read from config_file (or from the default
+ * configuration file when config_file is NULL).  The library must have
+ * been initialized with mid_init() or mid_init_no_config() first, and
+ * contexts can be created, used and freed from any thread.  Songs are
+ * loaded with a context through mid_song_load_context().
+ * Returns NULL on failure.
+ */
+  TIMI_EXPORT extern MidContext *mid_context_create (const char *config_file);
+
+/* Create a context which plays everything with the given soundfont,
+ * like mid_set_soundfont() followed by mid_init_no_config() does for
+ * the library.
+ * Returns NULL on failure.
+ */
+  TIMI_EXPORT extern MidContext *mid_context_create_soundfont (const char *sf2_file);
+
+/* Free a context.  The songs loaded with it keep what they use of it
+ * until they are freed, too.
+ */
+  TIMI_EXPORT extern void mid_context_free (MidContext *ctx);
+
 
 /* Input Stream Functions
  * ======================
@@ -220,15 +340,47 @@ extern "C" {
   TIMI_EXPORT extern MidSong *mid_song_load (MidIStream *stream,
                                              MidSongOptions *options);
 
+/* Load MIDI song with the configuration of a context instead of the
+ * one mid_init() read
+ */
+  TIMI_EXPORT extern MidSong *mid_song_load_context (MidContext *ctx,
+                                                     MidIStream *stream,
+                                                     MidSongOptions *options);
+
+/* Set the song options that mid_song_load_ex() reads besides the ones
+ * mid_song_load() does to their defaults.
+ */
+  TIMI_EXPORT extern void mid_song_options_init (MidSongOptions *options);
+
+/* Load MIDI song with all of the options, and the configuration of a
+ * context, or the one mid_init() read if ctx is NULL
+ */
+  TIMI_EXPORT extern MidSong *mid_song_load_ex (MidContext *ctx,
+                                                MidIStream *stream,
+                                                MidSongOptions *options);
+
 /* Set song amplification value
  */
   TIMI_EXPORT extern void mid_song_set_volume (MidSong *song, int volume);
 
+/* Set how the notes of a channel (0 to 15) fare when the voices run out:
+ * the ones of the channels with the lower priority, 0 to 127 (64, and 96
+ * on drum channels, by default), are cut first. With max_voices above 0,
+ * a channel playing that many notes cuts one of its own for a new one.
+ */
+  TIMI_EXPORT extern void mid_song_set_channel_voices (MidSong *song,
+                                                       int channel,
+                                                       int priority,
+                                                       int max_voices);
+
 /* Seek song to the start position and initialize conversion
  */
   TIMI_EXPORT extern void mid_song_start (MidSong *song);
 
 /* Read WAVE data
+ * With MID_AUDIO_F32P, the size bytes read are all of the left channel's
+ * samples first and then all of the right one's, each size/8 of them,
+ * or as many as were read if it's less.
  */
   TIMI_EXPORT extern size_t mid_song_read_wave (MidSong *song, sint8 *ptr, size_t size);
 
@@ -244,6 +396,11 @@ extern "C" {
  */
   TIMI_EXPORT extern uint32 mid_song_get_time (MidSong *song);
 
+/* Get the number of notes stopped early for falling below the
+ * cull_threshold since the song was loaded
+ */
+  TIMI_EXPORT extern uint32 mid_song_get_culled_notes (MidSong *song);
+
 /* Get song meta data. Return NULL if no meta data.
  */
   TIMI_EXPORT extern char *mid_song_get_meta (MidSong *song, MidSongMetaId what);
@@ -133,12 +133,19 @@ extern sint32 XCHG_LONG (sint32);
 
 #define MID_VIBRATO_SAMPLE_INCREMENTS 32
 
-/* Maximum polyphony. */
-#define MID_MAX_VOICES	48
-
 typedef sint16 sample_t;
 typedef sint32 final_volume_t;
 
+/* Holder of sample data which isn't owned by the sample using it,
+   e.g. data mapped from a file: released when the last user is gone. */
+typedef struct _MidDataRef MidDataRef;
+struct _MidDataRef
+{
+  int refcount;
+  size_t bytes;	/* memory held, or 0 if it is a mapping of the file */
+  void (*release) (MidDataRef *ref);
+};
+
 typedef struct _MidSample MidSample;
 struct _MidSample
 {
@@ -149,7 +156,8 @@ struct _MidSample
   sint8 root_tune, fine_tune; /* for soundfont support */
   sint32 envelope_rate[6], envelope_offset[6];
   float volume;
-  sample_t *data;
+  sample_t *data;	/* sint8 data unless modes has MODES_16BIT */
+  MidDataRef *data_ref; /* NULL if data is ours to free */
   sint32
     tremolo_sweep_increment, tremolo_phase_increment,
     vibrato_sweep_increment, vibrato_control_ratio;
@@ -164,6 +172,7 @@ struct _MidChannel
   int bank, program, volume, sustain, panning, pitchbend, expression;
   int mono;	/* one note only on this channel -- not implemented yet */
   int pitchsens;
+  int priority, max_voices; /* set by mid_song_set_channel_voices() */
   /* chorus, reverb... Coming soon to a 300-MHz, eight-way superscalar
      processor near you */
   float pitchfactor; /* precomputed pitch bend factor to save some fdiv's */
@@ -179,16 +188,24 @@ struct _MidVoice
     sample_offset, sample_increment,
     envelope_volume, envelope_target, envelope_increment,
     tremolo_sweep, tremolo_sweep_position,
-    tremolo_phase, tremolo_phase_increment,
-    vibrato_sweep, vibrato_sweep_position;
+    tremolo_phase, tremolo_phase_increment, tremolo_depth,
+    vibrato_sweep, vibrato_sweep_position, vibrato_depth,
+    base_increment; /* the sample_increment before any vibrato */
 
   final_volume_t left_mix, right_mix;
+  sint32 left_ramp, right_ramp; /* when ramping: the volumes the last
+				   samples were mixed at, << RAMP_BITS */
+  float left_gain, right_gain,	/* with PE_FLOAT: left_mix and right_mix */
+    left_gain_ramp, right_gain_ramp; /* and left_ramp and right_ramp */
 
   float left_amp, right_amp, tremolo_volume;
-    sint32 vibrato_sample_increment[MID_VIBRATO_SAMPLE_INCREMENTS];
   int
     vibrato_phase, vibrato_control_ratio, vibrato_control_counter,
     envelope_stage, control_counter, panning, panned;
+  int list_pos;			/* where the voice is in song->voice_list */
+  int key_prev, key_next,	/* the voices in use next to it on its */
+    channel_prev, channel_next;	/* channel and key, and channel, or -1 */
+  int culled;			/* freed by the cull_threshold, till dropped */
 };
 
 #define INST_GUS        0
@@ -200,6 +217,7 @@ struct _MidInstrument
   int type;
   int samples;
   MidSample *sample;
+  struct _MidInstCache *cache; /* shared instrument cache entry, or NULL */
 };
 
 typedef struct _MidToneBankElement MidToneBankElement;
@@ -216,6 +234,20 @@ struct _MidToneBank
   MidInstrument *instrument[128];
 };
 
+/* The configuration songs are loaded with: the one mid_init() reads, or
+   one of a context made with mid_context_create() */
+struct _MidContext
+{
+  int refcount;	/* the context itself, and each song loaded with it */
+  int id;	/* keeps apart what was loaded with different configurations */
+  MidToneBank *master_tonebank[128], *master_drumset[128];
+  char def_instr_name[256];
+  char *sf_file;
+  int sf_order;
+  struct _SFRules *sfrules;	/* the font exclude/order directives */
+  struct _PathList *pathlist;
+};
+
 typedef struct _MidEvent MidEvent;
 struct _MidEvent
 {
@@ -247,27 +279,46 @@ struct _MidSong
   int buffer_size;
   sample_t *resample_buffer;
   sint32 *common_buffer;
+  float *float_buffer;		/* instead of common_buffer, with PE_FLOAT */
+  size_t plane_bytes;		/* PE_PLANAR: from the left channel to the right */
   /* These would both fit into 32 bits, but they are often added in
      large multiples, so it's simpler to have two roomy ints */
   /* samples per MIDI delta-t */
   sint32 sample_increment;
   sint32 sample_correction;
   MidChannel channel[16];
-  MidVoice voice[MID_MAX_VOICES];
+  MidVoice *voice;		/* voices + reserve_voices of them */
   int voices;
+  int reserve_voices;		/* only for fading out stolen notes */
+  int *voice_list;		/* the voices in use, then the free ones */
+  int active_voices;		/* how many of voice_list are in use */
+  int key_voices[16][128];	/* the first voice in use on each channel */
+  int channel_voices[16];	/* and key, and on each channel, or -1 */
+  int victim[STEAL_CANDIDATES];	/* the voices cheapest to cut, */
+  sint32 victim_worth[STEAL_CANDIDATES]; /* their voice_worth, */
+  int victims;			/* how many, or -1 to find them again */
+  sint32 victim_limit;		/* what the others are worth at least, */
+  int victim_limit_pos;		/* and the voice_list place on a tie */
   sint32 drumchannels;
   sint32 control_ratio;
+  int ramping;			/* the ramp_amplitude option */
+  int interpolation;		/* MID_INTERP_* */
+  int fir_taps;			/* of fir_table, for cubic or sinc */
+  sint16 *fir_table;		/* fir_taps coefficients for each fraction */
   sint32 lost_notes;
   sint32 cut_notes;
+  sint32 culled_notes;
+  float cull_amp;		/* the cull_threshold as an amp, or 0 */
   sint32 samples;
   MidEvent *events;
   MidEvent *current_event;
-  MidEventList *evlist;
   sint32 current_sample;
-  sint32 event_count;
-  sint32 at;
   sint32 groomed_event_count;
   char *meta_data[MID_META_MAX];
+  MidContext *ctx;		/* the configuration the song was loaded with */
+  struct _SFInsts *soundfont;	/* the parsed soundfont, if any */
+  struct _MidLoader *loader;	/* loads the instruments in the background */
+  struct _MidMixPool *mixers;	/* the threads mixing along, or NULL */
 };
 
 #endif /* TIMIDITY_INTERNAL_H */
@@ -0,0 +1,189 @@
+/* benchmark.c -- renders a song with each of the interpolations, and
+ * reports how many samples per second each of them does.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "timidity.h"
+
+static void
+print_usage (void)
+{
+  printf ("Usage: benchmark [-cfg /path/to/your/timidity.cfg]\n"
+	  "                 [-sf2 /path/to/your/sndfont.sf2]\n"
+	  "                 [-r rate] [-n rounds]\n"
+	  "                 [-cr control_rate] [-ramp] [-p voices]\n"
+	  "                 [-cull dBFS] [-t threads] midifile\n");
+}
+
+static const struct
+{
+  const char *name;
+  sint32 interpolation, taps;
+} tiers[] =
+{
+  { "none",    MID_INTERP_NONE,   0 },
+  { "linear",  MID_INTERP_LINEAR, 0 },
+  { "cubic",   MID_INTERP_CUBIC,  0 },
+  { "sinc-8",  MID_INTERP_SINC,   8 },
+  { "sinc-16", MID_INTERP_SINC,  16 },
+  { "sinc-32", MID_INTERP_SINC,  32 }
+};
+
+/* returns the samples rendered, per channel, and the seconds it took */
+static double
+render (const char *name, MidSongOptions *options, int rounds, double *secs)
+{
+  MidIStream *stream;
+  MidSong *song;
+  static sint8 buffer[65536];
+  size_t n;
+  double samples = 0;
+  clock_t start;
+
+  *secs = 0;
+  stream = mid_istream_open_file (name);
+  if (!stream)
+    return -1;
+  song = mid_song_load_ex (NULL, stream, options);
+  mid_istream_close (stream);
+  if (!song)
+    return -1;
+
+  /* the instruments are loaded: only the rendering is timed. clock()
+     counts the time of every thread, so with -t this is what mixing
+     on them costs rather than how much sooner the song is done. */
+  while (rounds--)
+    {
+      start = clock ();
+      mid_song_start (song);
+      while ((n = mid_song_read_wave (song, buffer, sizeof (buffer))) > 0)
+	samples += n / 4;
+      *secs += (double) (clock () - start) / CLOCKS_PER_SEC;
+    }
+  mid_song_free (song);
+  return samples;
+}
+
+int
+main (int argc, char *argv[])
+{
+  char *cfgfile = NULL, *sf2file = NULL, *midifile = NULL;
+  int rate = 44100, rounds = 3, control_rate = 0, ramp = 0, voices = 0;
+  int cull = 0, threads = 1, arg, rc;
+  unsigned int i;
+  MidSongOptions options;
+  double samples, secs;
+
+  for (arg = 1; arg < argc; arg++)
+    {
+      if (!strcmp (argv[arg], "-cfg"))
+	{
+	  if (++arg >= argc) break;
+	  cfgfile = argv[arg];
+	}
+      else if (!strcmp (argv[arg], "-sf2"))
+	{
+	  if (++arg >= argc) break;
+	  sf2file = argv[arg];
+	}
+      else if (!strcmp (argv[arg], "-r"))
+	{
+	  if (++arg >= argc) break;
+	  rate = atoi (argv[arg]);
+	}
+      else if (!strcmp (argv[arg], "-n"))
+	{
+	  if (++arg >= argc) break;
+	  rounds = atoi (argv[arg]);
+	}
+      else if (!strcmp (argv[arg], "-cr"))
+	{
+	  if (++arg >= argc) break;
+	  control_rate = atoi (argv[arg]);
+	}
+      else if (!strcmp (argv[arg], "-ramp"))
+	ramp = 1;
+      else if (!strcmp (argv[arg], "-p"))
+	{
+	  if (++arg >= argc) break;
+	  voices = atoi (argv[arg]);
+	}
+      else if (!strcmp (argv[arg], "-cull"))
+	{
+	  if (++arg >= argc) break;
+	  cull = atoi (argv[arg]);
+	}
+      else if (!strcmp (argv[arg], "-t"))
+	{
+	  if (++arg >= argc) break;
+	  threads = atoi (argv[arg]);
+	}
+      else if (argv[arg][0] == '-')
+	{
+	  print_usage ();
+	  return 1;
+	}
+      else
+	midifile = argv[arg];
+    }
+  if (!midifile || rounds < 1)
+    {
+      print_usage ();
+      return 1;
+    }
+
+  if (sf2file)
+    {
+      mid_set_soundfont (sf2file);
+      rc = mid_init (NULL);
+    }
+  else
+    rc = mid_init (cfgfile);
+  if (rc < 0)
+    {
+      fprintf (stderr, "Could not initialise libTiMidity\n");
+      return 1;
+    }
+
+  mid_song_options_init (&options);
+  options.rate = rate;
+  options.format = MID_AUDIO_S16LSB;
+  options.channels = 2;
+  options.buffer_size = 4096;
+  if (control_rate > 0)
+    options.control_rate = control_rate;
+  options.ramp_amplitude = ramp;
+  if (voices > 0)
+    options.voices = voices;
+  options.cull_threshold = cull;
+  options.mix_threads = threads;
+
+  printf ("%-8s %14s %10s\n", "", "samples/sec", "realtime");
+  for (i = 0; i < sizeof (tiers) / sizeof (tiers[0]); i++)
+    {
+      options.interpolation = tiers[i].interpolation;
+      if (tiers[i].taps)
+	options.sinc_taps = tiers[i].taps;
+      samples = render (midifile, &options, rounds, &secs);
+      if (samples < 0)
+	{
+	  fprintf (stderr, "Could not load %s\n", midifile);
+	  mid_exit ();
+	  return 1;
+	}
+      if (secs <= 0)
+	secs = 1.0 / CLOCKS_PER_SEC;
+      printf ("%-8s %14.0f %9.1fx\n", tiers[i].name, samples / secs,
+	      samples / secs / rate);
+    }
+
+  mid_exit ();
+  return 0;
+}
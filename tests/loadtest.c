@@ -0,0 +1,332 @@
+/* loadtest.c -- loads songs on several threads at once and checks that
+ * they come out the same as when they are loaded one at a time.
+ *
+ * This test is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "timidity.h"
+
+#define NSONGS   24
+#define NTHREADS 4
+#define NROUNDS  3
+
+#define PATCH_FILE  "loadtest.pat"
+#define CONFIG_FILE "./loadtest.cfg"
+
+typedef struct
+{
+  unsigned char *data;
+  size_t size;
+} Song;
+
+static Song songs[NSONGS + 1];
+static int nsongs;
+static unsigned long serial[NSONGS + 1];
+static int failures;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long seed;
+
+static int
+rnd (int n)
+{
+  seed = seed * 1103515245UL + 12345UL;
+  return (int) ((seed >> 16) % (unsigned long) n);
+}
+
+static void
+put_le (FILE *fp, unsigned long v, int bytes)
+{
+  while (bytes--)
+    {
+      fputc ((int) (v & 0xFF), fp);
+      v >>= 8;
+    }
+}
+
+/* A GUS patch with one looped 16-bit sample, and a config file playing
+   it for every program and drum */
+static int
+write_config (void)
+{
+  FILE *fp;
+  int i;
+
+  if (!(fp = fopen (PATCH_FILE, "wb")))
+    return -1;
+  fwrite ("GF1PATCH110\0ID#000002\0", 1, 22, fp);
+  for (i = 22; i < 239; i++)
+    fputc ((i == 82 || i == 151 || i == 198) ? 1 : 0, fp);
+  fwrite ("wave\0\0\0\0", 1, 8, fp);
+  put_le (fp, 2000, 4);	/* data length, in bytes */
+  put_le (fp, 400, 4);	/* loop start */
+  put_le (fp, 1800, 4);	/* loop end */
+  put_le (fp, 22050, 2);	/* sample rate */
+  put_le (fp, 0, 4);	/* low, high and root frequency */
+  put_le (fp, 12543853, 4);
+  put_le (fp, 440000, 4);
+  put_le (fp, 0, 2);
+  fputc (7, fp);		/* panning */
+  for (i = 0; i < 12; i++)	/* envelope rates and offsets */
+    fputc ((i < 6) ? 40 : ((i < 9) ? 240 : 10), fp);
+  fputc (0, fp), fputc (0, fp), fputc (0, fp);	/* tremolo */
+  fputc (30, fp), fputc (40, fp), fputc (60, fp);	/* vibrato */
+  fputc (1 | 4 | 32 | 64, fp);	/* 16-bit, looped, sustained, enveloped */
+  for (i = 0; i < 40; i++)
+    fputc (0, fp);
+  for (i = 0; i < 1000; i++)	/* a saw */
+    put_le (fp, (unsigned long) (((i % 50) * 1200 - 30000) & 0xFFFF), 2);
+  fclose (fp);
+
+  if (!(fp = fopen (CONFIG_FILE, "w")))
+    return -1;
+  fprintf (fp, "bank 0\n");
+  for (i = 0; i < 128; i++)
+    fprintf (fp, "%d loadtest%s\n", i, (i % 3) ? "" : " amp=80");
+  fprintf (fp, "drumset 0\n");
+  for (i = 0; i < 128; i++)
+    fprintf (fp, "%d loadtest%s\n", i, (i % 2) ? "" : " note=60");
+  fclose (fp);
+  return 0;
+}
+
+static unsigned char *
+put_byte (unsigned char *p, int b)
+{
+  *p++ = (unsigned char) b;
+  return p;
+}
+
+static unsigned char *
+put_vl (unsigned char *p, unsigned long v)
+{
+  unsigned char tmp[4];
+  int n = 0;
+  do
+    {
+      tmp[n++] = (unsigned char) (v & 0x7F);
+      v >>= 7;
+    }
+  while (v);
+  while (n--)
+    *p++ = tmp[n] | (n ? 0x80 : 0);
+  return p;
+}
+
+static unsigned char *
+put_be32 (unsigned char *p, unsigned long v)
+{
+  p[0] = (unsigned char) (v >> 24);
+  p[1] = (unsigned char) (v >> 16);
+  p[2] = (unsigned char) (v >> 8);
+  p[3] = (unsigned char) v;
+  return p + 4;
+}
+
+/* A track of notes using running status, with pitch bend sensitivity
+   (RPN) and bank changes, so that parser state carried from one file
+   or thread to another shows */
+static unsigned char *
+make_track (unsigned char *p, int n)
+{
+  unsigned char *start = p + 8, *q;
+  int i, ch = rnd (16), note;
+
+  memcpy (p, "MTrk", 4);
+  q = start;
+  if (n == 0)
+    {
+      q = put_vl (q, 0);
+      q = put_byte (q, 0xFF), q = put_byte (q, 0x51), q = put_byte (q, 3);
+      q = put_byte (q, 0x07), q = put_byte (q, rnd (256)), q = put_byte (q, 0x20);
+      q = put_vl (q, 0);
+      q = put_byte (q, 0xFF), q = put_byte (q, 0x01), q = put_byte (q, 4);
+      memcpy (q, "song", 4), q += 4;
+    }
+  q = put_vl (q, 0), q = put_byte (q, 0xC0 | ch), q = put_byte (q, rnd (128));
+  if (rnd (2))
+    {
+      q = put_vl (q, 0), q = put_byte (q, 0xB0 | ch);
+      q = put_byte (q, 101), q = put_byte (q, 0);
+      q = put_vl (q, 0), q = put_byte (q, 100), q = put_byte (q, 0);
+      q = put_vl (q, 0), q = put_byte (q, 6), q = put_byte (q, 1 + rnd (12));
+    }
+  for (i = 0; i < 12; i++)
+    {
+      note = 36 + rnd (48);
+      q = put_vl (q, rnd (60)), q = put_byte (q, 0x90 | ch);
+      q = put_byte (q, note), q = put_byte (q, 40 + rnd (80));
+      if (rnd (3) == 0)
+	{
+	  q = put_vl (q, rnd (30)), q = put_byte (q, 0xE0 | ch);
+	  q = put_byte (q, rnd (128)), q = put_byte (q, rnd (128));
+	  q = put_vl (q, rnd (30)), q = put_byte (q, 0x90 | ch);
+	  q = put_byte (q, note), q = put_byte (q, 0);
+	}
+      else /* running status */
+	{
+	  q = put_vl (q, 20 + rnd (60));
+	  q = put_byte (q, note), q = put_byte (q, 0);
+	}
+    }
+  q = put_vl (q, 0);
+  q = put_byte (q, 0xFF), q = put_byte (q, 0x2F), q = put_byte (q, 0);
+  put_be32 (p + 4, (unsigned long) (q - start));
+  return q;
+}
+
+static void
+make_song (Song *s, int n)
+{
+  unsigned char *p;
+  int i, tracks = 1 + n % 4;
+
+  seed = (unsigned long) n * 7919UL + 1;
+  s->data = p = (unsigned char *) malloc (32 + tracks * 1024);
+  memcpy (p, "MThd", 4);
+  p = put_be32 (p + 4, 6);
+  p = put_byte (p, 0), p = put_byte (p, (tracks > 1) ? 1 : 0);
+  p = put_byte (p, 0), p = put_byte (p, tracks);
+  p = put_byte (p, 0), p = put_byte (p, 96);
+  for (i = 0; i < tracks; i++)
+    p = make_track (p, i);
+  s->size = (size_t) (p - s->data);
+}
+
+static int
+read_song (Song *s, const char *name)
+{
+  FILE *fp = fopen (name, "rb");
+  long len;
+
+  if (!fp)
+    return -1;
+  fseek (fp, 0, SEEK_END);
+  len = ftell (fp);
+  fseek (fp, 0, SEEK_SET);
+  s->data = (unsigned char *) malloc (len);
+  if (fread (s->data, 1, len, fp) != (size_t) len)
+    len = -1;
+  fclose (fp);
+  s->size = (size_t) len;
+  return (len > 0) ? 0 : -1;
+}
+
+/* everything a song is loaded into that is worth comparing */
+static unsigned long
+play_song (Song *s)
+{
+  MidSongOptions options;
+  MidIStream *stream;
+  MidSong *song;
+  const char *text;
+  sint8 buffer[4096];
+  size_t n, i;
+  unsigned long h = 5381;
+
+  options.rate = 22050;
+  options.format = MID_AUDIO_S16LSB;
+  options.channels = 2;
+  options.buffer_size = 1024;
+  stream = mid_istream_open_mem (s->data, s->size);
+  if (!stream)
+    return 0;
+  song = mid_song_load (stream, &options);
+  mid_istream_close (stream);
+  if (!song)
+    return 0;
+
+  h = h * 33 + mid_song_get_total_time (song);
+  if ((text = mid_song_get_meta (song, MID_SONG_TEXT)) != NULL)
+    while (*text)
+      h = h * 33 + (unsigned char) *text++;
+  mid_song_start (song);
+  while ((n = mid_song_read_wave (song, buffer, sizeof (buffer))) > 0)
+    for (i = 0; i < n; i++)
+      h = h * 33 + (unsigned char) buffer[i];
+  mid_song_free (song);
+  return h;
+}
+
+static void *
+thread_main (void *arg)
+{
+  int t = (int) (long) arg;
+  int r, i, n;
+  unsigned long h;
+
+  for (r = 0; r < NROUNDS; r++)
+    for (i = 0; i < nsongs; i++)
+      {
+	n = (i * (t + 1) + r) % nsongs;
+	h = play_song (&songs[n]);
+	if (h != serial[n])
+	  {
+	    pthread_mutex_lock (&lock);
+	    fprintf (stderr, "song %d, thread %d: %08lx instead of %08lx\n",
+		     n, t, h, serial[n]);
+	    failures++;
+	    pthread_mutex_unlock (&lock);
+	  }
+      }
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pthread_t threads[NTHREADS];
+  const char *srcdir = getenv ("srcdir");
+  char name[1024];
+  int i;
+
+  (void) argc;
+  (void) argv;
+
+  if (write_config () < 0 || mid_init (CONFIG_FILE) < 0)
+    {
+      fprintf (stderr, "Could not set up the test config\n");
+      return 1;
+    }
+
+  for (nsongs = 0; nsongs < NSONGS; nsongs++)
+    make_song (&songs[nsongs], nsongs);
+  sprintf (name, "%.1000s/ame002.mid", (srcdir) ? srcdir : ".");
+  if (read_song (&songs[nsongs], name) == 0)
+    nsongs++;
+
+  for (i = 0; i < nsongs; i++)
+    {
+      serial[i] = play_song (&songs[i]);
+      if (!serial[i])
+	{
+	  fprintf (stderr, "Could not load song %d\n", i);
+	  return 1;
+	}
+    }
+
+  for (i = 0; i < NTHREADS; i++)
+    if (pthread_create (&threads[i], NULL, thread_main, (void *) (long) i) != 0)
+      {
+	fprintf (stderr, "Could not create thread %d\n", i);
+	return 1;
+      }
+  for (i = 0; i < NTHREADS; i++)
+    pthread_join (threads[i], NULL);
+
+  printf ("%d songs loaded %d times on %d threads: %d mismatches\n",
+	  nsongs, NROUNDS, NTHREADS, failures);
+
+  for (i = 0; i < nsongs; i++)
+    free (songs[i].data);
+  mid_exit ();
+  remove (PATCH_FILE);
+  remove (CONFIG_FILE);
+  return (failures) ? 1 : 0;
+}
@@ -54,7 +54,7 @@ main (int argc, char *argv[])
 	{
 	  if (++arg >= argc) break;
 	  bits = atoi (argv[arg]);
-	  if (bits != 8 && bits != 16)
+	  if (bits != 8 && bits != 16 && bits != 32)
 	    {
 	      fprintf (stderr, "Invalid sample width\n");
 	      return 1;
@@ -150,7 +150,8 @@ main (int argc, char *argv[])
     }
 
   options.rate = rate;
-  options.format = (bits == 16)? MID_AUDIO_S16LSB : MID_AUDIO_U8;
+  options.format = (bits == 32)? MID_AUDIO_F32 :
+		   (bits == 16)? MID_AUDIO_S16LSB : MID_AUDIO_U8;
   options.channels = channels;
   options.buffer_size = sizeof (buffer) / (bits * channels / 8);
 